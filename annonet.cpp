@@ -14,8 +14,18 @@
 */
 
 #include "annonet.h"
+#include "annonet_image_formats.h"
+#include "annonet_kernels.h"
+#include "annonet_mmap.h"
+#include "annonet_parallel_decode.h"
+#include "annonet_tar.h"
 
 #include <dlib/data_io.h>
+#include <dlib/image_io.h>
+#include <rapidjson/prettywriter.h>
+#include <rapidjson/stringbuffer.h>
+#include <cstring>
+#include <iterator>
 
 // ----------------------------------------------------------------------------------------
 
@@ -38,6 +48,36 @@ inline uint16_t rgba_label_to_index_label(const dlib::rgb_alpha_pixel& rgba_labe
     throw std::runtime_error(error.str());
 }
 
+uint32_t pack_rgba_label(const dlib::rgb_alpha_pixel& rgba_label)
+{
+    static_assert(sizeof(rgba_label) == sizeof(uint32_t), "rgb_alpha_pixel is expected to be tightly packed");
+    uint32_t packed;
+    std::memcpy(&packed, &rgba_label, sizeof(packed));
+    return packed;
+}
+
+rgba_label_decoder::rgba_label_decoder(const std::vector<AnnoClass>& anno_classes)
+    : anno_classes(anno_classes)
+    , colors({ pack_rgba_label(rgba_ignore_label) })
+    , labels_by_color({ dlib::loss_multiclass_log_per_pixel_::label_to_ignore })
+{
+    for (const AnnoClass& anno_class : anno_classes) {
+        colors.push_back(pack_rgba_label(anno_class.rgba_label));
+        labels_by_color.push_back(anno_class.index);
+    }
+}
+
+void rgba_label_decoder::decode_row(const dlib::rgb_alpha_pixel* rgba_labels, long count, uint16_t* labels) const
+{
+    const size_t unknown_color_index = get_kernels().decode_rgba_labels(
+        reinterpret_cast<const uint32_t*>(rgba_labels), count,
+        colors.data(), labels_by_color.data(), colors.size(), labels);
+
+    if (unknown_color_index < static_cast<size_t>(count)) {
+        rgba_label_to_index_label(rgba_labels[unknown_color_index], anno_classes); // throws
+    }
+}
+
 void decode_rgba_label_image(const dlib::matrix<dlib::rgb_alpha_pixel>& rgba_label_image, sample& ground_truth_sample, const std::vector<AnnoClass>& anno_classes)
 {
     const long nr = rgba_label_image.nr();
@@ -46,40 +86,110 @@ void decode_rgba_label_image(const dlib::matrix<dlib::rgb_alpha_pixel>& rgba_lab
     ground_truth_sample.label_image.set_size(nr, nc);
     ground_truth_sample.labeled_points_by_class.clear();
 
+    if (nr == 0 || nc == 0) {
+        return;
+    }
+
+    const rgba_label_decoder decoder(anno_classes);
+
     for (long r = 0; r < nr; ++r) {
+        uint16_t* const label_row = &ground_truth_sample.label_image(r, 0);
+        decoder.decode_row(&rgba_label_image(r, 0), nc, label_row);
+
         for (long c = 0; c < nc; ++c) {
-            const uint16_t label = rgba_label_to_index_label(rgba_label_image(r, c), anno_classes);
+            const uint16_t label = label_row[c];
             if (label != dlib::loss_multiclass_log_per_pixel_::label_to_ignore) {
                 ground_truth_sample.labeled_points_by_class[label].push_back(dlib::point(c, r));
             }
-            ground_truth_sample.label_image(r, c) = label;
         }
     }
 }
 
+bool is_input_image_filename(const std::string& filename)
+{
+    const auto ends_with = [&filename](const std::string& ending) {
+        return filename.size() >= ending.size() && filename.compare(filename.size() - ending.size(), ending.size(), ending) == 0;
+    };
+    if (ends_with("_mask.png")) {
+        return false;
+    }
+    if (ends_with("_result.png")) {
+        return false;
+    }
+    return ends_with(".jpeg")
+        || ends_with(".jpg")
+        || ends_with(".JPG")
+        || ends_with(".png")
+        || ends_with(".PNG")
+        || ends_with(".pgm")
+        || ends_with(".ppm")
+        || ends_with(".qoi");
+}
+
+std::vector<image_filenames> find_image_files_in_tar(
+    const std::string& archive_filename,
+    bool require_ground_truth,
+    bool print_progress
+)
+{
+    const std::shared_ptr<const tar_archive> archive = get_tar_archive(archive_filename);
+
+    std::vector<image_filenames> results;
+
+    size_t added = 0, ignored = 0;
+
+    for (const std::string& member_name : archive->get_member_names()) {
+        if (!is_input_image_filename(member_name)) {
+            continue;
+        }
+
+        image_filenames image_filenames;
+        image_filenames.image_filename = archive_filename + "/" + member_name;
+
+        const bool label_file_exists = archive->contains(member_name + "_mask.png");
+
+        if (label_file_exists) {
+            image_filenames.label_filename = image_filenames.image_filename + "_mask.png";
+        }
+
+        if (label_file_exists || !require_ground_truth) {
+            results.push_back(image_filenames);
+            ++added;
+        }
+        else if (require_ground_truth) {
+            ++ignored;
+        }
+    }
+
+    if (print_progress) {
+        std::cout << "Scanned " << archive_filename << ": " << added << " added, " << ignored << " ignored" << std::endl;
+    }
+
+    return results;
+}
+
 std::vector<image_filenames> find_image_files(
     const std::string& anno_data_folder,
-    bool require_ground_truth
+    bool require_ground_truth,
+    bool print_progress
 )
 {
-    std::cout << std::endl << "Scanning...";
+    if (is_tar_archive(anno_data_folder)) {
+        return find_image_files_in_tar(anno_data_folder, require_ground_truth, print_progress);
+    }
+
+    if (print_progress) {
+        std::cout << std::endl << "Scanning...";
+    }
 
     const std::vector<dlib::file> files = dlib::get_files_in_directory_tree(anno_data_folder,
         [](const dlib::file& name) {
-        if (dlib::match_ending("_mask.png")(name)) {
-            return false;
-        }
-        if (dlib::match_ending("_result.png")(name)) {
-            return false;
-        }
-        return dlib::match_ending(".jpeg")(name)
-            || dlib::match_ending(".jpg")(name)
-            || dlib::match_ending(".JPG")(name)
-            || dlib::match_ending(".png")(name)
-            || dlib::match_ending(".PNG")(name);
+        return is_input_image_filename(name.name());
     });
 
-    std::cout << " found " << files.size() << " candidates" << std::endl;
+    if (print_progress) {
+        std::cout << " found " << files.size() << " candidates" << std::endl;
+    }
 
     std::vector<image_filenames> results;
 
@@ -114,7 +224,7 @@ std::vector<image_filenames> find_image_files(
         }
 
         const auto now = std::chrono::steady_clock::now();
-        if (i == 0 || i == total - 1 || (now - progress_last_printed) > std::chrono::milliseconds(100)) {
+        if (print_progress && (i == 0 || i == total - 1 || (now - progress_last_printed) > std::chrono::milliseconds(100))) {
             std::cout
                 << "\rScanned " << std::fixed << std::setprecision(2)
                 << ((i + 1) * 100.0) / total << " % of " << total << " files: "
@@ -123,11 +233,121 @@ std::vector<image_filenames> find_image_files(
         }
     }
 
-    std::cout << std::endl;
+    if (print_progress) {
+        std::cout << std::endl;
+    }
 
     return results;
 }
 
+std::string read_anno_classes_file(const std::string& folder)
+{
+    if (is_tar_archive(folder)) {
+        const std::shared_ptr<const tar_archive> archive = get_tar_archive(folder);
+        if (archive->contains("anno_classes.json")) {
+            const auto data = archive->get_member_data("anno_classes.json");
+            return std::string(data.first, data.second);
+        }
+    }
+    else {
+        // do not scan subdirectories - the file must be in the root
+        std::ifstream in(folder + "/anno_classes.json", std::ios::binary);
+        if (in) {
+            return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        }
+    }
+
+    std::cout << "Warning: no anno_classes.json file found in " + folder << std::endl;
+    std::cout << " --> Using the default anno classes" << std::endl;
+    return "";
+}
+
+// Only the first few bytes are read, so that a file in a format that dlib has to load
+// anyway is not memory-mapped in vain
+image_format sniff_image_file_format(const std::string& filename)
+{
+    char prefix[16];
+    std::ifstream in(filename, std::ios::binary);
+    in.read(prefix, sizeof(prefix));
+    return detect_image_format(prefix, static_cast<size_t>(in.gcount()));
+}
+
+template <typename image_type>
+void load_image_file(image_type& image, const std::string& filename)
+{
+    std::string archive_filename, member_name;
+    if (split_tar_path(filename, archive_filename, member_name)) {
+        const std::shared_ptr<const tar_archive> archive = get_tar_archive(archive_filename);
+        const auto data = archive->get_member_data(member_name);
+        load_image_from_memory(image, data.first, data.second, filename);
+        return;
+    }
+
+    if (sniff_image_file_format(filename) == image_format::unknown) {
+        dlib::load_image(image, filename); // e.g., BMP or GIF
+        return;
+    }
+
+    // Decode straight from the page cache; raw formats need no other copy at all
+    const memory_mapped_file file(filename);
+    load_image_from_memory(image, file.data(), file.size(), filename);
+}
+
+void get_image_file_dimensions(const std::string& filename, long& width, long& height)
+{
+    std::string archive_filename, member_name;
+    if (split_tar_path(filename, archive_filename, member_name)) {
+        const auto data = get_tar_archive(archive_filename)->get_member_data(member_name);
+        if (read_image_dimensions(data.first, data.second, filename, width, height)) {
+            return;
+        }
+    }
+    else {
+        const memory_mapped_file file(filename);
+        if (read_image_dimensions(file.data(), file.size(), filename, width, height)) {
+            return;
+        }
+    }
+
+    NetPimpl::input_type image;
+    load_image_file(image, filename);
+    width = image.nc();
+    height = image.nr();
+}
+
+template <typename image_type>
+void load_image_from_memory(image_type& image, const char* data, size_t size, const std::string& name)
+{
+    const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(data);
+
+    switch (detect_image_format(data, size)) {
+    case image_format::png:
+        if (!load_banded_png_in_parallel(image, data, size, name)) {
+            dlib::load_png(image, bytes, size);
+        }
+        break;
+    case image_format::jpeg:
+        if (!load_jpeg_in_parallel(image, data, size, name)) {
+            dlib::load_jpeg(image, bytes, size);
+        }
+        break;
+    case image_format::pnm:
+        load_pnm(image, data, size, name);
+        break;
+    case image_format::qoi:
+        load_qoi(image, data, size, name);
+        break;
+    default:
+        throw std::runtime_error("Unsupported image format: " + name);
+    }
+}
+
+// explicit instantiations for the input and label images
+template void load_image_file<NetPimpl::input_type>(NetPimpl::input_type& image, const std::string& filename);
+template void load_image_file<dlib::matrix<dlib::rgb_alpha_pixel>>(dlib::matrix<dlib::rgb_alpha_pixel>& image, const std::string& filename);
+template void load_image_from_memory<NetPimpl::input_type>(NetPimpl::input_type& image, const char* data, size_t size, const std::string& name);
+template void load_image_from_memory<dlib::matrix<dlib::rgb_alpha_pixel>>(dlib::matrix<dlib::rgb_alpha_pixel>& image, const char* data, size_t size, const std::string& name);
+
 template <typename image_type>
 void resize_label_image(image_type& label_image, int target_width, int target_height)
 {
@@ -137,8 +357,9 @@ void resize_label_image(image_type& label_image, int target_width, int target_he
     std::swap(label_image, temp);
 }
 
-// explicit instantiation for dlib::matrix<uint16_t>
+// explicit instantiations for dlib::matrix<uint16_t>, and for coverage masks
 template void resize_label_image<dlib::matrix<uint16_t>>(dlib::matrix<uint16_t>& label_image, int target_width, int target_height);
+template void resize_label_image<dlib::matrix<unsigned char>>(dlib::matrix<unsigned char>& label_image, int target_width, int target_height);
 
 sample read_sample(const image_filenames& image_filenames, const std::vector<AnnoClass>& anno_classes, bool require_ground_truth, double downscaling_factor)
 {
@@ -147,13 +368,13 @@ sample read_sample(const image_filenames& image_filenames, const std::vector<Ann
 
     try {
         dlib::matrix<dlib::rgb_alpha_pixel> rgba_label_image;
-        dlib::load_image(sample.input_image, image_filenames.image_filename);
+        load_image_file(sample.input_image, image_filenames.image_filename);
         sample.original_width = sample.input_image.nc();
         sample.original_height = sample.input_image.nr();
         dlib::resize_image(1.0 / downscaling_factor, sample.input_image);
 
         if (!image_filenames.label_filename.empty()) {
-            dlib::load_image(rgba_label_image, image_filenames.label_filename);
+            load_image_file(rgba_label_image, image_filenames.label_filename);
 
             if (rgba_label_image.nr() != sample.original_height || rgba_label_image.nc() != sample.original_width) {
                 sample.error = "Label image size mismatch";
@@ -184,4 +405,23 @@ void set_low_priority()
 #else // WIN32
     // TODO
 #endif // WIN32
-}
\ No newline at end of file
+}
+
+void write_benchmark_results(const std::string& filename, const std::vector<std::pair<std::string, double>>& results)
+{
+    rapidjson::StringBuffer buffer;
+    rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(buffer);
+
+    writer.StartObject();
+    for (const auto& result : results) {
+        writer.Key(result.first.c_str());
+        writer.Double(result.second);
+    }
+    writer.EndObject();
+
+    std::ofstream out(filename, std::ios::binary);
+    out << buffer.GetString() << std::endl;
+    if (!out) {
+        throw std::runtime_error("Unable to write benchmark results to " + filename);
+    }
+}
@@ -59,13 +59,46 @@ struct sample
 
 inline uint16_t rgba_label_to_index_label(const dlib::rgb_alpha_pixel& rgba_label, const std::vector<AnnoClass>& anno_classes);
 
+uint32_t pack_rgba_label(const dlib::rgb_alpha_pixel& rgba_label);
+
+// Maps the colors of a label image to class indexes, a row at a time
+class rgba_label_decoder
+{
+public:
+    rgba_label_decoder(const std::vector<AnnoClass>& anno_classes);
+
+    // Throws if there are unknown colors
+    void decode_row(const dlib::rgb_alpha_pixel* rgba_labels, long count, uint16_t* labels) const;
+
+private:
+    const std::vector<AnnoClass>& anno_classes;
+    std::vector<uint32_t> colors;
+    std::vector<uint16_t> labels_by_color;
+};
+
 void decode_rgba_label_image(const dlib::matrix<dlib::rgb_alpha_pixel>& rgba_label_image, sample& ground_truth_sample, const std::vector<AnnoClass>& anno_classes);
 
+// The folder can also be an uncompressed tar archive
 std::vector<image_filenames> find_image_files(
     const std::string& anno_data_folder,
-    bool require_ground_truth
+    bool require_ground_truth,
+    bool print_progress = true
 );
 
+// Returns an empty string (meaning the default classes) if the folder has no anno_classes.json
+std::string read_anno_classes_file(const std::string& folder);
+
+// Like dlib::load_image, but can also read files inside tar archives; see annonet_tar.h
+template <typename image_type>
+void load_image_file(image_type& image, const std::string& filename);
+
+// Reads only the headers, if the format is known; otherwise, decodes the whole image
+void get_image_file_dimensions(const std::string& filename, long& width, long& height);
+
+// Picks the decoder based on the header of the data
+template <typename image_type>
+void load_image_from_memory(image_type& image, const char* data, size_t size, const std::string& name);
+
 template <typename image_type>
 void resize_label_image(image_type& label_image, int target_width, int target_height);
 
@@ -73,4 +106,7 @@ sample read_sample(const image_filenames& image_filenames, const std::vector<Ann
 
 void set_low_priority();
 
+// Writes benchmark results as a flat JSON object, for the regression harness (annonet_bench)
+void write_benchmark_results(const std::string& filename, const std::vector<std::pair<std::string, double>>& results);
+
 #endif // ANNONET_H
\ No newline at end of file
@@ -0,0 +1,480 @@
+/*
+    This program is a performance regression harness for annonet.
+
+    It runs a set of micro-benchmarks in-process (mask decoding, weighting,
+    tiled inference with the stub net), and optionally the end-to-end
+    benchmarks of annonet_train (--benchmark-loader) and annonet_infer
+    (--net-backend stub) on a synthetic dataset generated by annonet_generate.
+
+    Instructions:
+    1. Build annonet_bench, and optionally also annonet_generate, annonet_train
+       and annonet_infer.
+    2. Record a baseline on the reference machine:
+       ./annonet_bench --output baseline.json
+    3. Compare against it later:
+       ./annonet_bench --output results.json --baseline baseline.json
+
+    Each benchmark is repeated several times. A regression is reported when
+    the median gets worse than the baseline median by more than both the
+    relative tolerance and the observed noise (median absolute deviations).
+    The exit code is non-zero if there are any regressions.
+*/
+
+#include "annonet.h"
+#include "annonet_infer.h"
+#include "annonet_kernels.h"
+#include "annonet_stub_net.h"
+#include "annonet_train.h"
+
+#include "cxxopts/include/cxxopts.hpp"
+#include <rapidjson/document.h>
+#include <rapidjson/prettywriter.h>
+#include <rapidjson/stringbuffer.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <map>
+
+using namespace std;
+using namespace dlib;
+
+// ----------------------------------------------------------------------------------------
+
+struct benchmark_result
+{
+    std::string unit;
+    bool higher_is_better = true;
+    std::vector<double> values;
+    double median = 0.0;
+    double median_absolute_deviation = 0.0;
+};
+
+typedef std::map<std::string, benchmark_result> benchmark_results;
+
+// All the throughput figures (units like "Mpix/s" or "decodes/s") are better when higher;
+// anything else (durations) is better when lower
+bool is_higher_better(const std::string& unit)
+{
+    return unit.size() >= 2 && unit.compare(unit.size() - 2, 2, "/s") == 0;
+}
+
+double get_median(std::vector<double> values)
+{
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    const size_t n = values.size();
+    return n % 2 ? values[n / 2] : 0.5 * (values[n / 2 - 1] + values[n / 2]);
+}
+
+void update_statistics(benchmark_result& result)
+{
+    result.median = get_median(result.values);
+    std::vector<double> deviations;
+    for (double value : result.values) {
+        deviations.push_back(std::fabs(value - result.median));
+    }
+    result.median_absolute_deviation = get_median(deviations);
+}
+
+// ----------------------------------------------------------------------------------------
+
+void write_results(const benchmark_results& results, const std::string& filename)
+{
+    rapidjson::StringBuffer buffer;
+    rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(buffer);
+
+    writer.StartObject();
+    writer.Key("benchmarks");
+    writer.StartObject();
+    for (const auto& item : results) {
+        const benchmark_result& result = item.second;
+        writer.Key(item.first.c_str());
+        writer.StartObject();
+        writer.Key("unit");
+        writer.String(result.unit.c_str());
+        writer.Key("higher_is_better");
+        writer.Bool(result.higher_is_better);
+        writer.Key("median");
+        writer.Double(result.median);
+        writer.Key("median_absolute_deviation");
+        writer.Double(result.median_absolute_deviation);
+        writer.Key("values");
+        writer.StartArray();
+        for (double value : result.values) {
+            writer.Double(value);
+        }
+        writer.EndArray();
+        writer.EndObject();
+    }
+    writer.EndObject();
+    writer.EndObject();
+
+    std::ofstream out(filename, std::ios::binary);
+    out << buffer.GetString() << std::endl;
+    if (!out) {
+        throw std::runtime_error("Unable to write " + filename);
+    }
+}
+
+rapidjson::Document read_json_file(const std::string& filename)
+{
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Unable to read " + filename);
+    }
+    const std::string json((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    rapidjson::Document doc;
+    doc.Parse(json.c_str());
+    if (doc.HasParseError() || !doc.IsObject()) {
+        throw std::runtime_error("Error parsing json in " + filename);
+    }
+    return doc;
+}
+
+benchmark_results read_results(const std::string& filename)
+{
+    const rapidjson::Document doc = read_json_file(filename);
+
+    const auto benchmarks_member = doc.FindMember("benchmarks");
+    if (benchmarks_member == doc.MemberEnd() || !benchmarks_member->value.IsObject()) {
+        throw std::runtime_error("Unexpected content in " + filename + " - there should be a benchmarks object");
+    }
+
+    benchmark_results results;
+    for (auto i = benchmarks_member->value.MemberBegin(); i != benchmarks_member->value.MemberEnd(); ++i) {
+        benchmark_result& result = results[i->name.GetString()];
+        const auto& value = i->value;
+        result.unit = value["unit"].GetString();
+        // derived from the unit, so that a stale flag in an older baseline cannot turn a
+        // speed-up into a regression
+        result.higher_is_better = is_higher_better(result.unit);
+        result.median = value["median"].GetDouble();
+        result.median_absolute_deviation = value["median_absolute_deviation"].GetDouble();
+    }
+    return results;
+}
+
+// ----------------------------------------------------------------------------------------
+
+// Runs the function repeatedly for at least min_seconds, and returns work units per second
+double measure_throughput(const std::function<double()>& run_once, double min_seconds)
+{
+    run_once(); // warm-up
+
+    double work_done = 0.0;
+    const auto t0 = std::chrono::steady_clock::now();
+    double elapsed_seconds = 0.0;
+    do {
+        work_done += run_once();
+        elapsed_seconds = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - t0).count();
+    } while (elapsed_seconds < min_seconds);
+
+    return work_done / elapsed_seconds;
+}
+
+void make_synthetic_rgba_label_image(matrix<rgb_alpha_pixel>& rgba_label_image, const std::vector<AnnoClass>& anno_classes, long nr, long nc)
+{
+    rgba_label_image.set_size(nr, nc);
+    for (long r = 0; r < nr; ++r) {
+        for (long c = 0; c < nc; ++c) {
+            // Mostly clean, with some defect rectangles and some ignored areas
+            const long cell = (r / 64) * 1000 + (c / 64);
+            const uint32_t hash = static_cast<uint32_t>(cell * 2654435761u);
+            if (hash % 10 == 0) {
+                rgba_label_image(r, c) = rgba_ignore_label;
+            }
+            else if (hash % 7 == 0) {
+                rgba_label_image(r, c) = anno_classes[1 + hash % (anno_classes.size() - 1)].rgba_label;
+            }
+            else {
+                rgba_label_image(r, c) = anno_classes[0].rgba_label;
+            }
+        }
+    }
+}
+
+void run_micro_benchmarks(benchmark_results& results, size_t repetitions, double min_seconds, const std::string& filter)
+{
+    const std::vector<AnnoClass> anno_classes = parse_anno_classes("");
+
+    const auto run = [&](const std::string& name, const std::string& unit, const std::function<double()>& run_once) {
+        if (name.find(filter) == std::string::npos) {
+            return;
+        }
+        std::cout << "Running " << name << "..." << std::flush;
+        benchmark_result& result = results[name];
+        result.unit = unit;
+        result.higher_is_better = is_higher_better(unit);
+        for (size_t i = 0; i < repetitions; ++i) {
+            result.values.push_back(measure_throughput(run_once, min_seconds));
+        }
+        update_statistics(result);
+        std::cout << " " << result.median << " " << unit << std::endl;
+    };
+
+    {
+        matrix<rgb_alpha_pixel> rgba_label_image;
+        make_synthetic_rgba_label_image(rgba_label_image, anno_classes, 2048, 2048);
+        sample sample;
+        run("micro/decode_rgba_label_image", "Mpix/s", [&]() {
+            decode_rgba_label_image(rgba_label_image, sample, anno_classes);
+            return rgba_label_image.size() / 1e6;
+        });
+    }
+
+    {
+        matrix<rgb_alpha_pixel> rgba_label_image;
+        make_synthetic_rgba_label_image(rgba_label_image, anno_classes, 512, 512);
+        sample sample;
+        decode_rgba_label_image(rgba_label_image, sample, anno_classes);
+        NetPimpl::training_label_type weighted_label_image;
+        run("micro/set_weights", "Mpix/s", [&]() {
+            set_weights(sample.label_image, weighted_label_image, 0.5, 0.5);
+            return sample.label_image.size() / 1e6;
+        });
+    }
+
+    {
+        NetPimpl::input_type input_image(2048, 2048);
+        dlib::rand rnd("annonet_bench");
+        for (long r = 0; r < input_image.nr(); ++r) {
+            for (long c = 0; c < input_image.nc(); ++c) {
+                dlib::assign_pixel(input_image(r, c), static_cast<unsigned char>(rnd.get_random_8bit_number()));
+            }
+        }
+        annonet_stub_net stub_net(static_cast<uint16_t>(anno_classes.size()));
+        const std::vector<double> gains(anno_classes.size(), 0.0);
+        const std::vector<double> detection_levels = { 0.0, 1.0, 1.0 };
+        const int min_input_dimension = NetPimpl::TrainingNet::GetRequiredInputDimension();
+        tiling::parameters tiling_parameters;
+        tiling_parameters.max_tile_width = 512;
+        tiling_parameters.max_tile_height = 512;
+        tiling_parameters.overlap_x = min_input_dimension;
+        tiling_parameters.overlap_y = min_input_dimension;
+        annonet_infer_temp temp;
+        matrix<uint16_t> result_image;
+        run("micro/annonet_infer_stub", "Mpix/s", [&]() {
+            annonet_infer(stub_net, input_image, result_image, gains, std::vector<double>(), tiling_parameters, temp);
+            return input_image.size() / 1e6;
+        });
+        run("micro/annonet_infer_stub_detection", "Mpix/s", [&]() {
+            annonet_infer(stub_net, input_image, result_image, gains, detection_levels, tiling_parameters, temp);
+            return input_image.size() / 1e6;
+        });
+        run("micro/annonet_infer_stub_fixed_shape", "Mpix/s", [&]() {
+            annonet_infer(stub_net, input_image, result_image, gains, std::vector<double>(), tiling_parameters, temp, true);
+            return input_image.size() / 1e6;
+        });
+        // the pipeline (and its threads) is set up once, as it would be in an application
+        annonet_async_infer<annonet_stub_net> async_infer(stub_net, 2, gains, std::vector<double>(), tiling_parameters);
+        run("micro/annonet_async_infer_stub", "Mpix/s", [&]() {
+            const size_t image_count = 4;
+            std::vector<std::future<matrix<uint16_t>>> results;
+            for (size_t i = 0; i < image_count; ++i) {
+                results.push_back(async_infer.submit(input_image));
+            }
+            for (auto& result : results) {
+                result.get();
+            }
+            return image_count * input_image.size() / 1e6;
+        });
+    }
+}
+
+// ----------------------------------------------------------------------------------------
+
+std::string quote(const std::string& argument)
+{
+    return "\"" + argument + "\"";
+}
+
+void run_command(const std::string& command)
+{
+    std::cout << "Executing: " << command << std::endl;
+    const int result = std::system(command.c_str());
+    if (result != 0) {
+        std::ostringstream error;
+        error << "Command failed with exit code " << result << ": " << command;
+        throw std::runtime_error(error.str());
+    }
+}
+
+void run_end_to_end_benchmarks(benchmark_results& results, const cxxopts::Options& options, size_t repetitions, const std::string& filter)
+{
+    const std::string dataset_directory = options["dataset-directory"].as<std::string>();
+    const std::string generate_executable = options["generate-executable"].as<std::string>();
+    const std::string train_executable = options["train-executable"].as<std::string>();
+    const std::string infer_executable = options["infer-executable"].as<std::string>();
+    const std::string temporary_result_file = "annonet_bench_temporary_result.json";
+    const std::string isa_argument = options.count("force-isa") ? " --force-isa " + options["force-isa"].as<std::string>() : "";
+
+    if (!std::ifstream(dataset_directory + "/anno_classes.json")) {
+        run_command(quote(generate_executable) + " " + quote(dataset_directory) + " --seed annonet_bench --image-count 200 --min-width 512 --max-width 1536 --min-height 512 --max-height 1536");
+    }
+
+    const auto run = [&](const std::string& prefix, const std::string& command, const std::map<std::string, std::string>& units) {
+        if (prefix.find(filter) == std::string::npos) {
+            return;
+        }
+        for (size_t i = 0; i < repetitions; ++i) {
+            std::remove(temporary_result_file.c_str());
+            run_command(command + isa_argument + " --benchmark-result-file " + quote(temporary_result_file));
+            const rapidjson::Document doc = read_json_file(temporary_result_file);
+            for (const auto& unit : units) {
+                const auto member = doc.FindMember(unit.first.c_str());
+                if (member == doc.MemberEnd()) {
+                    throw std::runtime_error("No " + unit.first + " in the results of: " + command);
+                }
+                benchmark_result& result = results[prefix + "/" + unit.first];
+                result.unit = unit.second;
+                result.higher_is_better = is_higher_better(unit.second);
+                result.values.push_back(member->value.GetDouble());
+            }
+        }
+        for (const auto& unit : units) {
+            update_statistics(results[prefix + "/" + unit.first]);
+        }
+        std::remove(temporary_result_file.c_str());
+    };
+
+    if (!train_executable.empty()) {
+        std::ostringstream duration;
+        duration << options["loader-benchmark-duration"].as<double>();
+        run("train_loader",
+            quote(train_executable) + " " + quote(dataset_directory) + " --benchmark-loader --benchmark-duration " + duration.str(),
+            { { "crops_per_second", "crops/s" }, { "decodes_per_second", "decodes/s" } });
+    }
+
+    if (!infer_executable.empty()) {
+        run("infer_stub",
+            quote(infer_executable) + " " + quote(dataset_directory) + " --net-backend stub",
+            { { "images_per_second", "images/s" }, { "megapixels_per_second", "Mpix/s" } });
+    }
+}
+
+// ----------------------------------------------------------------------------------------
+
+// Returns the number of regressions
+size_t compare_to_baseline(const benchmark_results& results, const benchmark_results& baseline, double tolerance, double noise_multiplier)
+{
+    // scale factor to make the MAD a consistent estimator of the standard deviation
+    const double mad_to_stddev = 1.4826;
+
+    size_t regression_count = 0;
+
+    std::cout << std::endl << std::left << std::setw(48) << "benchmark" << std::right
+        << std::setw(14) << "baseline" << std::setw(14) << "current" << std::setw(10) << "change" << "  verdict" << std::endl;
+
+    for (const auto& item : results) {
+        const auto i = baseline.find(item.first);
+        if (i == baseline.end()) {
+            std::cout << std::left << std::setw(48) << item.first << std::right << std::setw(14) << "-"
+                << std::setw(14) << std::fixed << std::setprecision(2) << item.second.median << std::setw(10) << "-" << "  new" << std::endl;
+            continue;
+        }
+
+        const benchmark_result& current = item.second;
+        const benchmark_result& reference = i->second;
+
+        const double noise = noise_multiplier * mad_to_stddev * (current.median_absolute_deviation + reference.median_absolute_deviation);
+        const double allowed_change = std::max(tolerance * std::fabs(reference.median), noise);
+        const double change = current.median - reference.median;
+        const double worsening = reference.higher_is_better ? -change : change;
+        const bool regression = worsening > allowed_change;
+        const bool improvement = -worsening > allowed_change;
+
+        if (regression) {
+            ++regression_count;
+        }
+
+        std::cout << std::left << std::setw(48) << item.first << std::right
+            << std::setw(14) << std::fixed << std::setprecision(2) << reference.median
+            << std::setw(14) << current.median
+            << std::setw(9) << (reference.median != 0.0 ? 100.0 * change / reference.median : 0.0) << "%"
+            << "  " << (regression ? "REGRESSION" : improvement ? "improved" : "ok") << std::endl;
+    }
+
+    for (const auto& item : baseline) {
+        if (results.find(item.first) == results.end()) {
+            std::cout << std::left << std::setw(48) << item.first << std::right << std::setw(14) << std::fixed << std::setprecision(2) << item.second.median
+                << std::setw(14) << "-" << std::setw(10) << "-" << "  not run" << std::endl;
+        }
+    }
+
+    return regression_count;
+}
+
+// ----------------------------------------------------------------------------------------
+
+int main(int argc, char** argv) try
+{
+    cxxopts::Options options("annonet_bench", "Run the annonet benchmarks, and compare the results against a baseline");
+
+    options.add_options()
+        ("o,output", "Write the results to this JSON file", cxxopts::value<std::string>()->default_value("annonet_bench_results.json"))
+        ("b,baseline", "Compare the results against this JSON file", cxxopts::value<std::string>())
+        ("r,repetitions", "Number of repetitions of each benchmark", cxxopts::value<size_t>()->default_value("5"))
+        ("min-time", "Minimum duration of each micro-benchmark repetition, in seconds", cxxopts::value<double>()->default_value("1.0"))
+        ("tolerance", "Relative change that is never considered a regression", cxxopts::value<double>()->default_value("0.05"))
+        ("noise-multiplier", "How many (estimated) standard deviations of noise are never considered a regression", cxxopts::value<double>()->default_value("3.0"))
+        ("filter", "Only run the benchmarks whose name contains this string", cxxopts::value<std::string>()->default_value(""))
+        ("skip-end-to-end", "Only run the micro-benchmarks")
+        ("dataset-directory", "Directory of the synthetic dataset; generated if it does not exist yet", cxxopts::value<std::string>()->default_value("annonet_bench_dataset"))
+        ("generate-executable", "The annonet_generate executable", cxxopts::value<std::string>()->default_value("annonet_generate_cpu"))
+        ("train-executable", "The annonet_train executable (empty to skip)", cxxopts::value<std::string>()->default_value("annonet_train_cpu"))
+        ("infer-executable", "The annonet_infer executable (empty to skip)", cxxopts::value<std::string>()->default_value("annonet_infer_cpu"))
+        ("loader-benchmark-duration", "Duration of each data loader benchmark run, in seconds", cxxopts::value<double>()->default_value("10.0"))
+        ("force-isa", "Use the per-pixel kernels of this instruction set level: generic, sse41, avx2, or avx512 (default: the best supported)", cxxopts::value<std::string>())
+        ;
+
+    try {
+        options.parse(argc, argv);
+
+        if (options.count("force-isa") == 1) {
+            select_kernels(parse_isa_level(options["force-isa"].as<std::string>()));
+        }
+        std::cout << "Instruction set level = " << to_string(get_kernels().isa) << std::endl;
+    }
+    catch (std::exception& e) {
+        cerr << e.what() << std::endl;
+        cerr << std::endl;
+        cerr << options.help() << std::endl;
+        return 2;
+    }
+
+    const size_t repetitions = std::max(static_cast<size_t>(1), options["repetitions"].as<size_t>());
+    const std::string filter = options["filter"].as<std::string>();
+
+    benchmark_results results;
+
+    run_micro_benchmarks(results, repetitions, options["min-time"].as<double>(), filter);
+
+    if (options.count("skip-end-to-end") == 0) {
+        run_end_to_end_benchmarks(results, options, repetitions, filter);
+    }
+
+    write_results(results, options["output"].as<std::string>());
+    std::cout << "Results written to " << options["output"].as<std::string>() << std::endl;
+
+    if (options.count("baseline")) {
+        const benchmark_results baseline = read_results(options["baseline"].as<std::string>());
+        const size_t regression_count = compare_to_baseline(results, baseline, options["tolerance"].as<double>(), options["noise-multiplier"].as<double>());
+        if (regression_count > 0) {
+            std::cout << std::endl << regression_count << " regression(s) found!" << std::endl;
+            return 1;
+        }
+        std::cout << std::endl << "No regressions found." << std::endl;
+    }
+}
+catch(std::exception& e)
+{
+    cout << e.what() << endl;
+    return 1;
+}
@@ -0,0 +1,317 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+*/
+
+#include "annonet_class_index.h"
+#include "annonet_tar.h"
+
+#include <dlib/serialize.h>
+#include <dlib/threads.h>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+namespace {
+    const std::string manifest_magic = "annoclassindex";
+    const int manifest_version = 2;
+
+    void serialize_statistics(const image_class_statistics& statistics, std::ostream& out)
+    {
+        dlib::serialize(statistics.label_filename, out);
+        dlib::serialize(statistics.label_file_size, out);
+        dlib::serialize(statistics.label_file_modification_time, out);
+        dlib::serialize(statistics.image_file_size, out);
+        dlib::serialize(statistics.image_file_modification_time, out);
+        dlib::serialize(statistics.error, out);
+        dlib::serialize(statistics.classes.size(), out);
+        for (const class_statistics& c : statistics.classes) {
+            dlib::serialize(c.class_index, out);
+            dlib::serialize(c.pixel_count, out);
+            dlib::serialize(c.bounding_box, out);
+        }
+    }
+
+    void deserialize_statistics(image_class_statistics& statistics, std::istream& in)
+    {
+        dlib::deserialize(statistics.label_filename, in);
+        dlib::deserialize(statistics.label_file_size, in);
+        dlib::deserialize(statistics.label_file_modification_time, in);
+        dlib::deserialize(statistics.image_file_size, in);
+        dlib::deserialize(statistics.image_file_modification_time, in);
+        dlib::deserialize(statistics.error, in);
+        size_t class_count = 0;
+        dlib::deserialize(class_count, in);
+        statistics.classes.resize(class_count);
+        for (class_statistics& c : statistics.classes) {
+            dlib::deserialize(c.class_index, in);
+            dlib::deserialize(c.pixel_count, in);
+            dlib::deserialize(c.bounding_box, in);
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------
+
+image_class_statistics compute_image_class_statistics(const image_filenames& image_filenames, const std::vector<AnnoClass>& anno_classes)
+{
+    image_class_statistics statistics;
+    statistics.label_filename = image_filenames.label_filename;
+
+    try {
+        get_file_stamp(image_filenames.label_filename, statistics.label_file_size, statistics.label_file_modification_time);
+        get_file_stamp(image_filenames.image_filename, statistics.image_file_size, statistics.image_file_modification_time);
+
+        long width = 0, height = 0;
+        get_image_file_dimensions(image_filenames.image_filename, width, height);
+
+        dlib::matrix<dlib::rgb_alpha_pixel> rgba_label_image;
+        load_image_file(rgba_label_image, image_filenames.label_filename);
+
+        const long nr = rgba_label_image.nr();
+        const long nc = rgba_label_image.nc();
+
+        if (nr != height || nc != width) {
+            throw std::runtime_error("Label image size mismatch");
+        }
+
+        uint16_t max_class_index = 0;
+        for (const AnnoClass& anno_class : anno_classes) {
+            max_class_index = std::max(max_class_index, anno_class.index);
+        }
+
+        std::vector<class_statistics> by_class(max_class_index + 1);
+        std::vector<uint16_t> labels(nc);
+
+        const rgba_label_decoder decoder(anno_classes);
+
+        for (long r = 0; r < nr; ++r) {
+            decoder.decode_row(&rgba_label_image(r, 0), nc, labels.data());
+
+            for (long c = 0; c < nc; ++c) {
+                const uint16_t label = labels[c];
+                if (label < by_class.size()) {
+                    class_statistics& s = by_class[label];
+                    if (s.pixel_count++ == 0) {
+                        s.bounding_box = dlib::rectangle(c, r, c, r);
+                    }
+                    else {
+                        // the rows come in order, so the top is already known
+                        s.bounding_box.left() = std::min(s.bounding_box.left(), c);
+                        s.bounding_box.right() = std::max(s.bounding_box.right(), c);
+                        s.bounding_box.bottom() = r;
+                    }
+                }
+            }
+        }
+
+        for (size_t i = 0; i < by_class.size(); ++i) {
+            if (by_class[i].pixel_count > 0) {
+                by_class[i].class_index = static_cast<uint16_t>(i);
+                statistics.classes.push_back(by_class[i]);
+            }
+        }
+    }
+    catch (std::exception& e) {
+        statistics.error = e.what();
+        statistics.classes.clear();
+    }
+
+    return statistics;
+}
+
+// ----------------------------------------------------------------------------------------
+
+dataset_class_index::dataset_class_index(
+    const std::vector<image_filenames>& image_files,
+    const std::vector<AnnoClass>& anno_classes,
+    const std::string& classes_key,
+    const std::string& manifest_filename,
+    unsigned int thread_count
+)
+{
+    std::unordered_map<std::string, image_class_statistics> cached;
+    load_manifest(manifest_filename, classes_key, cached);
+
+    statistics.resize(image_files.size());
+
+    std::vector<size_t> to_compute;
+
+    for (size_t i = 0; i < image_files.size(); ++i) {
+        const std::string& label_filename = image_files[i].label_filename;
+        const auto j = cached.find(label_filename);
+        if (j != cached.end()) {
+            uint64_t label_size = 0, image_size = 0;
+            int64_t label_modification_time = 0, image_modification_time = 0;
+            try {
+                get_file_stamp(label_filename, label_size, label_modification_time);
+                get_file_stamp(image_files[i].image_filename, image_size, image_modification_time);
+            }
+            catch (std::exception&) {
+                // just compute again, and report the error then
+            }
+            if (label_size == j->second.label_file_size && label_modification_time == j->second.label_file_modification_time
+                && image_size == j->second.image_file_size && image_modification_time == j->second.image_file_modification_time) {
+                statistics[i] = std::move(j->second);
+                continue;
+            }
+        }
+        to_compute.push_back(i);
+    }
+
+    if (!to_compute.empty()) {
+        std::cout << "Validating and indexing " << to_compute.size() << " images..." << std::endl;
+
+        dlib::parallel_for(std::max(1U, thread_count), 0, to_compute.size(), [&](long i) {
+            const size_t image_index = to_compute[i];
+            statistics[image_index] = compute_image_class_statistics(image_files[image_index], anno_classes);
+        });
+
+        save_manifest(manifest_filename, classes_key);
+    }
+
+    for (size_t i = 0; i < statistics.size(); ++i) {
+        for (const class_statistics& c : statistics[i].classes) {
+            images_by_class[c.class_index].push_back(i);
+        }
+    }
+}
+
+uint64_t dataset_class_index::get_pixel_count(uint16_t class_index) const
+{
+    uint64_t pixel_count = 0;
+    const auto i = images_by_class.find(class_index);
+    if (i != images_by_class.end()) {
+        for (const size_t image_index : i->second) {
+            for (const class_statistics& c : statistics[image_index].classes) {
+                if (c.class_index == class_index) {
+                    pixel_count += c.pixel_count;
+                }
+            }
+        }
+    }
+    return pixel_count;
+}
+
+std::vector<size_t> dataset_class_index::get_invalid_images() const
+{
+    std::vector<size_t> invalid_images;
+    for (size_t i = 0; i < statistics.size(); ++i) {
+        if (!statistics[i].error.empty()) {
+            invalid_images.push_back(i);
+        }
+    }
+    return invalid_images;
+}
+
+bool dataset_class_index::load_manifest(const std::string& manifest_filename, const std::string& classes_key, std::unordered_map<std::string, image_class_statistics>& cached) const
+{
+    std::ifstream in(manifest_filename, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+
+    try {
+        std::string magic, manifest_classes_key;
+        int version = 0;
+        dlib::deserialize(magic, in);
+        dlib::deserialize(version, in);
+        if (magic != manifest_magic || version != manifest_version) {
+            return false;
+        }
+
+        // if the classes have changed, the colors may mean something else now
+        dlib::deserialize(manifest_classes_key, in);
+        if (manifest_classes_key != classes_key) {
+            return false;
+        }
+
+        size_t count = 0;
+        dlib::deserialize(count, in);
+        for (size_t i = 0; i < count; ++i) {
+            image_class_statistics statistics;
+            deserialize_statistics(statistics, in);
+            cached[statistics.label_filename] = std::move(statistics);
+        }
+        return true;
+    }
+    catch (dlib::serialization_error&) {
+        cached.clear();
+        return false;
+    }
+}
+
+void dataset_class_index::save_manifest(const std::string& manifest_filename, const std::string& classes_key) const
+{
+    // Write to a temporary file first, so that concurrent readers never see a partial manifest
+    const std::string temporary_filename = manifest_filename + ".tmp";
+
+    {
+        std::ofstream out(temporary_filename, std::ios::binary);
+        dlib::serialize(manifest_magic, out);
+        dlib::serialize(manifest_version, out);
+        dlib::serialize(classes_key, out);
+        dlib::serialize(statistics.size(), out);
+        for (const image_class_statistics& s : statistics) {
+            serialize_statistics(s, out);
+        }
+
+        if (!out) {
+            // not fatal: the index will just be computed again the next time
+            std::cerr << "Warning: unable to write " << manifest_filename << std::endl;
+            out.close();
+            std::remove(temporary_filename.c_str());
+            return;
+        }
+    }
+
+    std::remove(manifest_filename.c_str());
+    std::rename(temporary_filename.c_str(), manifest_filename.c_str());
+}
+
+std::string get_class_index_manifest_filename(const std::string& anno_data_folder)
+{
+    std::string path = anno_data_folder;
+    while (path.size() > 1 && (path.back() == '/' || path.back() == '\\')) {
+        path.pop_back();
+    }
+    if (is_tar_archive(path)) {
+        return path + ".annoclasses";
+    }
+    return path + "/annonet.annoclasses";
+}
+
+// ----------------------------------------------------------------------------------------
+
+class_stratified_sampler::class_stratified_sampler(const dataset_class_index& index, const std::vector<uint16_t>& classes_to_ignore)
+{
+    for (const auto& i : index.get_images_by_class()) {
+        if (std::find(classes_to_ignore.begin(), classes_to_ignore.end(), i.first) == classes_to_ignore.end()) {
+            classes.push_back(i.first);
+            images_by_class.push_back(&i.second);
+        }
+    }
+
+    if (classes.empty()) {
+        throw std::runtime_error("No labeled classes to sample from");
+    }
+}
+
+size_t class_stratified_sampler::get(dlib::rand& rnd, uint16_t& class_index) const
+{
+    const size_t i = rnd.get_random_32bit_number() % classes.size();
+    const std::vector<size_t>& images = *images_by_class[i];
+    class_index = classes[i];
+    return images[rnd.get_random_32bit_number() % images.size()];
+}
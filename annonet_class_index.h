@@ -0,0 +1,120 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+
+    The class index records, for each image of a dataset, which classes its
+    labels contain, how many pixels of each, and where. It lets the training
+    sampler pick a class first and then an image that contains it, so that
+    rare classes get their share of the crops, and so that images that
+    aren't needed are never loaded at all.
+
+    Computing the index means decoding every label image once, so it is
+    cached in a manifest file in the dataset directory (annonet.annoclasses);
+    only new or modified label images are decoded again.
+
+    As every label image is decoded anyway, the index doubles as a
+    validation of the dataset: an image whose label image has unknown colors
+    or the wrong size, or which can't be read at all, gets an error instead
+    of statistics. The verdicts are cached along with the statistics.
+*/
+
+#ifndef ANNONET_CLASS_INDEX_H
+#define ANNONET_CLASS_INDEX_H
+
+#include "annonet.h"
+
+#include <map>
+
+// ----------------------------------------------------------------------------------------
+
+struct class_statistics
+{
+    uint16_t class_index = 0;
+    uint64_t pixel_count = 0;
+    dlib::rectangle bounding_box; // in the full-resolution label image
+};
+
+struct image_class_statistics
+{
+    std::string label_filename;
+    uint64_t label_file_size = 0;
+    int64_t label_file_modification_time = 0;
+    uint64_t image_file_size = 0;
+    int64_t image_file_modification_time = 0;
+    std::vector<class_statistics> classes;
+    std::string error; // if not empty, the sample is unusable (and has no classes)
+};
+
+// Reads only the header of the input image, to check its size
+image_class_statistics compute_image_class_statistics(const image_filenames& image_filenames, const std::vector<AnnoClass>& anno_classes);
+
+// ----------------------------------------------------------------------------------------
+
+class dataset_class_index
+{
+public:
+    // Reuses the up-to-date entries of the manifest file (if there is one), computes the
+    // rest, and writes the manifest back if anything changed; the manifest is valid only
+    // for the same classes_key (the anno classes json, plus any remapping)
+    dataset_class_index(
+        const std::vector<image_filenames>& image_files,
+        const std::vector<AnnoClass>& anno_classes,
+        const std::string& classes_key,
+        const std::string& manifest_filename,
+        unsigned int thread_count
+    );
+
+    size_t get_image_count() const { return statistics.size(); }
+
+    // In the same order as the image files given to the constructor
+    const image_class_statistics& get_statistics(size_t image_index) const { return statistics[image_index]; }
+
+    const std::map<uint16_t, std::vector<size_t>>& get_images_by_class() const { return images_by_class; }
+
+    uint64_t get_pixel_count(uint16_t class_index) const;
+
+    // The images that have an error
+    std::vector<size_t> get_invalid_images() const;
+
+private:
+    bool load_manifest(const std::string& manifest_filename, const std::string& classes_key, std::unordered_map<std::string, image_class_statistics>& cached) const;
+    void save_manifest(const std::string& manifest_filename, const std::string& classes_key) const;
+
+    std::vector<image_class_statistics> statistics;
+    std::map<uint16_t, std::vector<size_t>> images_by_class;
+};
+
+// For a directory at /path/to/data, this is /path/to/data/annonet.annoclasses; as an
+// archive can't hold it, for /path/to/data.tar it is /path/to/data.tar.annoclasses
+std::string get_class_index_manifest_filename(const std::string& anno_data_folder);
+
+// ----------------------------------------------------------------------------------------
+
+// Picks a class uniformly among the classes present in the dataset, and then an image
+// that contains that class
+class class_stratified_sampler
+{
+public:
+    class_stratified_sampler(const dataset_class_index& index, const std::vector<uint16_t>& classes_to_ignore);
+
+    // Returns the index of the image, and sets the class that the crop should be centered on
+    size_t get(dlib::rand& rnd, uint16_t& class_index) const;
+
+    const std::vector<uint16_t>& get_classes() const { return classes; }
+
+private:
+    std::vector<uint16_t> classes;
+    std::vector<const std::vector<size_t>*> images_by_class;
+};
+
+#endif // ANNONET_CLASS_INDEX_H
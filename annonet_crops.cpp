@@ -0,0 +1,181 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+*/
+
+#include "annonet_crops.h"
+
+#include <cstddef>
+#include <cstring>
+#include <sstream>
+
+namespace {
+    const char crop_file_magic[8] = { 'A', 'N', 'N', 'O', 'C', 'R', 'O', 'P' };
+    const uint32_t crop_file_version = 1;
+
+    typedef NetPimpl::input_type::type input_pixel;
+
+    // The fixed-size part of the header; the anno classes JSON follows it. The values
+    // are in the native byte order, so the files are meant to be used on the machine
+    // (or at least the architecture) that wrote them.
+    struct crop_file_header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t dimension;
+        uint32_t input_pixel_size;
+        uint32_t anno_classes_json_size;
+        double initial_downscaling_factor;
+        double further_downscaling_factor;
+        uint64_t crop_count;
+        uint64_t data_offset;
+    };
+
+    const uint64_t data_alignment = 4096;
+    const uint64_t record_alignment = 64;
+
+    uint64_t round_up(uint64_t value, uint64_t alignment)
+    {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    // The labels come first in each record, so that they are always aligned
+    uint64_t get_label_size(uint64_t dimension)
+    {
+        return dimension * dimension * sizeof(uint16_t);
+    }
+
+    uint64_t get_record_size(uint64_t dimension)
+    {
+        return round_up(get_label_size(dimension) + dimension * dimension * sizeof(input_pixel), record_alignment);
+    }
+}
+
+// ----------------------------------------------------------------------------------------
+
+crop_file_writer::crop_file_writer(const std::string& filename, const crop_file_info& info)
+    : filename(filename)
+    , info(info)
+    , out(filename, std::ios::binary)
+{
+    crop_file_header header = {};
+    std::memcpy(header.magic, crop_file_magic, sizeof(header.magic));
+    header.version = crop_file_version;
+    header.dimension = static_cast<uint32_t>(info.dimension);
+    header.input_pixel_size = sizeof(input_pixel);
+    header.anno_classes_json_size = static_cast<uint32_t>(info.anno_classes_json.size());
+    header.initial_downscaling_factor = info.initial_downscaling_factor;
+    header.further_downscaling_factor = info.further_downscaling_factor;
+    header.crop_count = 0; // see finish()
+    header.data_offset = round_up(sizeof(header) + info.anno_classes_json.size(), data_alignment);
+
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(info.anno_classes_json.data(), info.anno_classes_json.size());
+
+    const std::vector<char> padding(header.data_offset - sizeof(header) - info.anno_classes_json.size(), 0);
+    out.write(padding.data(), padding.size());
+
+    if (!out) {
+        throw std::runtime_error("Unable to write " + filename);
+    }
+}
+
+void crop_file_writer::write(const NetPimpl::input_type& input_image, const dlib::matrix<uint16_t>& label_image)
+{
+    const long dimension = info.dimension;
+
+    DLIB_CASSERT(input_image.nr() == dimension && input_image.nc() == dimension);
+    DLIB_CASSERT(label_image.nr() == dimension && label_image.nc() == dimension);
+
+    const uint64_t label_size = get_label_size(dimension);
+    const uint64_t input_size = dimension * dimension * sizeof(input_pixel);
+    const std::vector<char> padding(get_record_size(dimension) - label_size - input_size, 0);
+
+    out.write(reinterpret_cast<const char*>(&label_image(0, 0)), label_size);
+    out.write(reinterpret_cast<const char*>(&input_image(0, 0)), input_size);
+    out.write(padding.data(), padding.size());
+
+    if (!out) {
+        throw std::runtime_error("Unable to write " + filename);
+    }
+
+    ++crop_count;
+}
+
+void crop_file_writer::finish()
+{
+    out.seekp(offsetof(crop_file_header, crop_count));
+    out.write(reinterpret_cast<const char*>(&crop_count), sizeof(crop_count));
+    out.close();
+
+    if (!out) {
+        throw std::runtime_error("Unable to write " + filename);
+    }
+}
+
+// ----------------------------------------------------------------------------------------
+
+crop_file_reader::crop_file_reader(const std::string& filename)
+    : file(filename)
+{
+    crop_file_header header;
+
+    if (file.size() < sizeof(header)) {
+        throw std::runtime_error(filename + " is not a crop file");
+    }
+
+    std::memcpy(&header, file.data(), sizeof(header));
+
+    if (std::memcmp(header.magic, crop_file_magic, sizeof(header.magic)) != 0) {
+        throw std::runtime_error(filename + " is not a crop file");
+    }
+    if (header.version != crop_file_version) {
+        std::ostringstream error;
+        error << "Unsupported crop file version " << header.version << " in " << filename;
+        throw std::runtime_error(error.str());
+    }
+    if (header.input_pixel_size != sizeof(input_pixel)) {
+        throw std::runtime_error("The input pixel type of " + filename + " does not match this build (grayscale vs. color)");
+    }
+    if (header.crop_count == 0) {
+        throw std::runtime_error(filename + " is empty or incomplete");
+    }
+
+    info.dimension = header.dimension;
+    info.initial_downscaling_factor = header.initial_downscaling_factor;
+    info.further_downscaling_factor = header.further_downscaling_factor;
+    crop_count = header.crop_count;
+    data_offset = header.data_offset;
+    record_size = get_record_size(header.dimension);
+
+    if (sizeof(header) + header.anno_classes_json_size > data_offset || data_offset + crop_count * record_size > file.size()) {
+        throw std::runtime_error(filename + " is truncated");
+    }
+
+    info.anno_classes_json.assign(file.data() + sizeof(header), header.anno_classes_json_size);
+}
+
+void crop_file_reader::read(uint64_t index, NetPimpl::input_type& input_image, dlib::matrix<uint16_t>& label_image) const
+{
+    DLIB_CASSERT(index < crop_count);
+
+    const long dimension = info.dimension;
+    const char* const record = file.data() + data_offset + index * record_size;
+    const uint64_t label_size = get_label_size(dimension);
+
+    label_image.set_size(dimension, dimension);
+    input_image.set_size(dimension, dimension);
+
+    std::memcpy(&label_image(0, 0), record, label_size);
+    std::memcpy(&input_image(0, 0), record + label_size, dimension * dimension * sizeof(input_pixel));
+}
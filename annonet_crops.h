@@ -0,0 +1,78 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+
+    A crop file holds a large pool of already extracted training crops, of a
+    fixed size, back to back. It is written once by annonet_train
+    --materialize-crops, and then memory-mapped by later training runs, so that
+    they need to do only the cheap augmentations (flips and noise) online.
+*/
+
+#ifndef ANNONET_CROPS_H
+#define ANNONET_CROPS_H
+
+#include "annonet_mmap.h"
+#include "dlib-dnn-pimpl-wrapper/NetPimpl.h"
+
+#include <fstream>
+
+// ----------------------------------------------------------------------------------------
+
+struct crop_file_info
+{
+    std::string anno_classes_json;
+    double initial_downscaling_factor = 1.0;
+    double further_downscaling_factor = 1.0;
+    long dimension = 0;
+};
+
+class crop_file_writer
+{
+public:
+    crop_file_writer(const std::string& filename, const crop_file_info& info);
+
+    void write(const NetPimpl::input_type& input_image, const dlib::matrix<uint16_t>& label_image);
+
+    // Until this is called, the file is not valid
+    void finish();
+
+    uint64_t get_crop_count() const { return crop_count; }
+
+private:
+    const std::string filename;
+    const crop_file_info info;
+    std::ofstream out;
+    uint64_t crop_count = 0;
+};
+
+class crop_file_reader
+{
+public:
+    crop_file_reader(const std::string& filename);
+
+    const crop_file_info& get_info() const { return info; }
+
+    uint64_t get_crop_count() const { return crop_count; }
+
+    // Thread-safe
+    void read(uint64_t index, NetPimpl::input_type& input_image, dlib::matrix<uint16_t>& label_image) const;
+
+private:
+    const memory_mapped_file file;
+    crop_file_info info;
+    uint64_t crop_count = 0;
+    uint64_t data_offset = 0;
+    uint64_t record_size = 0;
+};
+
+#endif // ANNONET_CROPS_H
@@ -0,0 +1,340 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+*/
+
+#include "annonet_frame_ring.h"
+
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+#ifdef _WIN32
+#include <dlib/windows_magic.h>
+#include <windows.h>
+#else // _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // _WIN32
+
+namespace {
+    const char frame_ring_magic[8] = { 'a', 'n', 'n', 'o', 'r', 'i', 'n', 'g' };
+    const uint32_t frame_ring_version = 1;
+
+    // The frame data starts at a cache line (and SIMD) friendly offset
+    const uint64_t frame_data_alignment = 64;
+
+    uint64_t align_up(uint64_t value, uint64_t alignment)
+    {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    uint32_t get_bytes_per_pixel(frame_format format)
+    {
+        switch (format) {
+        case frame_format::gray8: return 1;
+        case frame_format::label16: return 2;
+        default: throw std::runtime_error("Unknown frame format");
+        }
+    }
+
+    // Polls the slot state; the producer and the consumer are in different processes, so
+    // there is nothing portable to block on
+    template <typename predicate_type>
+    bool wait_until(predicate_type predicate, std::chrono::milliseconds timeout)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        for (unsigned int spin = 0; !predicate(); ++spin) {
+            if (std::chrono::steady_clock::now() >= deadline) {
+                return false;
+            }
+            if (spin < 100) {
+                std::this_thread::yield();
+            }
+            else {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+        return true;
+    }
+
+#ifndef _WIN32
+    std::string get_shm_name(const std::string& name)
+    {
+        return name.empty() || name[0] != '/' ? "/" + name : name;
+    }
+#endif // _WIN32
+}
+
+// ----------------------------------------------------------------------------------------
+
+shared_frame_ring::shared_frame_ring(const std::string& name)
+    : name(name)
+    , owner(false)
+{
+    map(0, false);
+
+    try {
+        if (mapped_size < sizeof(frame_ring_header) || std::memcmp(header->magic, frame_ring_magic, sizeof(frame_ring_magic)) != 0) {
+            throw std::runtime_error("Not a frame ring: " + name);
+        }
+        if (header->version != frame_ring_version) {
+            throw std::runtime_error("Unsupported frame ring version in " + name);
+        }
+
+        const uint64_t bytes_per_pixel = get_bytes_per_pixel(header->format);
+        if (header->slot_count == 0 || header->stride < header->width * bytes_per_pixel || header->slot_size < static_cast<uint64_t>(header->height) * header->stride
+            || header->data_offset < sizeof(frame_ring_header) + header->slot_count * sizeof(frame_ring_slot_state)
+            || header->data_offset + header->slot_count * header->slot_size > mapped_size) {
+            throw std::runtime_error("Inconsistent frame ring header in " + name);
+        }
+    }
+    catch (std::exception&) {
+        unmap();
+        throw;
+    }
+
+    slot_states = reinterpret_cast<frame_ring_slot_state*>(mapped_data + sizeof(frame_ring_header));
+}
+
+shared_frame_ring::shared_frame_ring(const std::string& name, uint32_t slot_count, uint32_t width, uint32_t height, frame_format format)
+    : name(name)
+    , owner(true)
+{
+    if (slot_count == 0 || width == 0 || height == 0) {
+        throw std::runtime_error("Invalid frame ring dimensions for " + name);
+    }
+
+    const uint32_t stride = static_cast<uint32_t>(align_up(width * get_bytes_per_pixel(format), frame_data_alignment));
+    const uint64_t slot_size = align_up(static_cast<uint64_t>(height) * stride, frame_data_alignment);
+    const uint64_t data_offset = align_up(sizeof(frame_ring_header) + slot_count * sizeof(frame_ring_slot_state), frame_data_alignment);
+
+    map(static_cast<size_t>(data_offset + slot_count * slot_size), true);
+
+    new (mapped_data) frame_ring_header;
+    std::memcpy(header->magic, frame_ring_magic, sizeof(frame_ring_magic));
+    header->version = frame_ring_version;
+    header->slot_count = slot_count;
+    header->width = width;
+    header->height = height;
+    header->stride = stride;
+    header->format = format;
+    header->slot_size = slot_size;
+    header->data_offset = data_offset;
+    header->closed.store(0);
+    header->reserved = 0;
+
+    slot_states = reinterpret_cast<frame_ring_slot_state*>(mapped_data + sizeof(frame_ring_header));
+    for (uint32_t i = 0; i < slot_count; ++i) {
+        new (&slot_states[i]) frame_ring_slot_state;
+        slot_states[i].state.store(static_cast<uint32_t>(frame_slot_state::free));
+        slot_states[i].reserved = 0;
+        slot_states[i].sequence_number = 0;
+        slot_states[i].timestamp = 0;
+    }
+}
+
+shared_frame_ring::~shared_frame_ring()
+{
+    unmap();
+}
+
+bool shared_frame_ring::acquire_ready_slot(uint32_t& slot_index, std::chrono::milliseconds timeout)
+{
+    slot_index = static_cast<uint32_t>(next_sequence_number % header->slot_count);
+    std::atomic<uint32_t>& state = slot_states[slot_index].state;
+
+    const bool ready_or_closed = wait_until([&]() {
+        return state.load(std::memory_order_acquire) == static_cast<uint32_t>(frame_slot_state::ready)
+            || header->closed.load(std::memory_order_acquire) != 0;
+    }, timeout);
+
+    // the producer publishes its last frame before closing, so check the state once more
+    if (!ready_or_closed || state.load(std::memory_order_acquire) != static_cast<uint32_t>(frame_slot_state::ready)) {
+        return false;
+    }
+
+    state.store(static_cast<uint32_t>(frame_slot_state::in_use), std::memory_order_relaxed);
+    ++next_sequence_number;
+    return true;
+}
+
+void shared_frame_ring::release_slot(uint32_t slot_index)
+{
+    slot_states[slot_index].state.store(static_cast<uint32_t>(frame_slot_state::free), std::memory_order_release);
+}
+
+bool shared_frame_ring::acquire_free_slot(uint32_t& slot_index, std::chrono::milliseconds timeout)
+{
+    slot_index = static_cast<uint32_t>(next_sequence_number % header->slot_count);
+    const std::atomic<uint32_t>& state = slot_states[slot_index].state;
+
+    if (!wait_until([&]() { return state.load(std::memory_order_acquire) == static_cast<uint32_t>(frame_slot_state::free); }, timeout)) {
+        return false;
+    }
+
+    ++next_sequence_number;
+    return true;
+}
+
+void shared_frame_ring::publish_slot(uint32_t slot_index, uint64_t sequence_number, int64_t timestamp)
+{
+    frame_ring_slot_state& slot_state = slot_states[slot_index];
+    slot_state.sequence_number = sequence_number;
+    slot_state.timestamp = timestamp;
+    slot_state.state.store(static_cast<uint32_t>(frame_slot_state::ready), std::memory_order_release);
+}
+
+void shared_frame_ring::close()
+{
+    header->closed.store(1, std::memory_order_release);
+}
+
+const unsigned char* shared_frame_ring::get_slot_data(uint32_t slot_index) const
+{
+    return mapped_data + header->data_offset + slot_index * header->slot_size;
+}
+
+unsigned char* shared_frame_ring::get_slot_data(uint32_t slot_index)
+{
+    return mapped_data + header->data_offset + slot_index * header->slot_size;
+}
+
+#ifdef _WIN32
+
+void shared_frame_ring::map(size_t size, bool create)
+{
+    const std::string mapping_name = "Local\\" + name;
+
+    // Unlike a POSIX shared memory object, a named mapping cannot be removed while some
+    // process (e.g., a consumer of an earlier run) still has it open; then the existing
+    // mapping is returned, and the stale ring in it is replaced in place
+    bool existing = !create;
+
+    if (create) {
+        const uint64_t size64 = size;
+        mapping_handle = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, static_cast<DWORD>(size64 >> 32), static_cast<DWORD>(size64 & 0xffffffff), mapping_name.c_str());
+        existing = mapping_handle != NULL && GetLastError() == ERROR_ALREADY_EXISTS;
+    }
+    else {
+        mapping_handle = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, mapping_name.c_str());
+    }
+    if (mapping_handle == NULL) {
+        mapping_handle = nullptr;
+        throw std::runtime_error("Unable to " + std::string(create ? "create" : "open") + " frame ring " + name);
+    }
+
+    mapped_data = static_cast<unsigned char*>(MapViewOfFile(mapping_handle, FILE_MAP_ALL_ACCESS, 0, 0, existing ? 0 : size));
+    if (mapped_data == nullptr) {
+        CloseHandle(mapping_handle);
+        mapping_handle = nullptr;
+        throw std::runtime_error("Unable to map frame ring " + name);
+    }
+
+    if (existing) {
+        MEMORY_BASIC_INFORMATION info;
+        VirtualQuery(mapped_data, &info, sizeof(info));
+        mapped_size = info.RegionSize;
+    }
+    else {
+        mapped_size = size;
+    }
+
+    if (create) {
+        if (mapped_size < size) {
+            unmap();
+            throw std::runtime_error("Unable to replace frame ring " + name + " - a smaller ring of the same name is still open in another process");
+        }
+        mapped_size = size;
+        std::memset(mapped_data, 0, sizeof(frame_ring_header));
+    }
+
+    header = reinterpret_cast<frame_ring_header*>(mapped_data);
+}
+
+void shared_frame_ring::unmap()
+{
+    // the named mapping goes away with the last handle
+    if (mapped_data) {
+        UnmapViewOfFile(mapped_data);
+        mapped_data = nullptr;
+    }
+    if (mapping_handle) {
+        CloseHandle(mapping_handle);
+        mapping_handle = nullptr;
+    }
+}
+
+#else // _WIN32
+
+void shared_frame_ring::map(size_t size, bool create)
+{
+    const std::string shm_name = get_shm_name(name);
+
+    if (create) {
+        shm_unlink(shm_name.c_str()); // a stale ring from an earlier run
+    }
+
+    const int fd = create
+        ? shm_open(shm_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600)
+        : shm_open(shm_name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        throw std::runtime_error("Unable to " + std::string(create ? "create" : "open") + " frame ring " + name);
+    }
+
+    if (create) {
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            ::close(fd);
+            shm_unlink(shm_name.c_str());
+            throw std::runtime_error("Unable to size frame ring " + name);
+        }
+    }
+    else {
+        struct stat status;
+        if (fstat(fd, &status) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Unable to get the size of frame ring " + name);
+        }
+        size = static_cast<size_t>(status.st_size);
+    }
+
+    void* const address = size > 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd); // the mapping stays valid
+
+    if (address == MAP_FAILED) {
+        if (create) {
+            shm_unlink(shm_name.c_str());
+        }
+        throw std::runtime_error("Unable to map frame ring " + name);
+    }
+
+    mapped_data = static_cast<unsigned char*>(address);
+    mapped_size = size;
+    header = reinterpret_cast<frame_ring_header*>(mapped_data);
+}
+
+void shared_frame_ring::unmap()
+{
+    if (mapped_data) {
+        munmap(mapped_data, mapped_size);
+        mapped_data = nullptr;
+    }
+    if (owner) {
+        shm_unlink(get_shm_name(name).c_str());
+    }
+}
+
+#endif // _WIN32
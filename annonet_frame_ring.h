@@ -0,0 +1,138 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+
+    A frame ring is a shared-memory ring buffer of fixed-size frames, for
+    passing camera frames to annonet_infer (and the results back) without
+    going through files and image codecs. The layout is plain data, so the
+    acquisition process need not link against annonet:
+
+        frame_ring_header
+        frame_ring_slot_state[slot_count]
+        (padding up to data_offset)
+        slot_count * slot_size bytes of frame data, each frame height rows of
+        stride bytes
+
+    There is one producer and one consumer. The producer fills the slots in
+    order (sequence_number % slot_count), and the consumer takes them in the
+    same order; the slot states hand each slot over from one to the other.
+*/
+
+#ifndef ANNONET_FRAME_RING_H
+#define ANNONET_FRAME_RING_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// ----------------------------------------------------------------------------------------
+
+enum class frame_format : uint32_t
+{
+    gray8 = 1,   // input frames: one byte per pixel
+    label16 = 2  // result frames: one uint16_t class index per pixel
+};
+
+enum class frame_slot_state : uint32_t
+{
+    free = 0,    // the producer may write the slot
+    ready = 1,   // the consumer may read the slot
+    in_use = 2   // the consumer is reading the slot (in place)
+};
+
+struct frame_ring_header
+{
+    char magic[8];              // "annoring"
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;            // bytes per row
+    frame_format format;
+    uint64_t slot_size;         // bytes per slot, at least height * stride
+    uint64_t data_offset;       // from the beginning of the shared memory
+    std::atomic<uint32_t> closed; // set by the producer after its last frame
+    uint32_t reserved;
+};
+
+struct frame_ring_slot_state
+{
+    std::atomic<uint32_t> state; // frame_slot_state
+    uint32_t reserved;
+    uint64_t sequence_number;
+    int64_t timestamp;           // whatever the producer wants to pass along
+};
+
+// ----------------------------------------------------------------------------------------
+
+class shared_frame_ring
+{
+public:
+    // Opens a ring that another process has created
+    shared_frame_ring(const std::string& name);
+
+    // Creates a ring (replacing a stale one of the same name); it is removed again in the
+    // destructor
+    shared_frame_ring(const std::string& name, uint32_t slot_count, uint32_t width, uint32_t height, frame_format format);
+
+    ~shared_frame_ring();
+
+    shared_frame_ring(const shared_frame_ring&) = delete;
+    shared_frame_ring& operator=(const shared_frame_ring&) = delete;
+
+    const frame_ring_header& get_header() const { return *header; }
+
+    // Consumer side: waits for the next slot to become ready, and marks it in use. Returns
+    // false if the producer has closed the ring and there are no more frames, or if the
+    // timeout passes first.
+    bool acquire_ready_slot(uint32_t& slot_index, std::chrono::milliseconds timeout);
+
+    // Consumer side: hands the slot back to the producer
+    void release_slot(uint32_t slot_index);
+
+    // Producer side: waits for the next slot to become free. Returns false on timeout.
+    bool acquire_free_slot(uint32_t& slot_index, std::chrono::milliseconds timeout);
+
+    // Producer side: hands the (written) slot over to the consumer
+    void publish_slot(uint32_t slot_index, uint64_t sequence_number, int64_t timestamp);
+
+    // Producer side: no more frames
+    void close();
+
+    const frame_ring_slot_state& get_slot_state(uint32_t slot_index) const { return slot_states[slot_index]; }
+
+    const unsigned char* get_slot_data(uint32_t slot_index) const;
+    unsigned char* get_slot_data(uint32_t slot_index);
+
+private:
+    void map(size_t size, bool create);
+    void unmap();
+
+    const std::string name;
+    const bool owner;
+
+    unsigned char* mapped_data = nullptr;
+    size_t mapped_size = 0;
+
+    frame_ring_header* header = nullptr;
+    frame_ring_slot_state* slot_states = nullptr;
+
+    uint64_t next_sequence_number = 0; // the next slot to acquire, on either side
+
+#ifdef _WIN32
+    void* mapping_handle = nullptr;
+#endif // _WIN32
+};
+
+#endif // ANNONET_FRAME_RING_H
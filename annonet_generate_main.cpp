@@ -0,0 +1,325 @@
+/*
+    This program generates a synthetic anno dataset, so that the data loaders
+    and the inference pipeline can be benchmarked reproducibly without access
+    to any real (and possibly confidential) data.
+
+    Instructions:
+    1. Build the annonet_generate program.
+    2. Run:
+       ./annonet_generate /path/to/output --image-count 1000 --seed 1
+    3. Train or infer on the generated data as usual:
+       ./annonet_train /path/to/output
+
+    The output directory will contain an anno_classes.json file and a tree of
+    images, each with a matching _mask.png file. The same seed and parameters
+    always give the same dataset.
+*/
+
+#include "annonet_parse_anno_classes.h"
+
+#include "cxxopts/include/cxxopts.hpp"
+#include <dlib/dir_nav.h>
+#include <dlib/image_saver/save_png.h>
+#include <dlib/image_saver/save_jpeg.h>
+#include <dlib/threads.h>
+
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+using namespace dlib;
+
+// ----------------------------------------------------------------------------------------
+
+struct generator_parameters
+{
+    std::string seed;
+    long min_width = 0;
+    long max_width = 0;
+    long min_height = 0;
+    long max_height = 0;
+    double blobs_per_megapixel = 0.0;
+    double min_blob_radius = 0.0;
+    double max_blob_radius = 0.0;
+    double ignore_fraction = 0.0;
+    long ignore_patch_size = 0;
+    double jpeg_fraction = 0.0;
+    int jpeg_quality = 0;
+};
+
+// ----------------------------------------------------------------------------------------
+
+std::vector<AnnoClass> make_synthetic_anno_classes(uint16_t class_count)
+{
+    std::vector<AnnoClass> anno_classes;
+    anno_classes.push_back(AnnoClass(0, rgb_alpha_pixel(0, 255, 0, 64), "clean"));
+
+    for (uint16_t index = 1; index < class_count; ++index) {
+        // Spread the defect classes evenly around the hue circle, avoiding pure green
+        const double hue = std::fmod(150.0 + 360.0 * (index - 1) / (class_count - 1), 360.0);
+        const double x = 1.0 - std::fabs(std::fmod(hue / 60.0, 2.0) - 1.0);
+        double r = 0, g = 0, b = 0;
+        switch (static_cast<int>(hue / 60.0)) {
+        case 0: r = 1; g = x; break;
+        case 1: r = x; g = 1; break;
+        case 2: g = 1; b = x; break;
+        case 3: g = x; b = 1; break;
+        case 4: r = x; b = 1; break;
+        default: r = 1; b = x; break;
+        }
+        const rgb_alpha_pixel rgba_label(
+            static_cast<unsigned char>(std::round(255 * r)),
+            static_cast<unsigned char>(std::round(255 * g)),
+            static_cast<unsigned char>(std::round(255 * b)),
+            128
+        );
+        std::ostringstream classlabel;
+        classlabel << "defect " << index;
+        anno_classes.push_back(AnnoClass(index, rgba_label, classlabel.str()));
+    }
+
+    return anno_classes;
+}
+
+// ----------------------------------------------------------------------------------------
+
+void generate_sample(
+    const generator_parameters& parameters,
+    const std::vector<AnnoClass>& anno_classes,
+    size_t image_index,
+    matrix<rgb_pixel>& image,
+    matrix<rgb_alpha_pixel>& mask,
+    bool& save_as_jpeg
+)
+{
+    // Seed per image, so that the result does not depend on the thread count
+    std::ostringstream seed;
+    seed << parameters.seed << "_" << image_index;
+    dlib::rand rnd(seed.str());
+
+    const auto random_between = [&rnd](long min_value, long max_value) {
+        return min_value + static_cast<long>(rnd.get_random_64bit_number() % (max_value - min_value + 1));
+    };
+
+    const long nc = random_between(parameters.min_width, parameters.max_width);
+    const long nr = random_between(parameters.min_height, parameters.max_height);
+
+    image.set_size(nr, nc);
+    mask.set_size(nr, nc);
+
+    // Background: a smooth gradient with some sensor noise
+    const double base_level = 64.0 + 128.0 * rnd.get_random_double();
+    const double gradient_x = (rnd.get_random_double() - 0.5) * 64.0 / nc;
+    const double gradient_y = (rnd.get_random_double() - 0.5) * 64.0 / nr;
+    const double noise_level = 2.0 + 6.0 * rnd.get_random_double();
+
+    const auto clamp = [](double value) {
+        return static_cast<unsigned char>(std::max(0.0, std::min(255.0, std::round(value))));
+    };
+
+    for (long r = 0; r < nr; ++r) {
+        for (long c = 0; c < nc; ++c) {
+            const double level = base_level + gradient_x * c + gradient_y * r + noise_level * rnd.get_random_gaussian();
+            image(r, c) = rgb_pixel(clamp(level), clamp(level), clamp(level));
+            mask(r, c) = anno_classes.front().rgba_label;
+        }
+    }
+
+    // Defects: elliptical blobs, each of a random class with its own intensity offset
+    const size_t class_count = anno_classes.size();
+    if (class_count > 1) {
+        const double expected_blob_count = parameters.blobs_per_megapixel * nr * nc / 1e6;
+        const long blob_count = static_cast<long>(std::floor(expected_blob_count * 2.0 * rnd.get_random_double() + rnd.get_random_double()));
+
+        for (long blob = 0; blob < blob_count; ++blob) {
+            const size_t class_index = 1 + rnd.get_random_32bit_number() % (class_count - 1);
+            const double radius_x = parameters.min_blob_radius + (parameters.max_blob_radius - parameters.min_blob_radius) * rnd.get_random_double();
+            const double radius_y = parameters.min_blob_radius + (parameters.max_blob_radius - parameters.min_blob_radius) * rnd.get_random_double();
+            const double center_x = nc * rnd.get_random_double();
+            const double center_y = nr * rnd.get_random_double();
+            const double offset = (class_index % 2 ? -1.0 : 1.0) * (24.0 + 8.0 * class_index);
+            const rgb_pixel tint(
+                class_index % 3 == 0 ? 16 : 0,
+                class_index % 3 == 1 ? 16 : 0,
+                class_index % 3 == 2 ? 16 : 0
+            );
+
+            const long top = std::max(0L, static_cast<long>(std::floor(center_y - radius_y)));
+            const long bottom = std::min(nr - 1, static_cast<long>(std::ceil(center_y + radius_y)));
+            const long left = std::max(0L, static_cast<long>(std::floor(center_x - radius_x)));
+            const long right = std::min(nc - 1, static_cast<long>(std::ceil(center_x + radius_x)));
+
+            for (long r = top; r <= bottom; ++r) {
+                for (long c = left; c <= right; ++c) {
+                    const double dx = (c - center_x) / radius_x;
+                    const double dy = (r - center_y) / radius_y;
+                    if (dx * dx + dy * dy <= 1.0) {
+                        rgb_pixel& pixel = image(r, c);
+                        pixel.red = clamp(pixel.red + offset + tint.red);
+                        pixel.green = clamp(pixel.green + offset + tint.green);
+                        pixel.blue = clamp(pixel.blue + offset + tint.blue);
+                        mask(r, c) = anno_classes[class_index].rgba_label;
+                    }
+                }
+            }
+        }
+    }
+
+    // Ignored areas: square patches that are left unannotated
+    if (parameters.ignore_fraction > 0.0) {
+        const long patch_size = std::max(1L, parameters.ignore_patch_size);
+        for (long patch_top = 0; patch_top < nr; patch_top += patch_size) {
+            for (long patch_left = 0; patch_left < nc; patch_left += patch_size) {
+                if (rnd.get_random_double() < parameters.ignore_fraction) {
+                    for (long r = patch_top, r_end = std::min(nr, patch_top + patch_size); r < r_end; ++r) {
+                        for (long c = patch_left, c_end = std::min(nc, patch_left + patch_size); c < c_end; ++c) {
+                            mask(r, c) = rgba_ignore_label;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    save_as_jpeg = rnd.get_random_double() < parameters.jpeg_fraction;
+}
+
+// ----------------------------------------------------------------------------------------
+
+int main(int argc, char** argv) try
+{
+    if (argc == 1)
+    {
+        cout << "You call this program like this: " << endl;
+        cout << "./annonet_generate /path/to/output" << endl;
+        return 1;
+    }
+
+    cxxopts::Options options("annonet_generate", "Generate synthetic anno datasets for reproducible benchmarks");
+
+    std::ostringstream hardware_concurrency;
+    hardware_concurrency << std::thread::hardware_concurrency();
+
+    options.add_options()
+        ("o,output-directory", "Output directory", cxxopts::value<std::string>())
+        ("n,image-count", "Number of images to generate", cxxopts::value<size_t>()->default_value("100"))
+        ("images-per-directory", "Number of images per subdirectory", cxxopts::value<size_t>()->default_value("100"))
+        ("seed", "Random seed", cxxopts::value<std::string>()->default_value("annonet"))
+        ("min-width", "Minimum image width", cxxopts::value<long>()->default_value("512"))
+        ("max-width", "Maximum image width", cxxopts::value<long>()->default_value("2048"))
+        ("min-height", "Minimum image height", cxxopts::value<long>()->default_value("512"))
+        ("max-height", "Maximum image height", cxxopts::value<long>()->default_value("2048"))
+        ("class-count", "Number of classes, including the clean class", cxxopts::value<uint16_t>()->default_value("3"))
+        ("blobs-per-megapixel", "Average number of defect blobs per megapixel", cxxopts::value<double>()->default_value("4.0"))
+        ("min-blob-radius", "Minimum defect blob radius, in pixels", cxxopts::value<double>()->default_value("4.0"))
+        ("max-blob-radius", "Maximum defect blob radius, in pixels", cxxopts::value<double>()->default_value("64.0"))
+        ("ignore-fraction", "Fraction of pixels to leave unannotated (0.0 to 1.0)", cxxopts::value<double>()->default_value("0.1"))
+        ("ignore-patch-size", "Side length of the unannotated patches, in pixels", cxxopts::value<long>()->default_value("32"))
+        ("jpeg-fraction", "Fraction of images to save as JPEG instead of PNG (0.0 to 1.0)", cxxopts::value<double>()->default_value("0.5"))
+        ("jpeg-quality", "JPEG quality (1 to 100)", cxxopts::value<int>()->default_value("90"))
+        ("thread-count", "Number of generator threads", cxxopts::value<unsigned int>()->default_value(hardware_concurrency.str()))
+        ;
+
+    try {
+        options.parse_positional("output-directory");
+        options.parse(argc, argv);
+
+        cxxopts::check_required(options, { "output-directory" });
+
+        if (options["class-count"].as<uint16_t>() < 2) {
+            throw std::runtime_error("There must be at least two classes.");
+        }
+        if (options["min-width"].as<long>() < 1 || options["min-width"].as<long>() > options["max-width"].as<long>()
+            || options["min-height"].as<long>() < 1 || options["min-height"].as<long>() > options["max-height"].as<long>()) {
+            throw std::runtime_error("The image size limits are not valid.");
+        }
+        if (options["min-blob-radius"].as<double>() <= 0.0 || options["min-blob-radius"].as<double>() > options["max-blob-radius"].as<double>()) {
+            throw std::runtime_error("The blob radius limits are not valid.");
+        }
+    }
+    catch (std::exception& e) {
+        cerr << e.what() << std::endl;
+        cerr << std::endl;
+        cerr << options.help() << std::endl;
+        return 2;
+    }
+
+    const std::string output_directory = options["output-directory"].as<std::string>();
+    const size_t image_count = options["image-count"].as<size_t>();
+    const size_t images_per_directory = std::max(static_cast<size_t>(1), options["images-per-directory"].as<size_t>());
+    const auto thread_count = std::max(1U, options["thread-count"].as<unsigned int>());
+
+    generator_parameters parameters;
+    parameters.seed = options["seed"].as<std::string>();
+    parameters.min_width = options["min-width"].as<long>();
+    parameters.max_width = options["max-width"].as<long>();
+    parameters.min_height = options["min-height"].as<long>();
+    parameters.max_height = options["max-height"].as<long>();
+    parameters.blobs_per_megapixel = options["blobs-per-megapixel"].as<double>();
+    parameters.min_blob_radius = options["min-blob-radius"].as<double>();
+    parameters.max_blob_radius = options["max-blob-radius"].as<double>();
+    parameters.ignore_fraction = options["ignore-fraction"].as<double>();
+    parameters.ignore_patch_size = options["ignore-patch-size"].as<long>();
+    parameters.jpeg_fraction = options["jpeg-fraction"].as<double>();
+    parameters.jpeg_quality = std::max(1, std::min(100, options["jpeg-quality"].as<int>()));
+
+    std::cout << "Output directory = " << output_directory << std::endl;
+    std::cout << "Image count = " << image_count << std::endl;
+    std::cout << "Seed = " << parameters.seed << std::endl;
+
+    const auto anno_classes = make_synthetic_anno_classes(options["class-count"].as<uint16_t>());
+
+    create_directory(output_directory);
+
+    {
+        std::ofstream anno_classes_file(output_directory + "/anno_classes.json", std::ios::binary);
+        anno_classes_file << anno_classes_to_json(anno_classes);
+        if (!anno_classes_file) {
+            throw std::runtime_error("Unable to write " + output_directory + "/anno_classes.json");
+        }
+    }
+
+    for (size_t first_image_index = 0; first_image_index < image_count; first_image_index += images_per_directory) {
+        std::ostringstream subdirectory;
+        subdirectory << output_directory << "/" << std::setfill('0') << std::setw(4) << (first_image_index / images_per_directory);
+        create_directory(subdirectory.str());
+    }
+
+    std::mutex progress_mutex;
+    size_t images_done = 0;
+
+    parallel_for(thread_count, 0, image_count, [&](long image_index) {
+        matrix<rgb_pixel> image;
+        matrix<rgb_alpha_pixel> mask;
+        bool save_as_jpeg = false;
+
+        generate_sample(parameters, anno_classes, image_index, image, mask, save_as_jpeg);
+
+        std::ostringstream image_filename;
+        image_filename << output_directory << "/" << std::setfill('0') << std::setw(4) << (image_index / images_per_directory)
+            << "/" << std::setw(8) << image_index << (save_as_jpeg ? ".jpg" : ".png");
+
+        if (save_as_jpeg) {
+            save_jpeg(image, image_filename.str(), parameters.jpeg_quality);
+        }
+        else {
+            save_png(image, image_filename.str());
+        }
+        save_png(mask, image_filename.str() + "_mask.png");
+
+        std::lock_guard<std::mutex> lock(progress_mutex);
+        ++images_done;
+        std::cout << "\rGenerated " << images_done << " of " << image_count << " images" << std::flush;
+    });
+
+    std::cout << std::endl << "Done!" << std::endl;
+}
+catch(std::exception& e)
+{
+    cout << e.what() << endl;
+    return 1;
+}
@@ -0,0 +1,364 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+*/
+
+#include "annonet_image_formats.h"
+
+#include <cctype>
+#include <fstream>
+#include <sstream>
+
+namespace {
+    const size_t qoi_header_size = 14;
+    const unsigned char qoi_end_marker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    const uint64_t qoi_max_pixel_count = 400000000;
+
+    // Any PNM header number larger than this is rejected; with at most 3 channels, the
+    // size of the pixel data then fits in 64 bits
+    const uint64_t pnm_max_number = 0x7fffffff;
+
+    bool is_same_pixel(const dlib::rgb_alpha_pixel& a, const dlib::rgb_alpha_pixel& b)
+    {
+        return a.red == b.red && a.green == b.green && a.blue == b.blue && a.alpha == b.alpha;
+    }
+
+    uint32_t read_big_endian_32(const unsigned char* data)
+    {
+        return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | uint32_t(data[3]);
+    }
+
+    void write_big_endian_32(std::vector<char>& out, uint32_t value)
+    {
+        out.push_back(static_cast<char>(value >> 24));
+        out.push_back(static_cast<char>(value >> 16));
+        out.push_back(static_cast<char>(value >> 8));
+        out.push_back(static_cast<char>(value));
+    }
+
+    void write_file(const std::string& filename, const char* data, size_t size)
+    {
+        std::ofstream out(filename, std::ios::binary);
+        out.write(data, size);
+        if (!out) {
+            throw std::runtime_error("Unable to write " + filename);
+        }
+    }
+
+    template <typename pixel_type>
+    void save_pnm_impl(const dlib::matrix<pixel_type>& image, const std::string& filename, const char* magic)
+    {
+        std::ostringstream header;
+        header << magic << "\n" << image.nc() << " " << image.nr() << "\n255\n";
+
+        const std::string h = header.str();
+
+        std::ofstream out(filename, std::ios::binary);
+        out.write(h.data(), h.size());
+        for (long r = 0; r < image.nr() && image.nc() > 0; ++r) {
+            out.write(reinterpret_cast<const char*>(&image(r, 0)), image.nc() * sizeof(pixel_type));
+        }
+        if (!out) {
+            throw std::runtime_error("Unable to write " + filename);
+        }
+    }
+
+    template <typename pixel_type>
+    void save_qoi_impl(const dlib::matrix<pixel_type>& image, const std::string& filename, unsigned char channels)
+    {
+        const long pixel_count = image.size();
+
+        std::vector<char> out;
+        out.reserve(qoi_header_size + pixel_count * (channels + 1) + sizeof(qoi_end_marker));
+
+        const auto put = [&out](unsigned int byte) {
+            out.push_back(static_cast<char>(byte));
+        };
+
+        out.insert(out.end(), { 'q', 'o', 'i', 'f' });
+        write_big_endian_32(out, static_cast<uint32_t>(image.nc()));
+        write_big_endian_32(out, static_cast<uint32_t>(image.nr()));
+        put(channels);
+        put(0); // sRGB with linear alpha
+
+        dlib::rgb_alpha_pixel index[64];
+        std::fill(std::begin(index), std::end(index), dlib::rgb_alpha_pixel(0, 0, 0, 0));
+
+        dlib::rgb_alpha_pixel previous(0, 0, 0, 255);
+        int run = 0;
+
+        for (long i = 0; i < pixel_count; ++i) {
+            dlib::rgb_alpha_pixel pixel;
+            dlib::assign_pixel(pixel, image(i / image.nc(), i % image.nc()));
+
+            if (is_same_pixel(pixel, previous)) {
+                ++run;
+                if (run == 62 || i == pixel_count - 1) {
+                    put(0xc0 | (run - 1));
+                    run = 0;
+                }
+                continue;
+            }
+
+            if (run > 0) {
+                put(0xc0 | (run - 1));
+                run = 0;
+            }
+
+            const unsigned int hash = image_formats_impl::qoi_hash(pixel);
+
+            if (is_same_pixel(index[hash], pixel)) {
+                put(hash);
+            }
+            else {
+                index[hash] = pixel;
+
+                if (pixel.alpha == previous.alpha) {
+                    const signed char vr = static_cast<signed char>(pixel.red - previous.red);
+                    const signed char vg = static_cast<signed char>(pixel.green - previous.green);
+                    const signed char vb = static_cast<signed char>(pixel.blue - previous.blue);
+                    const int vg_r = vr - vg;
+                    const int vg_b = vb - vg;
+
+                    if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                        put(0x40 | ((vr + 2) << 4) | ((vg + 2) << 2) | (vb + 2));
+                    }
+                    else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+                        put(0x80 | (vg + 32));
+                        put(((vg_r + 8) << 4) | (vg_b + 8));
+                    }
+                    else {
+                        put(0xfe);
+                        put(pixel.red);
+                        put(pixel.green);
+                        put(pixel.blue);
+                    }
+                }
+                else {
+                    put(0xff);
+                    put(pixel.red);
+                    put(pixel.green);
+                    put(pixel.blue);
+                    put(pixel.alpha);
+                }
+            }
+
+            previous = pixel;
+        }
+
+        out.insert(out.end(), std::begin(qoi_end_marker), std::end(qoi_end_marker));
+
+        write_file(filename, out.data(), out.size());
+    }
+}
+
+// ----------------------------------------------------------------------------------------
+
+image_format detect_image_format(const char* data, size_t size)
+{
+    const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(data);
+
+    const unsigned char png_signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+    if (size >= sizeof(png_signature) && std::memcmp(bytes, png_signature, sizeof(png_signature)) == 0) {
+        return image_format::png;
+    }
+    if (size >= 3 && bytes[0] == 0xff && bytes[1] == 0xd8 && bytes[2] == 0xff) {
+        return image_format::jpeg;
+    }
+    if (size >= 3 && bytes[0] == 'P' && (bytes[1] == '5' || bytes[1] == '6') && std::isspace(bytes[2])) {
+        return image_format::pnm;
+    }
+    if (size >= qoi_header_size && std::memcmp(bytes, "qoif", 4) == 0) {
+        return image_format::qoi;
+    }
+    return image_format::unknown;
+}
+
+raw_image_header parse_pnm_header(const char* data, size_t size, const std::string& name)
+{
+    if (size < 3 || data[0] != 'P' || (data[1] != '5' && data[1] != '6')) {
+        throw std::runtime_error("Invalid PNM header: " + name);
+    }
+
+    raw_image_header header;
+    header.channels = data[1] == '5' ? 1 : 3;
+
+    size_t position = 2;
+
+    // Reads the next whitespace-separated number, skipping any comments
+    const auto read_number = [&]() {
+        while (position < size) {
+            if (data[position] == '#') {
+                while (position < size && data[position] != '\n') {
+                    ++position;
+                }
+            }
+            else if (std::isspace(static_cast<unsigned char>(data[position]))) {
+                ++position;
+            }
+            else {
+                break;
+            }
+        }
+        uint64_t value = 0;
+        const size_t begin = position;
+        while (position < size && data[position] >= '0' && data[position] <= '9') {
+            value = value * 10 + (data[position] - '0');
+            if (value > pnm_max_number) {
+                throw std::runtime_error("Out-of-range number in PNM header: " + name);
+            }
+            ++position;
+        }
+        if (position == begin) {
+            throw std::runtime_error("Invalid PNM header: " + name);
+        }
+        return static_cast<long>(value);
+    };
+
+    header.width = read_number();
+    header.height = read_number();
+    const long max_value = read_number();
+
+    if (max_value != 255) {
+        throw std::runtime_error("Only 8-bit PNM images are supported: " + name);
+    }
+    if (header.width <= 0 || header.height <= 0) {
+        throw std::runtime_error("Empty PNM image: " + name);
+    }
+
+    // exactly one whitespace character separates the header from the pixels
+    if (position >= size || !std::isspace(static_cast<unsigned char>(data[position]))) {
+        throw std::runtime_error("Invalid PNM header: " + name);
+    }
+    header.data_offset = position + 1;
+
+    // the numbers are small enough for this not to overflow
+    const uint64_t pixel_data_size = static_cast<uint64_t>(header.width) * static_cast<uint64_t>(header.height) * static_cast<uint64_t>(header.channels);
+
+    if (header.data_offset > size || pixel_data_size > size - header.data_offset) {
+        throw std::runtime_error("Truncated PNM data: " + name);
+    }
+
+    return header;
+}
+
+raw_image_header parse_qoi_header(const char* data, size_t size, const std::string& name)
+{
+    const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(data);
+
+    if (size < qoi_header_size || std::memcmp(bytes, "qoif", 4) != 0) {
+        throw std::runtime_error("Invalid QOI header: " + name);
+    }
+
+    raw_image_header header;
+    header.width = read_big_endian_32(bytes + 4);
+    header.height = read_big_endian_32(bytes + 8);
+    header.channels = bytes[12];
+    header.data_offset = qoi_header_size;
+
+    if (header.channels != 3 && header.channels != 4) {
+        throw std::runtime_error("Invalid QOI header: " + name);
+    }
+    if (header.width <= 0 || header.height <= 0) {
+        throw std::runtime_error("Empty QOI image: " + name);
+    }
+    if (static_cast<uint64_t>(header.width) * header.height > qoi_max_pixel_count) {
+        throw std::runtime_error("Too large QOI image: " + name);
+    }
+
+    return header;
+}
+
+bool read_image_dimensions(const char* data, size_t size, const std::string& name, long& width, long& height)
+{
+    const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(data);
+
+    switch (detect_image_format(data, size)) {
+    case image_format::png:
+        // the IHDR chunk always comes first
+        if (size < 24 || std::memcmp(bytes + 12, "IHDR", 4) != 0) {
+            throw std::runtime_error("Invalid PNG header: " + name);
+        }
+        width = read_big_endian_32(bytes + 16);
+        height = read_big_endian_32(bytes + 20);
+        return true;
+
+    case image_format::jpeg:
+        for (size_t position = 2; position + 4 <= size; ) {
+            if (bytes[position] != 0xff) {
+                break;
+            }
+            const unsigned char marker = bytes[position + 1];
+            if (marker == 0xff) {
+                ++position; // fill byte
+                continue;
+            }
+            if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7)) {
+                position += 2; // no payload
+                continue;
+            }
+            const size_t length = (bytes[position + 2] << 8) | bytes[position + 3];
+            const bool is_start_of_frame = marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc;
+            if (is_start_of_frame) {
+                if (position + 9 > size) {
+                    break;
+                }
+                height = (bytes[position + 5] << 8) | bytes[position + 6];
+                width = (bytes[position + 7] << 8) | bytes[position + 8];
+                return true;
+            }
+            position += 2 + length;
+        }
+        throw std::runtime_error("No JPEG frame header found: " + name);
+
+    case image_format::pnm: {
+        const raw_image_header header = parse_pnm_header(data, size, name);
+        width = header.width;
+        height = header.height;
+        return true;
+    }
+
+    case image_format::qoi: {
+        const raw_image_header header = parse_qoi_header(data, size, name);
+        width = header.width;
+        height = header.height;
+        return true;
+    }
+
+    default:
+        return false;
+    }
+}
+
+// ----------------------------------------------------------------------------------------
+
+void save_pnm(const dlib::matrix<unsigned char>& image, const std::string& filename)
+{
+    save_pnm_impl(image, filename, "P5");
+}
+
+void save_pnm(const dlib::matrix<dlib::rgb_pixel>& image, const std::string& filename)
+{
+    save_pnm_impl(image, filename, "P6");
+}
+
+void save_qoi(const dlib::matrix<dlib::rgb_pixel>& image, const std::string& filename)
+{
+    save_qoi_impl(image, filename, 3);
+}
+
+void save_qoi(const dlib::matrix<dlib::rgb_alpha_pixel>& image, const std::string& filename)
+{
+    save_qoi_impl(image, filename, 4);
+}
@@ -0,0 +1,215 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+
+    Besides PNG and JPEG, the loader reads two formats that are much cheaper to
+    decode: binary PGM/PPM (raw pixels behind a short text header, so decoding
+    is practically a memcpy from the memory-mapped file), and QOI (a simple
+    lossless codec, see https://qoiformat.org/). Datasets can be converted
+    using annonet_convert. The format is always recognized from the header of
+    the file, not from the extension.
+*/
+
+#ifndef ANNONET_IMAGE_FORMATS_H
+#define ANNONET_IMAGE_FORMATS_H
+
+#include <dlib/matrix.h>
+#include <dlib/pixel.h>
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// ----------------------------------------------------------------------------------------
+
+enum class image_format { unknown, png, jpeg, pnm, qoi };
+
+image_format detect_image_format(const char* data, size_t size);
+
+struct raw_image_header
+{
+    long width = 0;
+    long height = 0;
+    int channels = 0; // 1 = grayscale, 3 = rgb, 4 = rgba
+    size_t data_offset = 0;
+};
+
+// Binary PGM (P5) and PPM (P6), 8 bits per sample
+raw_image_header parse_pnm_header(const char* data, size_t size, const std::string& name);
+
+raw_image_header parse_qoi_header(const char* data, size_t size, const std::string& name);
+
+// Reads only the headers; returns false for unknown formats, and throws for broken headers
+bool read_image_dimensions(const char* data, size_t size, const std::string& name, long& width, long& height);
+
+// ----------------------------------------------------------------------------------------
+
+namespace image_formats_impl {
+
+    // The channels are: 1 = gray, 2 = gray and alpha, 3 = rgb, 4 = rgba
+    template <typename pixel_type>
+    void assign_row(pixel_type* out, const unsigned char* in, long count, int channels)
+    {
+        for (long i = 0; i < count; ++i, in += channels) {
+            switch (channels) {
+            case 1: dlib::assign_pixel(out[i], in[0]); break;
+            case 2: dlib::assign_pixel(out[i], dlib::rgb_alpha_pixel(in[0], in[0], in[0], in[1])); break;
+            case 3: dlib::assign_pixel(out[i], dlib::rgb_pixel(in[0], in[1], in[2])); break;
+            default: dlib::assign_pixel(out[i], dlib::rgb_alpha_pixel(in[0], in[1], in[2], in[3])); break;
+            }
+        }
+    }
+
+    // The common cases, where the layout in the file is already what we want
+    inline void assign_row(unsigned char* out, const unsigned char* in, long count, int channels)
+    {
+        if (channels == 1) {
+            std::memcpy(out, in, count);
+        }
+        else {
+            assign_row<unsigned char>(out, in, count, channels);
+        }
+    }
+
+    inline void assign_row(dlib::rgb_pixel* out, const unsigned char* in, long count, int channels)
+    {
+        if (channels == 3) {
+            static_assert(sizeof(dlib::rgb_pixel) == 3, "Unexpected rgb_pixel layout");
+            std::memcpy(out, in, count * 3);
+        }
+        else {
+            assign_row<dlib::rgb_pixel>(out, in, count, channels);
+        }
+    }
+
+    inline void assign_row(dlib::rgb_alpha_pixel* out, const unsigned char* in, long count, int channels)
+    {
+        if (channels == 4) {
+            static_assert(sizeof(dlib::rgb_alpha_pixel) == 4, "Unexpected rgb_alpha_pixel layout");
+            std::memcpy(out, in, count * 4);
+        }
+        else {
+            assign_row<dlib::rgb_alpha_pixel>(out, in, count, channels);
+        }
+    }
+
+    inline unsigned int qoi_hash(const dlib::rgb_alpha_pixel& p)
+    {
+        return (p.red * 3 + p.green * 5 + p.blue * 7 + p.alpha * 11) % 64;
+    }
+}
+
+template <typename image_type>
+void load_pnm(image_type& image, const char* data, size_t size, const std::string& name)
+{
+    const raw_image_header header = parse_pnm_header(data, size, name);
+
+    image.set_size(header.height, header.width);
+
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(data + header.data_offset);
+    const size_t row_size = header.width * header.channels;
+
+    for (long r = 0; r < header.height; ++r, in += row_size) {
+        image_formats_impl::assign_row(&image(r, 0), in, header.width, header.channels);
+    }
+}
+
+template <typename image_type>
+void load_qoi(image_type& image, const char* data, size_t size, const std::string& name)
+{
+    const raw_image_header header = parse_qoi_header(data, size, name);
+
+    image.set_size(header.height, header.width);
+
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(data + header.data_offset);
+    const unsigned char* const end = reinterpret_cast<const unsigned char*>(data + size);
+
+    dlib::rgb_alpha_pixel index[64];
+    std::fill(std::begin(index), std::end(index), dlib::rgb_alpha_pixel(0, 0, 0, 0));
+
+    dlib::rgb_alpha_pixel pixel(0, 0, 0, 255);
+    int run = 0;
+
+    const auto truncated = [&name]() {
+        return std::runtime_error("Truncated QOI data: " + name);
+    };
+
+    for (long r = 0; r < header.height; ++r) {
+        for (long c = 0; c < header.width; ++c) {
+            if (run > 0) {
+                --run;
+            }
+            else {
+                if (in >= end) {
+                    throw truncated();
+                }
+                const unsigned char b1 = *in++;
+                if (b1 == 0xfe) {
+                    if (end - in < 3) {
+                        throw truncated();
+                    }
+                    pixel.red = in[0];
+                    pixel.green = in[1];
+                    pixel.blue = in[2];
+                    in += 3;
+                }
+                else if (b1 == 0xff) {
+                    if (end - in < 4) {
+                        throw truncated();
+                    }
+                    pixel.red = in[0];
+                    pixel.green = in[1];
+                    pixel.blue = in[2];
+                    pixel.alpha = in[3];
+                    in += 4;
+                }
+                else if ((b1 & 0xc0) == 0x00) {
+                    pixel = index[b1];
+                }
+                else if ((b1 & 0xc0) == 0x40) {
+                    pixel.red = static_cast<unsigned char>(pixel.red + ((b1 >> 4) & 0x03) - 2);
+                    pixel.green = static_cast<unsigned char>(pixel.green + ((b1 >> 2) & 0x03) - 2);
+                    pixel.blue = static_cast<unsigned char>(pixel.blue + (b1 & 0x03) - 2);
+                }
+                else if ((b1 & 0xc0) == 0x80) {
+                    if (in >= end) {
+                        throw truncated();
+                    }
+                    const unsigned char b2 = *in++;
+                    const int vg = (b1 & 0x3f) - 32;
+                    pixel.red = static_cast<unsigned char>(pixel.red + vg - 8 + ((b2 >> 4) & 0x0f));
+                    pixel.green = static_cast<unsigned char>(pixel.green + vg);
+                    pixel.blue = static_cast<unsigned char>(pixel.blue + vg - 8 + (b2 & 0x0f));
+                }
+                else {
+                    run = b1 & 0x3f;
+                }
+                index[image_formats_impl::qoi_hash(pixel)] = pixel;
+            }
+            dlib::assign_pixel(image(r, c), pixel);
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------
+
+// For writing; the decoders above are the hot path, so they are kept inline
+void save_pnm(const dlib::matrix<unsigned char>& image, const std::string& filename);
+void save_pnm(const dlib::matrix<dlib::rgb_pixel>& image, const std::string& filename);
+
+void save_qoi(const dlib::matrix<dlib::rgb_pixel>& image, const std::string& filename);
+void save_qoi(const dlib::matrix<dlib::rgb_alpha_pixel>& image, const std::string& filename);
+
+#endif // ANNONET_IMAGE_FORMATS_H
@@ -17,8 +17,15 @@
 */
 
 #include "annonet_infer.h"
+#include "annonet_runtime_net.h"
+#include "annonet_stub_net.h"
 #include <dlib/dnn.h>
+#include <dlib/pipe.h>
 #include "tiling/dlib-wrapper.h"
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <thread>
 #include <unordered_set>
 
 template <
@@ -69,38 +76,50 @@ void outpaint(
     // TODO: even blur from outside
 }
 
-void annonet_infer(
-    NetPimpl::RuntimeNet& net,
-    const NetPimpl::input_type& input_image,
-    dlib::matrix<uint16_t>& result_image,
-    const std::vector<double>& gains,
-    const std::vector<double>& detection_levels,
+// Edge tiles are shifted inward (overlapping their neighbors more) instead of shrinking,
+// unless the tile is larger than the image anyway
+long get_fixed_shape_tile_start(long tile_center, long tile_size, long image_size)
+{
+    const long start = tile_center - tile_size / 2;
+    if (tile_size >= image_size) {
+        return start;
+    }
+    return std::max(0L, std::min(start, image_size - tile_size));
+}
+
+// The tiles as the net sees them: the full rects are grown to the recommended input dimensions
+std::vector<tiling::dlib_tile> get_actual_tiles(
+    long image_width,
+    long image_height,
     const tiling::parameters& tiling_parameters,
-    annonet_infer_temp& temp
+    bool fixed_shape_tiles
 )
 {
-    const bool use_detection_level = std::any_of(detection_levels.begin(), detection_levels.end(),
-        [](const double value) {
-            assert(value >= 0.0);
-            return value > 0.0;
-        });
+    const std::vector<tiling::dlib_tile> tiles = tiling::get_tiles(image_width, image_height, tiling_parameters);
 
-    result_image.set_size(input_image.nr(), input_image.nc());
+    int fixed_tile_width = 0;
+    int fixed_tile_height = 0;
 
-    if (use_detection_level) {
-        temp.detection_seeds.clear();
+    if (fixed_shape_tiles) {
+        for (const tiling::dlib_tile& tile : tiles) {
+            fixed_tile_width = std::max(fixed_tile_width, static_cast<int>(tile.full_rect.width()));
+            fixed_tile_height = std::max(fixed_tile_height, static_cast<int>(tile.full_rect.height()));
+        }
+        fixed_tile_width = NetPimpl::RuntimeNet::GetRecommendedInputDimension(fixed_tile_width);
+        fixed_tile_height = NetPimpl::RuntimeNet::GetRecommendedInputDimension(fixed_tile_height);
     }
 
-    const std::vector<tiling::dlib_tile> tiles = tiling::get_tiles(input_image.nc(), input_image.nr(), tiling_parameters);
+    std::vector<tiling::dlib_tile> actual_tiles;
+    actual_tiles.reserve(tiles.size());
 
     for (const tiling::dlib_tile& tile : tiles) {
 
         const dlib::point tile_center(tile.full_rect.left() + tile.full_rect.width() / 2, tile.full_rect.top() + tile.full_rect.height() / 2);
 
-        const int recommended_tile_width = NetPimpl::RuntimeNet::GetRecommendedInputDimension(tile.full_rect.width());
-        const int recommended_tile_height = NetPimpl::RuntimeNet::GetRecommendedInputDimension(tile.full_rect.height());
-        const int recommended_tile_left = tile_center.x() - recommended_tile_width / 2;
-        const int recommended_tile_top = tile_center.y() - recommended_tile_height / 2;
+        const int recommended_tile_width = fixed_shape_tiles ? fixed_tile_width : NetPimpl::RuntimeNet::GetRecommendedInputDimension(tile.full_rect.width());
+        const int recommended_tile_height = fixed_shape_tiles ? fixed_tile_height : NetPimpl::RuntimeNet::GetRecommendedInputDimension(tile.full_rect.height());
+        const int recommended_tile_left = fixed_shape_tiles ? get_fixed_shape_tile_start(tile_center.x(), recommended_tile_width, image_width) : tile_center.x() - recommended_tile_width / 2;
+        const int recommended_tile_top = fixed_shape_tiles ? get_fixed_shape_tile_start(tile_center.y(), recommended_tile_height, image_height) : tile_center.y() - recommended_tile_height / 2;
 
         assert(static_cast<unsigned long>(recommended_tile_width) >= tile.full_rect.width());
         assert(static_cast<unsigned long>(recommended_tile_height) >= tile.full_rect.height());
@@ -112,17 +131,141 @@ void annonet_infer(
         assert(actual_tile.full_rect.width() == recommended_tile_width);
         assert(actual_tile.full_rect.height() == recommended_tile_height);
 
-        const int actual_tile_width = actual_tile.full_rect.width();
-        const int actual_tile_height = actual_tile.full_rect.height();
-        const dlib::rectangle actual_tile_rect = dlib::centered_rect(tile_center, actual_tile_width, actual_tile_height);
-        const dlib::chip_details chip_details(actual_tile_rect, dlib::chip_dims(actual_tile_height, actual_tile_width));
-        dlib::extract_image_chip(input_image, chip_details, temp.input_tile, dlib::interpolate_bilinear());
+        assert(actual_tile.full_rect.contains(actual_tile.non_overlapping_rect));
+
+        actual_tiles.push_back(actual_tile);
+    }
+
+    return actual_tiles;
+}
+
+template <typename image_type>
+void extract_tile(
+    const image_type& input_image,
+    const tiling::dlib_tile& actual_tile,
+    NetPimpl::input_type& input_tile
+)
+{
+    const int actual_tile_width = actual_tile.full_rect.width();
+    const int actual_tile_height = actual_tile.full_rect.height();
+    const dlib::chip_details chip_details(actual_tile.full_rect, dlib::chip_dims(actual_tile_height, actual_tile_width));
+    dlib::extract_image_chip(input_image, chip_details, input_tile, dlib::interpolate_bilinear());
+
+    if (!dlib::get_rect(input_image).contains(chip_details.rect)) {
+        const dlib::rectangle inside(-chip_details.rect.tl_corner(), dlib::get_rect(input_image).br_corner() - chip_details.rect.tl_corner());
+        outpaint(dlib::image_view<NetPimpl::input_type>(input_tile), inside);
+    }
+}
+
+bool is_detection_level_used(const std::vector<double>& detection_levels)
+{
+    return std::any_of(detection_levels.begin(), detection_levels.end(),
+        [](const double value) {
+            assert(value >= 0.0);
+            return value > 0.0;
+        });
+}
+
+// Records the labeled pixels whose logit margin over the clean class exceeds the detection
+// level; valid_rect_in_tile is mapped to the image so that its top-left is valid_tl_in_image
+void collect_detection_seeds(
+    const dlib::tensor& output_tensor,
+    const dlib::matrix<uint16_t>& index_label_tile,
+    const dlib::rectangle& valid_rect_in_tile,
+    const dlib::point& valid_tl_in_image,
+    const std::vector<double>& detection_levels,
+    std::vector<dlib::point>& detection_seeds
+)
+{
+    const auto tensor_index = [](const dlib::tensor& t, long sample, long k, long row, long column)
+    {
+        // See: https://github.com/davisking/dlib/blob/4dfeb7e186dd1bf6ac91273509f687293bd4230a/dlib/dnn/tensor_abstract.h#L38
+        return ((sample * t.k() + k) * t.nr() + row) * t.nc() + column;
+    };
+
+    const float* const out_data = output_tensor.host();
+
+    const long valid_left_in_tile = valid_rect_in_tile.left();
+    const long valid_top_in_tile = valid_rect_in_tile.top();
+
+    for (long y = 0, valid_tile_height = valid_rect_in_tile.height(); y < valid_tile_height; ++y) {
+        for (long x = 0, valid_tile_width = valid_rect_in_tile.width(); x < valid_tile_width; ++x) {
+            const uint16_t label = index_label_tile(valid_top_in_tile + y, valid_left_in_tile + x);
+            if (label > 0) {
+                const float clean_output = out_data[tensor_index(output_tensor, 0, 0, valid_top_in_tile + y, valid_left_in_tile + x)];
+                const float label_output = out_data[tensor_index(output_tensor, 0, label, valid_top_in_tile + y, valid_left_in_tile + x)];
+                if (label_output - clean_output > detection_levels[label] - detection_levels[0]) {
+                    detection_seeds.emplace_back(valid_tl_in_image.x() + x, valid_tl_in_image.y() + y);
+                }
+            }
+        }
+    }
+}
+
+// Clears the blobs that do not contain any detection seed
+void keep_detected_blobs(
+    dlib::matrix<uint16_t>& result_image,
+    const std::vector<dlib::point>& detection_seeds,
+    dlib::matrix<unsigned int>& connected_blobs
+)
+{
+    dlib::label_connected_blobs(result_image, dlib::zero_pixels_are_background(), dlib::neighbors_8(), dlib::connected_if_equal(), connected_blobs);
+
+    std::unordered_set<unsigned int> detected_blobs;
+
+    for (const dlib::point& point : detection_seeds) {
+        const unsigned int blob = connected_blobs(point.y(), point.x());
+        detected_blobs.insert(blob);
+    }
+
+    const long nr = result_image.nr();
+    const long nc = result_image.nc();
+
+    for (long r = 0; r < nr; ++r) {
+        for (long c = 0; c < nc; ++c) {
+            const unsigned int blob = connected_blobs(r, c);
+            if (blob > 0) {
+                if (detected_blobs.find(blob) == detected_blobs.end()) {
+                    result_image(r, c) = 0;
+                }
+            }
+        }
+    }
+}
+
+// Returns the number of tiles processed: all of them, unless the deadline comes first. A tile
+// is not started if it would not be done in time, judging by the slowest one so far.
+template <typename net_type, typename image_type>
+size_t annonet_infer_tiles(
+    net_type& net,
+    const image_type& input_image,
+    const std::vector<tiling::dlib_tile>& actual_tiles,
+    dlib::matrix<uint16_t>& result_image,
+    const std::vector<double>& gains,
+    const std::vector<double>& detection_levels,
+    annonet_infer_temp& temp,
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()
+)
+{
+    const bool use_detection_level = is_detection_level_used(detection_levels);
+    const bool use_deadline = deadline != std::chrono::steady_clock::time_point::max();
+
+    if (use_detection_level) {
+        temp.detection_seeds.clear();
+    }
+
+    size_t processed_tile_count = 0;
+    std::chrono::steady_clock::duration max_tile_duration = std::chrono::steady_clock::duration::zero();
+
+    for (const tiling::dlib_tile& actual_tile : actual_tiles) {
 
-        if (!dlib::rectangle(input_image.nc(), input_image.nr()).contains(chip_details.rect)) {
-            const dlib::rectangle inside(-chip_details.rect.tl_corner(), get_rect(input_image).br_corner() - chip_details.rect.tl_corner());
-            outpaint(dlib::image_view<NetPimpl::input_type>(temp.input_tile), inside);
+        const auto tile_start = use_deadline ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+        if (use_deadline && tile_start + max_tile_duration > deadline) {
+            break;
         }
 
+        extract_tile(input_image, actual_tile, temp.input_tile);
+
         const dlib::matrix<uint16_t> index_label_tile = net(temp.input_tile, gains);
 
         DLIB_CASSERT(index_label_tile.nr() == temp.input_tile.nr());
@@ -132,65 +275,675 @@ void annonet_infer(
         const long valid_top_in_image = actual_tile.non_overlapping_rect.top();
         const long valid_left_in_tile = actual_tile.non_overlapping_rect.left() - actual_tile.full_rect.left();
         const long valid_top_in_tile = actual_tile.non_overlapping_rect.top() - actual_tile.full_rect.top();
+        const long valid_tile_width = actual_tile.non_overlapping_rect.width();
         for (long y = 0, valid_tile_height = actual_tile.non_overlapping_rect.height(); y < valid_tile_height; ++y) {
-            for (long x = 0, valid_tile_width = actual_tile.non_overlapping_rect.width(); x < valid_tile_width; ++x) {
-                const uint16_t label = index_label_tile(valid_top_in_tile + y, valid_left_in_tile + x);
-                result_image(valid_top_in_image + y, valid_left_in_image + x) = label;
+            const uint16_t* const tile_row = &index_label_tile(valid_top_in_tile + y, valid_left_in_tile);
+            std::copy(tile_row, tile_row + valid_tile_width, &result_image(valid_top_in_image + y, valid_left_in_image));
+        }
+
+        if (use_detection_level) {
+            const dlib::tensor& output_tensor = net.GetOutput();
+
+            DLIB_CASSERT(output_tensor.nr() == actual_tile.full_rect.height());
+            DLIB_CASSERT(output_tensor.nc() == actual_tile.full_rect.width());
+
+            const dlib::rectangle valid_rect_in_tile = dlib::translate_rect(actual_tile.non_overlapping_rect, -actual_tile.full_rect.tl_corner());
+            collect_detection_seeds(output_tensor, index_label_tile, valid_rect_in_tile, actual_tile.non_overlapping_rect.tl_corner(), detection_levels, temp.detection_seeds);
+        }
+
+        ++processed_tile_count;
+
+        if (use_deadline) {
+            max_tile_duration = std::max(max_tile_duration, std::chrono::steady_clock::now() - tile_start);
+        }
+    }
+
+    if (use_detection_level) {
+        keep_detected_blobs(result_image, temp.detection_seeds, temp.connected_blobs);
+    }
+
+    return processed_tile_count;
+}
+
+template <typename net_type>
+void annonet_infer(
+    net_type& net,
+    const NetPimpl::input_type& input_image,
+    dlib::matrix<uint16_t>& result_image,
+    const std::vector<double>& gains,
+    const std::vector<double>& detection_levels,
+    const tiling::parameters& tiling_parameters,
+    annonet_infer_temp& temp,
+    bool fixed_shape_tiles
+)
+{
+    result_image.set_size(input_image.nr(), input_image.nc());
+
+    const std::vector<tiling::dlib_tile> actual_tiles = get_actual_tiles(input_image.nc(), input_image.nr(), tiling_parameters, fixed_shape_tiles);
+
+    annonet_infer_tiles(net, input_image, actual_tiles, result_image, gains, detection_levels, temp);
+}
+
+template <typename net_type>
+void annonet_infer(
+    net_type& net,
+    const const_frame_view& input_frame,
+    dlib::matrix<uint16_t>& result_image,
+    const std::vector<double>& gains,
+    const std::vector<double>& detection_levels,
+    const tiling::parameters& tiling_parameters,
+    annonet_infer_temp& temp,
+    bool fixed_shape_tiles
+)
+{
+    result_image.set_size(input_frame.height, input_frame.width);
+
+    const std::vector<tiling::dlib_tile> actual_tiles = get_actual_tiles(input_frame.width, input_frame.height, tiling_parameters, fixed_shape_tiles);
+
+    // the tiles are extracted straight from the frame, so it is never copied as a whole
+    annonet_infer_tiles(net, input_frame, actual_tiles, result_image, gains, detection_levels, temp);
+}
+
+template <typename net_type>
+size_t annonet_infer_regions(
+    net_type& net,
+    const NetPimpl::input_type& input_image,
+    const std::vector<dlib::rectangle>& regions_of_interest,
+    dlib::matrix<uint16_t>& result_image,
+    const std::vector<double>& gains,
+    const std::vector<double>& detection_levels,
+    const tiling::parameters& tiling_parameters,
+    annonet_infer_temp& temp,
+    bool fixed_shape_tiles
+)
+{
+    result_image.set_size(input_image.nr(), input_image.nc());
+    result_image = 0;
+
+    std::vector<tiling::dlib_tile> actual_tiles = get_actual_tiles(input_image.nc(), input_image.nr(), tiling_parameters, fixed_shape_tiles);
+
+    // The results within a non-overlapping rect come from its own tile only, so the other
+    // tiles can be skipped altogether
+    const auto is_needed = [&regions_of_interest](const tiling::dlib_tile& tile) {
+        return std::any_of(regions_of_interest.begin(), regions_of_interest.end(),
+            [&tile](const dlib::rectangle& region) {
+                return !tile.non_overlapping_rect.intersect(region).is_empty();
+            });
+    };
+
+    actual_tiles.erase(std::remove_if(actual_tiles.begin(), actual_tiles.end(),
+        [&is_needed](const tiling::dlib_tile& tile) { return !is_needed(tile); }), actual_tiles.end());
+
+    annonet_infer_tiles(net, input_image, actual_tiles, result_image, gains, detection_levels, temp);
+
+    return actual_tiles.size();
+}
+
+// ----------------------------------------------------------------------------------------
+
+canvas_packer::canvas_packer(long max_canvas_width, long max_canvas_height, long gap)
+    : max_canvas_width(max_canvas_width)
+    , max_canvas_height(max_canvas_height)
+    , margin((gap + 1) / 2)
+{
+}
+
+bool canvas_packer::fits(long image_width, long image_height) const
+{
+    return image_width + 2 * margin <= max_canvas_width && image_height + 2 * margin <= max_canvas_height;
+}
+
+bool canvas_packer::try_add(long image_width, long image_height, dlib::rectangle& image_rect_in_canvas)
+{
+    const long cell_width = image_width + 2 * margin;
+    const long cell_height = image_height + 2 * margin;
+
+    if (!fits(image_width, image_height)) {
+        return false;
+    }
+
+    if (shelf_left + cell_width > max_canvas_width) {
+        // start a new shelf
+        shelf_top += shelf_height;
+        shelf_left = 0;
+        shelf_height = 0;
+    }
+
+    if (shelf_top + cell_height > max_canvas_height) {
+        return false;
+    }
+
+    image_rect_in_canvas = dlib::rectangle(shelf_left + margin, shelf_top + margin, shelf_left + margin + image_width - 1, shelf_top + margin + image_height - 1);
+
+    shelf_left += cell_width;
+    shelf_height = std::max(shelf_height, cell_height);
+    ++image_count;
+
+    return true;
+}
+
+void canvas_packer::clear()
+{
+    shelf_left = shelf_top = shelf_height = 0;
+    image_count = 0;
+}
+
+template <typename net_type>
+void annonet_infer_canvas(
+    net_type& net,
+    const std::vector<annonet_canvas_item>& items,
+    long margin,
+    const std::vector<double>& gains,
+    const std::vector<double>& detection_levels,
+    annonet_infer_temp& temp
+)
+{
+    if (items.empty()) {
+        return;
+    }
+
+    const bool use_detection_level = is_detection_level_used(detection_levels);
+
+    long used_width = 0, used_height = 0;
+    for (const annonet_canvas_item& item : items) {
+        used_width = std::max(used_width, item.image_rect_in_canvas.right() + margin + 1);
+        used_height = std::max(used_height, item.image_rect_in_canvas.bottom() + margin + 1);
+    }
+
+    const int canvas_width = NetPimpl::RuntimeNet::GetRecommendedInputDimension(used_width);
+    const int canvas_height = NetPimpl::RuntimeNet::GetRecommendedInputDimension(used_height);
+
+    temp.input_tile.set_size(canvas_height, canvas_width);
+    dlib::assign_all_pixels(temp.input_tile, 0);
+
+    for (const annonet_canvas_item& item : items) {
+        const NetPimpl::input_type& input_image = *item.input_image;
+        const dlib::rectangle& rect = item.image_rect_in_canvas;
+
+        DLIB_CASSERT(rect.width() == input_image.nc());
+        DLIB_CASSERT(rect.height() == input_image.nr());
+
+        for (long r = 0, nr = input_image.nr(); r < nr; ++r) {
+            for (long c = 0, nc = input_image.nc(); c < nc; ++c) {
+                temp.input_tile(rect.top() + r, rect.left() + c) = input_image(r, c);
             }
         }
 
+        // Each image owns a margin of half the gap around it, and the margins are outpainted
+        // from the image itself, so the neighbors stay out of its receptive field
+        const dlib::rectangle cell = grow_rect(rect, margin);
+        auto cell_image = dlib::sub_image(temp.input_tile, cell);
+        dlib::image_view<decltype(cell_image)> cell_view(cell_image);
+        outpaint(cell_view, dlib::rectangle(margin, margin, margin + rect.width() - 1, margin + rect.height() - 1));
+    }
+
+    const dlib::matrix<uint16_t> index_label_tile = net(temp.input_tile, gains);
+
+    DLIB_CASSERT(index_label_tile.nr() == temp.input_tile.nr());
+    DLIB_CASSERT(index_label_tile.nc() == temp.input_tile.nc());
+
+    for (const annonet_canvas_item& item : items) {
+        dlib::matrix<uint16_t>& result_image = *item.result_image;
+        const dlib::rectangle& rect = item.image_rect_in_canvas;
+
+        result_image.set_size(rect.height(), rect.width());
+
+        for (long y = 0, height = rect.height(); y < height; ++y) {
+            const uint16_t* const tile_row = &index_label_tile(rect.top() + y, rect.left());
+            std::copy(tile_row, tile_row + rect.width(), &result_image(y, 0));
+        }
+
         if (use_detection_level) {
+            const dlib::tensor& output_tensor = net.GetOutput();
+
+            DLIB_CASSERT(output_tensor.nr() == canvas_height);
+            DLIB_CASSERT(output_tensor.nc() == canvas_width);
+
+            temp.detection_seeds.clear();
+            collect_detection_seeds(output_tensor, index_label_tile, rect, dlib::point(0, 0), detection_levels, temp.detection_seeds);
+            keep_detected_blobs(result_image, temp.detection_seeds, temp.connected_blobs);
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------
 
-            const auto tensor_index = [](const dlib::tensor& t, long sample, long k, long row, long column)
-            {
-                // See: https://github.com/davisking/dlib/blob/4dfeb7e186dd1bf6ac91273509f687293bd4230a/dlib/dnn/tensor_abstract.h#L38
-                return ((sample * t.k() + k) * t.nr() + row) * t.nc() + column;
-            };
+inspection_tile_order parse_inspection_tile_order(const std::string& name)
+{
+    for (const inspection_tile_order order : { inspection_tile_order::tiling, inspection_tile_order::center_first, inspection_tile_order::edges_first }) {
+        if (name == to_string(order)) {
+            return order;
+        }
+    }
+    throw std::runtime_error("Unknown inspection tile order: " + name + " (supported: tiling, center-first, edges-first)");
+}
+
+std::string to_string(inspection_tile_order order)
+{
+    switch (order) {
+    case inspection_tile_order::center_first: return "center-first";
+    case inspection_tile_order::edges_first: return "edges-first";
+    default: return "tiling";
+    }
+}
+
+// The tiles that intersect any of the priority regions come first; within both groups, the
+// tiles are sorted according to the order
+void sort_tiles(
+    std::vector<tiling::dlib_tile>& actual_tiles,
+    inspection_tile_order tile_order,
+    const std::vector<dlib::rectangle>& priority_regions,
+    const dlib::rectangle& image_rect
+)
+{
+    if (tile_order != inspection_tile_order::tiling) {
+        const dlib::point image_center = dlib::center(image_rect);
+        const auto distance_from_center = [&image_center](const tiling::dlib_tile& tile) {
+            return (dlib::center(tile.non_overlapping_rect) - image_center).length_squared();
+        };
+        const bool center_first = tile_order == inspection_tile_order::center_first;
+        std::stable_sort(actual_tiles.begin(), actual_tiles.end(),
+            [&](const tiling::dlib_tile& tile1, const tiling::dlib_tile& tile2) {
+                return center_first
+                    ? distance_from_center(tile1) < distance_from_center(tile2)
+                    : distance_from_center(tile1) > distance_from_center(tile2);
+            });
+    }
+
+    if (!priority_regions.empty()) {
+        std::stable_partition(actual_tiles.begin(), actual_tiles.end(),
+            [&priority_regions](const tiling::dlib_tile& tile) {
+                return std::any_of(priority_regions.begin(), priority_regions.end(),
+                    [&tile](const dlib::rectangle& region) {
+                        return !tile.non_overlapping_rect.intersect(region).is_empty();
+                    });
+            });
+    }
+}
 
+template <typename net_type>
+annonet_inspection_result annonet_inspect(
+    net_type& net,
+    const NetPimpl::input_type& input_image,
+    const std::vector<double>& gains,
+    const std::vector<double>& detection_levels,
+    const tiling::parameters& tiling_parameters,
+    inspection_tile_order tile_order,
+    annonet_infer_temp& temp,
+    bool fixed_shape_tiles
+)
+{
+    const bool use_detection_level = is_detection_level_used(detection_levels);
+
+    std::vector<tiling::dlib_tile> actual_tiles = get_actual_tiles(input_image.nc(), input_image.nr(), tiling_parameters, fixed_shape_tiles);
+
+    sort_tiles(actual_tiles, tile_order, std::vector<dlib::rectangle>(), get_rect(input_image));
+
+    annonet_inspection_result result;
+    result.tile_count = actual_tiles.size();
+
+    for (const tiling::dlib_tile& actual_tile : actual_tiles) {
+
+        extract_tile(input_image, actual_tile, temp.input_tile);
+
+        const dlib::matrix<uint16_t> index_label_tile = net(temp.input_tile, gains);
+
+        DLIB_CASSERT(index_label_tile.nr() == temp.input_tile.nr());
+        DLIB_CASSERT(index_label_tile.nc() == temp.input_tile.nc());
+
+        ++result.processed_tile_count;
+
+        const dlib::rectangle valid_rect_in_tile = dlib::translate_rect(actual_tile.non_overlapping_rect, -actual_tile.full_rect.tl_corner());
+
+        if (use_detection_level) {
             const dlib::tensor& output_tensor = net.GetOutput();
 
-            DLIB_CASSERT(output_tensor.nr() == recommended_tile_height);
-            DLIB_CASSERT(output_tensor.nc() == recommended_tile_width);
+            DLIB_CASSERT(output_tensor.nr() == actual_tile.full_rect.height());
+            DLIB_CASSERT(output_tensor.nc() == actual_tile.full_rect.width());
 
-            const float* const out_data = output_tensor.host();
+            temp.detection_seeds.clear();
+            collect_detection_seeds(output_tensor, index_label_tile, valid_rect_in_tile, actual_tile.non_overlapping_rect.tl_corner(), detection_levels, temp.detection_seeds);
 
-            for (long y = 0, valid_tile_height = actual_tile.non_overlapping_rect.height(); y < valid_tile_height; ++y) {
-                for (long x = 0, valid_tile_width = actual_tile.non_overlapping_rect.width(); x < valid_tile_width; ++x) {
-                    const uint16_t label = index_label_tile(valid_top_in_tile + y, valid_left_in_tile + x);
+            if (!temp.detection_seeds.empty()) {
+                const dlib::point& seed = temp.detection_seeds.front();
+                result.defect_found = true;
+                result.location = seed;
+                result.class_index = index_label_tile(seed.y() - actual_tile.full_rect.top(), seed.x() - actual_tile.full_rect.left());
+                return result;
+            }
+        }
+        else {
+            for (long y = valid_rect_in_tile.top(); y <= valid_rect_in_tile.bottom(); ++y) {
+                for (long x = valid_rect_in_tile.left(); x <= valid_rect_in_tile.right(); ++x) {
+                    const uint16_t label = index_label_tile(y, x);
                     if (label > 0) {
-                        const float clean_output = out_data[tensor_index(output_tensor, 0, 0, valid_top_in_tile + y, valid_left_in_tile + x)];
-                        const float label_output = out_data[tensor_index(output_tensor, 0, label, valid_top_in_tile + y, valid_left_in_tile + x)];
-                        if (label_output - clean_output > detection_levels[label] - detection_levels[0]) {
-                            temp.detection_seeds.emplace_back(valid_left_in_image + x, valid_top_in_image + y);
-                        }                        
+                        result.defect_found = true;
+                        result.location = dlib::point(actual_tile.full_rect.left() + x, actual_tile.full_rect.top() + y);
+                        result.class_index = label;
+                        return result;
                     }
                 }
             }
         }
     }
 
-    if (use_detection_level) {
-        const unsigned long connected_blob_count = dlib::label_connected_blobs(result_image, dlib::zero_pixels_are_background(), dlib::neighbors_8(), dlib::connected_if_equal(), temp.connected_blobs);
+    return result;
+}
+
+// ----------------------------------------------------------------------------------------
+
+template <typename net_type>
+annonet_anytime_result annonet_infer_until(
+    net_type& net,
+    const NetPimpl::input_type& input_image,
+    std::chrono::steady_clock::time_point deadline,
+    dlib::matrix<uint16_t>& result_image,
+    dlib::matrix<unsigned char>& coverage_mask,
+    const std::vector<double>& gains,
+    const std::vector<double>& detection_levels,
+    const tiling::parameters& tiling_parameters,
+    inspection_tile_order tile_order,
+    const std::vector<dlib::rectangle>& priority_regions,
+    annonet_infer_temp& temp,
+    bool fixed_shape_tiles
+)
+{
+    result_image.set_size(input_image.nr(), input_image.nc());
+    result_image = 0;
+
+    std::vector<tiling::dlib_tile> actual_tiles = get_actual_tiles(input_image.nc(), input_image.nr(), tiling_parameters, fixed_shape_tiles);
+
+    sort_tiles(actual_tiles, tile_order, priority_regions, get_rect(input_image));
+
+    annonet_anytime_result result;
+    result.tile_count = actual_tiles.size();
+    result.processed_tile_count = annonet_infer_tiles(net, input_image, actual_tiles, result_image, gains, detection_levels, temp, deadline);
+    result.completed = result.processed_tile_count == result.tile_count;
+
+    coverage_mask.set_size(input_image.nr(), input_image.nc());
+    coverage_mask = 0;
+
+    for (size_t i = 0; i < result.processed_tile_count; ++i) {
+        const dlib::rectangle& covered = actual_tiles[i].non_overlapping_rect;
+        dlib::set_subm(coverage_mask, covered) = 255;
+    }
+
+    return result;
+}
+
+// ----------------------------------------------------------------------------------------
+
+template <typename net_type>
+struct annonet_async_infer<net_type>::impl
+{
+    struct job
+    {
+        NetPimpl::input_type input_image;
+        std::vector<tiling::dlib_tile> actual_tiles;
+        dlib::matrix<uint16_t> result_image;
+        std::vector<dlib::point> detection_seeds;
+        std::promise<dlib::matrix<uint16_t>> promise;
+        completion_callback on_complete;
+        std::exception_ptr error;
+    };
+
+    struct prepared_tile
+    {
+        std::shared_ptr<job> owner;
+        size_t tile_index = 0;
+        NetPimpl::input_type input_tile;
+        std::exception_ptr error;
+    };
+
+    impl(net_type& net, size_t max_in_flight, const std::vector<double>& gains, const std::vector<double>& detection_levels, const tiling::parameters& tiling_parameters, bool fixed_shape_tiles)
+        : net(net)
+        , max_in_flight(std::max<size_t>(1, max_in_flight))
+        , gains(gains)
+        , detection_levels(detection_levels)
+        , use_detection_level(is_detection_level_used(detection_levels))
+        , tiling_parameters(tiling_parameters)
+        , fixed_shape_tiles(fixed_shape_tiles)
+        , submitted_jobs(this->max_in_flight)
+        , prepared_tiles(2) // enough for the net thread never to wait, if the tiles come quicker
+    {
+        tile_preparer = std::thread([this]() { prepare_tiles(); });
+        net_runner = std::thread([this]() { run_net(); });
+    }
 
-        std::unordered_set<unsigned int> detected_blobs;
+    ~impl()
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            in_flight_changed.wait(lock, [this]() { return in_flight == 0 && completing == 0; });
+        }
+        submitted_jobs.disable();
+        prepared_tiles.disable();
+        tile_preparer.join();
+        net_runner.join();
+    }
 
-        for (const dlib::point& point : temp.detection_seeds) {
-            const unsigned int blob = temp.connected_blobs(point.y(), point.x());
-            detected_blobs.insert(blob);
+    std::future<dlib::matrix<uint16_t>> submit(NetPimpl::input_type& input_image, completion_callback on_complete)
+    {
+        // everything that can throw comes before the job is counted in, as the destructor
+        // waits for the count to drop back to zero
+        std::shared_ptr<job> new_job = std::make_shared<job>();
+        new_job->on_complete = on_complete;
+        std::future<dlib::matrix<uint16_t>> future = new_job->promise.get_future();
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            in_flight_changed.wait(lock, [this]() { return in_flight < max_in_flight; });
+            ++in_flight;
         }
 
-        const long nr = input_image.nr();
-        const long nc = input_image.nc();
+        new_job->input_image.swap(input_image);
+        submitted_jobs.enqueue(new_job);
+        return future;
+    }
+
+    // Stage 1: tile extraction
+    void prepare_tiles()
+    {
+        std::shared_ptr<job> current_job;
+        while (submitted_jobs.dequeue(current_job)) {
+            try {
+                current_job->actual_tiles = get_actual_tiles(current_job->input_image.nc(), current_job->input_image.nr(), tiling_parameters, fixed_shape_tiles);
+                current_job->result_image.set_size(current_job->input_image.nr(), current_job->input_image.nc());
+            }
+            catch (...) {
+                current_job->error = std::current_exception();
+            }
 
-        for (long r = 0; r < nr; ++r) {
-            for (long c = 0; c < nc; ++c) {
-                const unsigned int blob = temp.connected_blobs(r, c);
-                if (blob > 0) {
-                    if (detected_blobs.find(blob) == detected_blobs.end()) {
-                        result_image(r, c) = 0;
-                    }
+            if (current_job->error || current_job->actual_tiles.empty()) {
+                // no tiles to wait for: hand the job over as is
+                current_job->actual_tiles.clear();
+                prepared_tile tile;
+                tile.owner = current_job;
+                tile.error = current_job->error;
+                prepared_tiles.enqueue(tile);
+                continue;
+            }
+
+            for (size_t i = 0; i < current_job->actual_tiles.size(); ++i) {
+                prepared_tile tile;
+                tile.owner = current_job;
+                tile.tile_index = i;
+                try {
+                    extract_tile(current_job->input_image, current_job->actual_tiles[i], tile.input_tile);
+                }
+                catch (...) {
+                    tile.error = std::current_exception();
+                }
+                prepared_tiles.enqueue(tile);
+            }
+        }
+    }
+
+    // Stage 2: the net, stitching, and post-processing
+    void run_net()
+    {
+        prepared_tile tile;
+        while (prepared_tiles.dequeue(tile)) {
+            job& current_job = *tile.owner;
+
+            if (tile.error && !current_job.error) {
+                current_job.error = tile.error;
+            }
+
+            if (!current_job.error && !current_job.actual_tiles.empty()) {
+                try {
+                    infer_tile(current_job, tile);
+                }
+                catch (...) {
+                    current_job.error = std::current_exception();
                 }
             }
+
+            if (current_job.actual_tiles.empty() || tile.tile_index + 1 == current_job.actual_tiles.size()) {
+                complete(tile.owner);
+            }
+
+            tile = prepared_tile(); // let go of the job
         }
     }
+
+    void infer_tile(job& current_job, const prepared_tile& tile)
+    {
+        const tiling::dlib_tile& actual_tile = current_job.actual_tiles[tile.tile_index];
+
+        const dlib::matrix<uint16_t> index_label_tile = net(tile.input_tile, gains);
+
+        DLIB_CASSERT(index_label_tile.nr() == tile.input_tile.nr());
+        DLIB_CASSERT(index_label_tile.nc() == tile.input_tile.nc());
+
+        const dlib::rectangle valid_rect_in_tile = dlib::translate_rect(actual_tile.non_overlapping_rect, -actual_tile.full_rect.tl_corner());
+
+        for (long y = 0, valid_tile_height = valid_rect_in_tile.height(); y < valid_tile_height; ++y) {
+            const uint16_t* const tile_row = &index_label_tile(valid_rect_in_tile.top() + y, valid_rect_in_tile.left());
+            std::copy(tile_row, tile_row + valid_rect_in_tile.width(), &current_job.result_image(actual_tile.non_overlapping_rect.top() + y, actual_tile.non_overlapping_rect.left()));
+        }
+
+        if (use_detection_level) {
+            const dlib::tensor& output_tensor = net.GetOutput();
+
+            DLIB_CASSERT(output_tensor.nr() == actual_tile.full_rect.height());
+            DLIB_CASSERT(output_tensor.nc() == actual_tile.full_rect.width());
+
+            collect_detection_seeds(output_tensor, index_label_tile, valid_rect_in_tile, actual_tile.non_overlapping_rect.tl_corner(), detection_levels, current_job.detection_seeds);
+        }
+    }
+
+    void complete(const std::shared_ptr<job>& completed_job)
+    {
+        if (!completed_job->error && use_detection_level) {
+            try {
+                keep_detected_blobs(completed_job->result_image, completed_job->detection_seeds, connected_blobs);
+            }
+            catch (...) {
+                completed_job->error = std::current_exception();
+            }
+        }
+
+        // the slot is freed before the callback, so that the callback may submit the next
+        // image; completing keeps the destructor waiting until the job is really done
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            --in_flight;
+            ++completing;
+        }
+        in_flight_changed.notify_all();
+
+        if (completed_job->on_complete) {
+            // the callback is not allowed to take the pipeline down
+            try {
+                completed_job->on_complete(completed_job->result_image, completed_job->error);
+            }
+            catch (std::exception& e) {
+                std::cerr << "Warning: the completion callback threw an exception: " << e.what() << std::endl;
+            }
+            catch (...) {
+                std::cerr << "Warning: the completion callback threw an unknown exception" << std::endl;
+            }
+        }
+
+        if (completed_job->error) {
+            completed_job->promise.set_exception(completed_job->error);
+        }
+        else {
+            completed_job->promise.set_value(std::move(completed_job->result_image));
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            --completing;
+        }
+        in_flight_changed.notify_all();
+    }
+
+    net_type& net;
+    const size_t max_in_flight;
+    const std::vector<double> gains;
+    const std::vector<double> detection_levels;
+    const bool use_detection_level;
+    const tiling::parameters tiling_parameters;
+    const bool fixed_shape_tiles;
+
+    dlib::pipe<std::shared_ptr<job>> submitted_jobs;
+    dlib::pipe<prepared_tile> prepared_tiles;
+    dlib::matrix<unsigned int> connected_blobs;
+
+    mutable std::mutex mutex;
+    std::condition_variable in_flight_changed;
+    size_t in_flight = 0;
+    size_t completing = 0; // jobs no longer in flight, but still in complete()
+
+    std::thread tile_preparer;
+    std::thread net_runner;
+};
+
+template <typename net_type>
+annonet_async_infer<net_type>::annonet_async_infer(
+    net_type& net,
+    size_t max_in_flight,
+    const std::vector<double>& gains,
+    const std::vector<double>& detection_levels,
+    const tiling::parameters& tiling_parameters,
+    bool fixed_shape_tiles
+)
+    : pimpl(new impl(net, max_in_flight, gains, detection_levels, tiling_parameters, fixed_shape_tiles))
+{
 }
+
+template <typename net_type>
+annonet_async_infer<net_type>::~annonet_async_infer()
+{
+}
+
+template <typename net_type>
+std::future<dlib::matrix<uint16_t>> annonet_async_infer<net_type>::submit(NetPimpl::input_type input_image, completion_callback on_complete)
+{
+    return pimpl->submit(input_image, on_complete);
+}
+
+template <typename net_type>
+size_t annonet_async_infer<net_type>::get_in_flight_count() const
+{
+    std::lock_guard<std::mutex> lock(pimpl->mutex);
+    return pimpl->in_flight;
+}
+
+// explicit instantiations for the supported net types
+template void annonet_infer<annonet_runtime_net>(annonet_runtime_net&, const NetPimpl::input_type&, dlib::matrix<uint16_t>&, const std::vector<double>&, const std::vector<double>&, const tiling::parameters&, annonet_infer_temp&, bool);
+template void annonet_infer<annonet_stub_net>(annonet_stub_net&, const NetPimpl::input_type&, dlib::matrix<uint16_t>&, const std::vector<double>&, const std::vector<double>&, const tiling::parameters&, annonet_infer_temp&, bool);
+template void annonet_infer<annonet_runtime_net>(annonet_runtime_net&, const const_frame_view&, dlib::matrix<uint16_t>&, const std::vector<double>&, const std::vector<double>&, const tiling::parameters&, annonet_infer_temp&, bool);
+template void annonet_infer<annonet_stub_net>(annonet_stub_net&, const const_frame_view&, dlib::matrix<uint16_t>&, const std::vector<double>&, const std::vector<double>&, const tiling::parameters&, annonet_infer_temp&, bool);
+template void annonet_infer_canvas<annonet_runtime_net>(annonet_runtime_net&, const std::vector<annonet_canvas_item>&, long, const std::vector<double>&, const std::vector<double>&, annonet_infer_temp&);
+template void annonet_infer_canvas<annonet_stub_net>(annonet_stub_net&, const std::vector<annonet_canvas_item>&, long, const std::vector<double>&, const std::vector<double>&, annonet_infer_temp&);
+template annonet_inspection_result annonet_inspect<annonet_runtime_net>(annonet_runtime_net&, const NetPimpl::input_type&, const std::vector<double>&, const std::vector<double>&, const tiling::parameters&, inspection_tile_order, annonet_infer_temp&, bool);
+template annonet_inspection_result annonet_inspect<annonet_stub_net>(annonet_stub_net&, const NetPimpl::input_type&, const std::vector<double>&, const std::vector<double>&, const tiling::parameters&, inspection_tile_order, annonet_infer_temp&, bool);
+template size_t annonet_infer_regions<annonet_runtime_net>(annonet_runtime_net&, const NetPimpl::input_type&, const std::vector<dlib::rectangle>&, dlib::matrix<uint16_t>&, const std::vector<double>&, const std::vector<double>&, const tiling::parameters&, annonet_infer_temp&, bool);
+template size_t annonet_infer_regions<annonet_stub_net>(annonet_stub_net&, const NetPimpl::input_type&, const std::vector<dlib::rectangle>&, dlib::matrix<uint16_t>&, const std::vector<double>&, const std::vector<double>&, const tiling::parameters&, annonet_infer_temp&, bool);
+template annonet_anytime_result annonet_infer_until<annonet_runtime_net>(annonet_runtime_net&, const NetPimpl::input_type&, std::chrono::steady_clock::time_point, dlib::matrix<uint16_t>&, dlib::matrix<unsigned char>&, const std::vector<double>&, const std::vector<double>&, const tiling::parameters&, inspection_tile_order, const std::vector<dlib::rectangle>&, annonet_infer_temp&, bool);
+template annonet_anytime_result annonet_infer_until<annonet_stub_net>(annonet_stub_net&, const NetPimpl::input_type&, std::chrono::steady_clock::time_point, dlib::matrix<uint16_t>&, dlib::matrix<unsigned char>&, const std::vector<double>&, const std::vector<double>&, const tiling::parameters&, inspection_tile_order, const std::vector<dlib::rectangle>&, annonet_infer_temp&, bool);
+template class annonet_async_infer<annonet_runtime_net>;
+template class annonet_async_infer<annonet_stub_net>;
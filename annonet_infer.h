@@ -21,6 +21,32 @@
 
 #include "dlib-dnn-pimpl-wrapper/NetPimpl.h"
 #include "tiling/tiling.h"
+#include <dlib/image_processing/generic_image.h>
+
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+
+// A read-only view of a grayscale frame in memory owned by someone else (for example, a
+// shared-memory frame ring); annonet_infer can process it in place
+struct const_frame_view
+{
+    const unsigned char* data = nullptr;
+    long width = 0;
+    long height = 0;
+    long stride = 0; // bytes per row
+};
+
+// The dlib generic image interface, so that tiles can be extracted from frames directly
+namespace dlib {
+    template <> struct image_traits<const_frame_view> { typedef unsigned char pixel_type; };
+}
+inline long num_rows(const const_frame_view& frame) { return frame.height; }
+inline long num_columns(const const_frame_view& frame) { return frame.width; }
+inline long width_step(const const_frame_view& frame) { return frame.stride; }
+inline const void* image_data(const const_frame_view& frame) { return frame.data; }
 
 // Can be supplied to avoid unnecessary memory re-allocations
 struct annonet_infer_temp
@@ -30,14 +56,210 @@ struct annonet_infer_temp
     dlib::matrix<unsigned int> connected_blobs;
 };
 
+// The net_type is normally annonet_runtime_net, but annonet_stub_net can be
+// used as well, in order to measure the pipeline overhead.
+//
+// With fixed_shape_tiles, all the tiles of the image get the shape of the largest
+// one, and the edge tiles are shifted inward instead of shrinking; then the net
+// sees a single input shape per image, and need not reallocate its tensors.
+template <typename net_type>
 void annonet_infer(
-    NetPimpl::RuntimeNet& net,
+    net_type& net,
     const NetPimpl::input_type& input_image,
     dlib::matrix<uint16_t>& result_image,
     const std::vector<double>& gains = std::vector<double>(),
     const std::vector<double>& detection_levels = std::vector<double>(),
     const tiling::parameters& tiling_parameters = tiling::parameters(),
+    annonet_infer_temp& temp = annonet_infer_temp(),
+    bool fixed_shape_tiles = false
+);
+
+// The same for a frame that is not in a dlib matrix
+template <typename net_type>
+void annonet_infer(
+    net_type& net,
+    const const_frame_view& input_frame,
+    dlib::matrix<uint16_t>& result_image,
+    const std::vector<double>& gains = std::vector<double>(),
+    const std::vector<double>& detection_levels = std::vector<double>(),
+    const tiling::parameters& tiling_parameters = tiling::parameters(),
+    annonet_infer_temp& temp = annonet_infer_temp(),
+    bool fixed_shape_tiles = false
+);
+
+// Small images would each need a tile of their own, mostly padding. Instead, they can be
+// packed shelf by shelf into a shared canvas, and inferred in a single forward pass. The
+// gap between the images should be at least the receptive field of the net; each image
+// gets half of it as an outpainted margin, so the neighbors do not affect the results.
+class canvas_packer
+{
+public:
+    canvas_packer(long max_canvas_width, long max_canvas_height, long gap);
+
+    // Whether an image of this size fits in an (empty) canvas at all
+    bool fits(long image_width, long image_height) const;
+
+    // Returns false if the canvas is full; then infer, clear, and try again
+    bool try_add(long image_width, long image_height, dlib::rectangle& image_rect_in_canvas);
+
+    void clear();
+
+    size_t get_image_count() const { return image_count; }
+    long get_margin() const { return margin; }
+
+private:
+    const long max_canvas_width;
+    const long max_canvas_height;
+    const long margin;
+
+    long shelf_left = 0;
+    long shelf_top = 0;
+    long shelf_height = 0;
+    size_t image_count = 0;
+};
+
+struct annonet_canvas_item
+{
+    const NetPimpl::input_type* input_image = nullptr;
+    dlib::matrix<uint16_t>* result_image = nullptr;
+    dlib::rectangle image_rect_in_canvas; // as given by canvas_packer::try_add
+};
+
+// Infers all the items in one canvas; margin is canvas_packer::get_margin()
+template <typename net_type>
+void annonet_infer_canvas(
+    net_type& net,
+    const std::vector<annonet_canvas_item>& items,
+    long margin,
+    const std::vector<double>& gains = std::vector<double>(),
+    const std::vector<double>& detection_levels = std::vector<double>(),
     annonet_infer_temp& temp = annonet_infer_temp()
 );
 
+// Infers only the tiles that cover any of the regions of interest (for example, the
+// labeled areas of a validation image, grown by the receptive field); the rest of the
+// result image is left zero. Returns the number of tiles processed. With detection levels,
+// the blobs are seeded from the processed tiles only, so a blob whose seed lies elsewhere
+// is dropped.
+template <typename net_type>
+size_t annonet_infer_regions(
+    net_type& net,
+    const NetPimpl::input_type& input_image,
+    const std::vector<dlib::rectangle>& regions_of_interest,
+    dlib::matrix<uint16_t>& result_image,
+    const std::vector<double>& gains = std::vector<double>(),
+    const std::vector<double>& detection_levels = std::vector<double>(),
+    const tiling::parameters& tiling_parameters = tiling::parameters(),
+    annonet_infer_temp& temp = annonet_infer_temp(),
+    bool fixed_shape_tiles = false
+);
+
+// ----------------------------------------------------------------------------------------
+
+// For pass/fail inspection (and anytime inference), the tiles can be processed in the order
+// in which defects are most likely to be found (or that matters the most)
+enum class inspection_tile_order
+{
+    tiling,       // as returned by the tiling: row by row
+    center_first, // the tiles closest to the center of the image first
+    edges_first   // the tiles closest to the edges of the image first
+};
+
+inspection_tile_order parse_inspection_tile_order(const std::string& name);
+std::string to_string(inspection_tile_order order);
+
+struct annonet_inspection_result
+{
+    bool defect_found = false;
+    dlib::point location;      // in the input image, if a defect was found
+    uint16_t class_index = 0;  // if a defect was found
+    size_t processed_tile_count = 0;
+    size_t tile_count = 0;
+};
+
+// Returns as soon as any pixel would be labeled a defect (of any non-zero class) by
+// annonet_infer: with detection levels, a pixel that passes its detection level; the
+// blob filtering is skipped, because every blob that survives contains such a pixel.
+template <typename net_type>
+annonet_inspection_result annonet_inspect(
+    net_type& net,
+    const NetPimpl::input_type& input_image,
+    const std::vector<double>& gains = std::vector<double>(),
+    const std::vector<double>& detection_levels = std::vector<double>(),
+    const tiling::parameters& tiling_parameters = tiling::parameters(),
+    inspection_tile_order tile_order = inspection_tile_order::tiling,
+    annonet_infer_temp& temp = annonet_infer_temp(),
+    bool fixed_shape_tiles = false
+);
+
+// ----------------------------------------------------------------------------------------
+
+struct annonet_anytime_result
+{
+    bool completed = false; // whether all the tiles were processed in time
+    size_t processed_tile_count = 0;
+    size_t tile_count = 0;
+};
+
+// Anytime inference: processes the tiles in priority order (those intersecting any of the
+// priority regions first, then according to the tile order) until the deadline, and returns
+// what is done by then. The coverage mask is 255 where result_image is valid, and 0 where
+// the tiles were not processed in time (and where result_image is left zero).
+template <typename net_type>
+annonet_anytime_result annonet_infer_until(
+    net_type& net,
+    const NetPimpl::input_type& input_image,
+    std::chrono::steady_clock::time_point deadline,
+    dlib::matrix<uint16_t>& result_image,
+    dlib::matrix<unsigned char>& coverage_mask,
+    const std::vector<double>& gains = std::vector<double>(),
+    const std::vector<double>& detection_levels = std::vector<double>(),
+    const tiling::parameters& tiling_parameters = tiling::parameters(),
+    inspection_tile_order tile_order = inspection_tile_order::tiling,
+    const std::vector<dlib::rectangle>& priority_regions = std::vector<dlib::rectangle>(),
+    annonet_infer_temp& temp = annonet_infer_temp(),
+    bool fixed_shape_tiles = false
+);
+
+// ----------------------------------------------------------------------------------------
+
+// Asynchronous inference: submit() returns right away (unless too many images are in flight
+// already), and the result is delivered through a future and/or a completion callback. The
+// images go through a two-stage pipeline: one thread extracts (and outpaints) the tiles,
+// while another runs the net, so the tiles of the next image are ready when the net is. The
+// net must not be used by anyone else while an annonet_async_infer is using it.
+template <typename net_type>
+class annonet_async_infer
+{
+public:
+    // Called in the net thread, before the future becomes ready; error is null on success.
+    // The image no longer counts as in flight by then, so the callback may submit another
+    // one. Exceptions thrown by the callback are printed to std::cerr, and otherwise ignored.
+    typedef std::function<void(const dlib::matrix<uint16_t>& result_image, std::exception_ptr error)> completion_callback;
+
+    annonet_async_infer(
+        net_type& net,
+        size_t max_in_flight,
+        const std::vector<double>& gains = std::vector<double>(),
+        const std::vector<double>& detection_levels = std::vector<double>(),
+        const tiling::parameters& tiling_parameters = tiling::parameters(),
+        bool fixed_shape_tiles = false
+    );
+
+    // Waits until all the submitted images have been processed
+    ~annonet_async_infer();
+
+    annonet_async_infer(const annonet_async_infer&) = delete;
+    annonet_async_infer& operator=(const annonet_async_infer&) = delete;
+
+    // The input image is moved in (pass a copy to keep it)
+    std::future<dlib::matrix<uint16_t>> submit(NetPimpl::input_type input_image, completion_callback on_complete = completion_callback());
+
+    size_t get_in_flight_count() const;
+
+private:
+    struct impl;
+    std::unique_ptr<impl> pimpl;
+};
+
 #endif // ANNONET_INFER_H
@@ -14,11 +14,20 @@
 */
 
 #include "annonet.h"
+#include "annonet_frame_ring.h"
 #include "annonet_infer.h"
+#include "annonet_kernels.h"
+#include "annonet_runtime_net.h"
+#include "annonet_stub_net.h"
+#include "annonet_tar.h"
 
 #include "cxxopts/include/cxxopts.hpp"
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <memory>
 #include <dlib/data_io.h>
+#include <dlib/dir_nav.h>
 #include <dlib/gui_widgets.h>
 #include <dlib/image_saver/save_png.h>
 
@@ -64,11 +73,30 @@ std::vector<double> parse_class_specific_values(const std::vector<std::string>&
 
 // ----------------------------------------------------------------------------------------
 
-inline rgb_alpha_pixel index_label_to_rgba_label(uint16_t index_label, const std::vector<AnnoClass>& anno_classes)
+// Tar archives are not written to, so the results of the images in an archive go to
+// a directory tree next to it: /path/to/archive.tar_results/member_result.png
+std::string get_result_filename(const std::string& image_filename)
 {
-    const AnnoClass& anno_class = anno_classes[index_label];
-    assert(anno_class.index == index_label);
-    return anno_class.rgba_label;
+    std::string archive_filename, member_name;
+    if (!split_tar_path(image_filename, archive_filename, member_name)) {
+        return image_filename + "_result.png";
+    }
+
+    const std::string result_filename = archive_filename + "_results/" + member_name + "_result.png";
+
+    for (size_t separator = result_filename.find('/', archive_filename.size()); separator != std::string::npos; separator = result_filename.find('/', separator + 1)) {
+        dlib::create_directory(result_filename.substr(0, separator));
+    }
+
+    return result_filename;
+}
+
+// /path/to/image_result.png -> /path/to/image_result_coverage.png
+std::string get_coverage_filename(const std::string& result_filename)
+{
+    const std::string extension = ".png";
+    assert(result_filename.size() >= extension.size());
+    return result_filename.substr(0, result_filename.size() - extension.size()) + "_coverage.png";
 }
 
 void index_label_image_to_rgba_label_image(const matrix<uint16_t>& index_label_image, matrix<rgb_alpha_pixel>& rgba_label_image, const std::vector<AnnoClass>& anno_classes)
@@ -78,10 +106,22 @@ void index_label_image_to_rgba_label_image(const matrix<uint16_t>& index_label_i
 
     rgba_label_image.set_size(nr, nc);
 
+    if (nr == 0 || nc == 0) {
+        return;
+    }
+
+    std::vector<uint32_t> palette(anno_classes.size());
+    for (size_t i = 0; i < anno_classes.size(); ++i) {
+        assert(anno_classes[i].index == i);
+        palette[i] = pack_rgba_label(anno_classes[i].rgba_label);
+    }
+
+    const annonet_kernels& kernels = get_kernels();
+
     for (long r = 0; r < nr; ++r) {
-        for (long c = 0; c < nc; ++c) {
-            rgba_label_image(r, c) = index_label_to_rgba_label(index_label_image(r, c), anno_classes);
-        }
+        kernels.colorize_labels(
+            &index_label_image(r, 0), nc, palette.data(), palette.size(),
+            reinterpret_cast<uint32_t*>(&rgba_label_image(r, 0)));
     }
 }
 
@@ -273,6 +313,131 @@ void update_confusion_matrix_per_region(
     }
 }
 
+// The bounding boxes of the connected labeled areas (of any classes), grown by the margin
+std::vector<dlib::rectangle> get_labeled_regions(const sample& sample, long margin, dlib::matrix<unsigned long>& labeled_blobs)
+{
+    const auto is_unlabeled = [](const dlib::matrix<uint16_t>& label_image, const dlib::point& p) {
+        return label_image(p.y(), p.x()) == dlib::loss_multiclass_log_per_pixel_::label_to_ignore;
+    };
+    const auto is_connected = [](const dlib::matrix<uint16_t>&, const dlib::point&, const dlib::point&) {
+        return true;
+    };
+
+    const unsigned long blob_count = dlib::label_connected_blobs(sample.label_image, is_unlabeled, neighbors_8(), is_connected, labeled_blobs);
+
+    std::vector<dlib::rectangle> bounding_boxes(blob_count);
+
+    for (const auto& labeled_points : sample.labeled_points_by_class) {
+        for (const dlib::point& point : labeled_points.second) {
+            bounding_boxes[labeled_blobs(point.y(), point.x())] += point;
+        }
+    }
+
+    std::vector<dlib::rectangle> regions;
+    for (const dlib::rectangle& bounding_box : bounding_boxes) {
+        if (!bounding_box.is_empty()) {
+            regions.push_back(grow_rect(bounding_box, margin).intersect(get_rect(sample.label_image)));
+        }
+    }
+    return regions;
+}
+
+// ----------------------------------------------------------------------------------------
+
+// Runs until the producer closes the input ring; each frame is inferred in place, and its
+// slot is handed back before the results are published
+template <typename net_type>
+void infer_frame_ring(
+    net_type& net,
+    shared_frame_ring& input_ring,
+    shared_frame_ring* output_ring,
+    const std::vector<double>& gains,
+    const std::vector<double>& detection_levels,
+    const tiling::parameters& tiling_parameters,
+    annonet_infer_temp& temp,
+    bool fixed_shape_tiles,
+    std::chrono::milliseconds output_ring_timeout
+)
+{
+    const frame_ring_header& input_header = input_ring.get_header();
+
+    if (input_header.format != frame_format::gray8) {
+        throw std::runtime_error("Unsupported input frame format (only gray8 frames can be inferred)");
+    }
+
+    std::cout << "Frames: " << input_header.width << " x " << input_header.height << ", " << input_header.slot_count << " slots" << std::endl;
+
+    const std::chrono::milliseconds poll_interval(100);
+
+    matrix<uint16_t> result_image;
+    size_t frame_count = 0;
+    size_t dropped_count = 0;
+
+    const auto t0 = std::chrono::steady_clock::now();
+
+    while (true) {
+        uint32_t input_slot = 0;
+        if (!input_ring.acquire_ready_slot(input_slot, poll_interval)) {
+            if (input_header.closed.load() != 0) {
+                break;
+            }
+            continue;
+        }
+
+        const frame_ring_slot_state& input_slot_state = input_ring.get_slot_state(input_slot);
+        const uint64_t sequence_number = input_slot_state.sequence_number;
+        const int64_t timestamp = input_slot_state.timestamp;
+
+        const_frame_view input_frame;
+        input_frame.data = input_ring.get_slot_data(input_slot);
+        input_frame.width = input_header.width;
+        input_frame.height = input_header.height;
+        input_frame.stride = input_header.stride;
+
+        annonet_infer(net, input_frame, result_image, gains, detection_levels, tiling_parameters, temp, fixed_shape_tiles);
+
+        input_ring.release_slot(input_slot);
+
+        if (output_ring) {
+            // back-pressure: wait while the consumer of the results is behind - but not
+            // forever, and no longer once the producer is done
+            uint32_t output_slot = 0;
+            const auto output_deadline = std::chrono::steady_clock::now() + output_ring_timeout;
+            bool output_slot_acquired = false;
+            while (!(output_slot_acquired = output_ring->acquire_free_slot(output_slot, poll_interval))) {
+                if (input_header.closed.load() != 0 || std::chrono::steady_clock::now() >= output_deadline) {
+                    break;
+                }
+            }
+            if (output_slot_acquired) {
+                const frame_ring_header& output_header = output_ring->get_header();
+                unsigned char* const output_data = output_ring->get_slot_data(output_slot);
+                for (long r = 0; r < result_image.nr(); ++r) {
+                    std::copy(&result_image(r, 0), &result_image(r, 0) + result_image.nc(), reinterpret_cast<uint16_t*>(output_data + r * output_header.stride));
+                }
+                output_ring->publish_slot(output_slot, sequence_number, timestamp);
+            }
+            else {
+                ++dropped_count;
+                std::cout << "\nWarning: no free slot in the output ring, dropping the result of frame " << sequence_number << std::endl;
+            }
+        }
+
+        ++frame_count;
+        std::cout << "\rProcessed frame " << sequence_number << "...";
+    }
+
+    if (output_ring) {
+        output_ring->close();
+    }
+
+    const double elapsed_seconds = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count() / 1000.0;
+    std::cout << "\nInput frame ring closed; " << frame_count << " frames processed in " << elapsed_seconds << " seconds" << std::endl;
+    if (dropped_count > 0) {
+        std::cout << "Warning: the results of " << dropped_count << " frames were dropped, because the output ring was full" << std::endl;
+    }
+}
+
 // ----------------------------------------------------------------------------------------
 
 struct result_image_type {
@@ -280,8 +445,22 @@ struct result_image_type {
     int original_width = 0;
     int original_height = 0;
     matrix<uint16_t> label_image;
+    matrix<unsigned char> coverage_mask; // only with a deadline
 };
 
+// The format is left,top,width,height (in pixels of the original image)
+dlib::rectangle parse_region(const std::string& string_from_command_line)
+{
+    std::istringstream in(string_from_command_line);
+    long left = 0, top = 0, width = 0, height = 0;
+    char separator1 = 0, separator2 = 0, separator3 = 0;
+    in >> left >> separator1 >> top >> separator2 >> width >> separator3 >> height;
+    if (!in || separator1 != ',' || separator2 != ',' || separator3 != ',' || width <= 0 || height <= 0) {
+        throw std::runtime_error("The regions must be supplied in the format left,top,width,height (e.g., 100,50,400,300)");
+    }
+    return dlib::rectangle(left, top, left + width - 1, top + height - 1);
+}
+
 int main(int argc, char** argv) try
 {
     if (argc == 1)
@@ -314,17 +493,56 @@ int main(int argc, char** argv) try
         ("d,detection", "Supply a class-specific detection level that _comes on top of gain_, for example: 1:1.5", cxxopts::value<std::vector<std::string>>())
         ("w,tile-max-width", "Set max tile width", cxxopts::value<int>()->default_value(default_max_tile_width))
         ("h,tile-max-height", "Set max tile height", cxxopts::value<int>()->default_value(default_max_tile_height))
+        ("fixed-shape-tiles", "Give all the tiles of an image the same shape, shifting the edge tiles inward instead of shrinking them")
+        ("inspect", "Pass/fail inspection: stop processing each image at its first defect pixel (of any non-zero class, taking the detection levels into account), and report the location instead of writing result images")
+        ("inspection-tile-order", "Set the order in which the tiles are processed with --inspect or --deadline: tiling, center-first, or edges-first", cxxopts::value<std::string>()->default_value("tiling"))
+        ("deadline", "Anytime inference: stop processing each image after this many milliseconds, and write the partial result along with a coverage mask", cxxopts::value<double>())
+        ("priority-region", "With --deadline, process the tiles intersecting this region first, for example: 100,50,400,300 (left,top,width,height)", cxxopts::value<std::vector<std::string>>())
+        ("labeled-areas-only", "Evaluation: infer only the tiles that cover the labeled areas (the result images are left blank elsewhere; images without labels are inferred as a whole). Ignored with --detection, which needs the whole images")
+        ("pack-small-images", "Pack the images that fit in a tile into shared canvas tiles, and infer several of them at once")
+        ("input-ring", "Instead of an input directory, infer the frames of this shared-memory frame ring (created by the acquisition process)", cxxopts::value<std::string>())
+        ("output-ring", "With --input-ring, publish the results to a shared-memory frame ring of this name (created by annonet_infer)", cxxopts::value<std::string>())
+        ("output-ring-timeout", "With --output-ring, drop a result if no output slot becomes free in this many seconds", cxxopts::value<double>()->default_value("10"))
         ("full-image-reader-thread-count", "Set the number of full-image reader threads", cxxopts::value<int>()->default_value(hardware_concurrency.str()))
         ("result-image-writer-thread-count", "Set the number of result-image writer threads", cxxopts::value<int>()->default_value(hardware_concurrency.str()))
+        ("net-backend", "Set the net backend: dnn (annonet.dnn), or stub (a per-pixel threshold, for measuring the pipeline overhead)", cxxopts::value<std::string>()->default_value("dnn"))
+        ("stub-net-threshold", "Set the threshold used by the stub net backend", cxxopts::value<double>()->default_value("128.0"))
+        ("benchmark-result-file", "Write the throughput figures to this JSON file", cxxopts::value<std::string>())
+        ("force-isa", "Use the per-pixel kernels of this instruction set level: generic, sse41, avx2, or avx512 (default: the best supported)", cxxopts::value<std::string>())
         ;
 
     try {
         options.parse_positional("input-directory");
         options.parse(argc, argv);
 
-        cxxopts::check_required(options, { "input-directory" });
+        if (options.count("input-ring") == 1) {
+            std::cout << "Input frame ring = " << options["input-ring"].as<std::string>() << std::endl;
+        }
+        else {
+            cxxopts::check_required(options, { "input-directory" });
+
+            std::cout << "Input directory = " << options["input-directory"].as<std::string>() << std::endl;
+        }
 
-        std::cout << "Input directory = " << options["input-directory"].as<std::string>() << std::endl;
+        const std::string net_backend = options["net-backend"].as<std::string>();
+        if (net_backend != "dnn" && net_backend != "stub") {
+            throw std::runtime_error("Unknown net backend: " + net_backend);
+        }
+
+        parse_inspection_tile_order(options["inspection-tile-order"].as<std::string>());
+
+        if (options.count("deadline") == 1 && options["deadline"].as<double>() <= 0.0) {
+            throw std::runtime_error("The deadline must be positive");
+        }
+
+        if (options["output-ring-timeout"].as<double>() < 0.0) {
+            throw std::runtime_error("The output ring timeout must not be negative");
+        }
+
+        if (options.count("force-isa") == 1) {
+            select_kernels(parse_isa_level(options["force-isa"].as<std::string>()));
+        }
+        std::cout << "Instruction set level = " << to_string(get_kernels().isa) << std::endl;
     }
     catch (std::exception& e) {
         cerr << e.what() << std::endl;
@@ -333,18 +551,43 @@ int main(int argc, char** argv) try
         return 2;
     }
 
+    const bool use_stub_net = options["net-backend"].as<std::string>() == "stub";
+
     double downscaling_factor = 1.0;
     std::string serialized_runtime_net;
     std::string anno_classes_json;
-    deserialize("annonet.dnn") >> anno_classes_json >> downscaling_factor >> serialized_runtime_net;
 
-    std::cout << "Deserializing annonet, downscaling factor = " << downscaling_factor << std::endl;
+    annonet_runtime_net net;
 
-    NetPimpl::RuntimeNet net;
-    net.Deserialize(std::istringstream(serialized_runtime_net));
+    if (!use_stub_net || std::ifstream("annonet.dnn", std::ios::binary)) {
+        deserialize("annonet.dnn") >> anno_classes_json >> downscaling_factor >> serialized_runtime_net;
+
+        std::cout << "Deserializing annonet, downscaling factor = " << downscaling_factor << std::endl;
+    }
+    else {
+        // without a trained net, take the classes from the data, so that its masks can be decoded
+        if (options.count("input-directory") == 1) {
+            anno_classes_json = read_anno_classes_file(options["input-directory"].as<std::string>());
+        }
+        std::cout << "No annonet.dnn found, downscaling factor = " << downscaling_factor << std::endl;
+    }
+
+    if (!use_stub_net) {
+        net.Deserialize(serialized_runtime_net);
+        std::cout << "Net variant = " << net.GetVariantName() << std::endl;
+    }
 
     const std::vector<AnnoClass> anno_classes = parse_anno_classes(anno_classes_json);
 
+    // With a class remapping in training, the label images have more colors than the net has classes
+    const std::vector<AnnoClass> decoding_anno_classes = parse_decoding_anno_classes(anno_classes_json);
+
+    annonet_stub_net stub_net(static_cast<uint16_t>(anno_classes.size()), options["stub-net-threshold"].as<double>());
+
+    if (use_stub_net) {
+        std::cout << "Using the stub net backend, threshold = " << options["stub-net-threshold"].as<double>() << std::endl;
+    }
+
     DLIB_CASSERT(anno_classes.size() >= 2);
 
     const std::vector<double> gains = parse_class_specific_values(options["gain"].as<std::vector<std::string>>(), anno_classes.size());
@@ -370,6 +613,39 @@ int main(int argc, char** argv) try
     annonet_infer_temp temp;
     matrix<uint16_t> index_label_tile_resized;
 
+    const int min_input_dimension = NetPimpl::TrainingNet::GetRequiredInputDimension();
+
+    tiling::parameters tiling_parameters;
+    tiling_parameters.max_tile_width = options["tile-max-width"].as<int>();
+    tiling_parameters.max_tile_height = options["tile-max-height"].as<int>();
+    tiling_parameters.overlap_x = min_input_dimension;
+    tiling_parameters.overlap_y = min_input_dimension;
+
+    DLIB_CASSERT(tiling_parameters.max_tile_width >= min_input_dimension);
+    DLIB_CASSERT(tiling_parameters.max_tile_height >= min_input_dimension);
+
+    const bool fixed_shape_tiles = options.count("fixed-shape-tiles") > 0;
+
+    if (options.count("input-ring") == 1) {
+        if (downscaling_factor != 1.0) {
+            throw std::runtime_error("Frame rings are not supported with downscaling (the frames are inferred in place)");
+        }
+        shared_frame_ring input_ring(options["input-ring"].as<std::string>());
+        std::unique_ptr<shared_frame_ring> output_ring;
+        const std::chrono::milliseconds output_ring_timeout(static_cast<long long>(options["output-ring-timeout"].as<double>() * 1000.0));
+        if (options.count("output-ring") == 1) {
+            const frame_ring_header& header = input_ring.get_header();
+            output_ring.reset(new shared_frame_ring(options["output-ring"].as<std::string>(), header.slot_count, header.width, header.height, frame_format::label16));
+        }
+        if (use_stub_net) {
+            infer_frame_ring(stub_net, input_ring, output_ring.get(), gains, detection_levels, tiling_parameters, temp, fixed_shape_tiles, output_ring_timeout);
+        }
+        else {
+            infer_frame_ring(net, input_ring, output_ring.get(), gains, detection_levels, tiling_parameters, temp, fixed_shape_tiles, output_ring_timeout);
+        }
+        return 0;
+    }
+
     auto files = find_image_files(options["input-directory"].as<std::string>(), false);
 
     dlib::pipe<image_filenames> full_image_read_requests(files.size());
@@ -388,7 +664,7 @@ int main(int argc, char** argv) try
         full_image_readers.push_back(std::thread([&]() {
             image_filenames image_filenames;
             while (full_image_read_requests.dequeue(image_filenames)) {
-                full_image_read_results.enqueue(read_sample(image_filenames, anno_classes, false, downscaling_factor));
+                full_image_read_results.enqueue(read_sample(image_filenames, decoding_anno_classes, false, downscaling_factor));
             }
         }));
     }
@@ -406,32 +682,111 @@ int main(int argc, char** argv) try
                 resize_label_image(result_image.label_image, result_image.original_width, result_image.original_height);
                 index_label_image_to_rgba_label_image(result_image.label_image, rgba_label_image, anno_classes);
                 save_png(rgba_label_image, result_image.filename);
+                if (result_image.coverage_mask.size() > 0) {
+                    resize_label_image(result_image.coverage_mask, result_image.original_width, result_image.original_height);
+                    save_png(result_image.coverage_mask, get_coverage_filename(result_image.filename));
+                }
                 result_image_write_results.enqueue(true);
             }
         }));
     }
 
-    const int min_input_dimension = NetPimpl::TrainingNet::GetRequiredInputDimension();
-
-    tiling::parameters tiling_parameters;
-    tiling_parameters.max_tile_width = options["tile-max-width"].as<int>();
-    tiling_parameters.max_tile_height = options["tile-max-height"].as<int>();
-    tiling_parameters.overlap_x = min_input_dimension;
-    tiling_parameters.overlap_y = min_input_dimension;
-
-    DLIB_CASSERT(tiling_parameters.max_tile_width >= min_input_dimension);
-    DLIB_CASSERT(tiling_parameters.max_tile_height >= min_input_dimension);
-
     // first index: ground truth, second index: predicted
     confusion_matrix_type confusion_matrix_per_pixel, confusion_matrix_per_region;
     init_confusion_matrix(confusion_matrix_per_pixel, anno_classes.size());
     init_confusion_matrix(confusion_matrix_per_region, anno_classes.size());
     size_t ground_truth_count = 0;
+    double processed_pixel_count = 0.0;
 
     const auto t0 = std::chrono::steady_clock::now();
 
     update_confusion_matrix_per_region_temp update_confusion_matrix_per_region_temp;
 
+    size_t result_image_count = 0;
+
+    std::unordered_map<uint16_t, std::deque<dlib::point>> covered_labeled_points_by_class;
+
+    const auto finish_sample = [&](const sample& sample, result_image_type& result_image) {
+        processed_pixel_count += static_cast<double>(sample.input_image.nr()) * sample.input_image.nc();
+
+        // With a deadline, the tiles that were not processed are left blank, and their labeled
+        // points are not counted in the confusion matrices (as if they were unlabeled)
+        const bool use_coverage_mask = result_image.coverage_mask.size() > 0;
+        if (use_coverage_mask) {
+            covered_labeled_points_by_class.clear();
+            for (const auto& labeled_points : sample.labeled_points_by_class) {
+                for (const dlib::point& point : labeled_points.second) {
+                    if (result_image.coverage_mask(point.y(), point.x()) != 0) {
+                        covered_labeled_points_by_class[labeled_points.first].push_back(point);
+                    }
+                }
+            }
+        }
+        const auto& labeled_points_by_class = use_coverage_mask ? covered_labeled_points_by_class : sample.labeled_points_by_class;
+
+        for (const auto& labeled_points : labeled_points_by_class) {
+            const uint16_t ground_truth_value = labeled_points.first;
+            for (const dlib::point& point : labeled_points.second) {
+                const uint16_t predicted_value = result_image.label_image(point.y(), point.x());
+                ++confusion_matrix_per_pixel[ground_truth_value][predicted_value];
+            }
+            ground_truth_count += labeled_points.second.size();
+        }
+
+        update_confusion_matrix_per_region(confusion_matrix_per_region, labeled_points_by_class, sample.label_image, result_image.label_image, update_confusion_matrix_per_region_temp);
+
+        result_image_write_requests.enqueue(result_image);
+        ++result_image_count;
+    };
+
+    const bool inspect = options.count("inspect") > 0;
+    const inspection_tile_order tile_order = parse_inspection_tile_order(options["inspection-tile-order"].as<std::string>());
+    size_t defective_image_count = 0;
+    size_t inspected_tile_count = 0;
+    size_t total_tile_count = 0;
+
+    const bool use_deadline = options.count("deadline") > 0 && !inspect;
+    const auto deadline_duration = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(use_deadline ? options["deadline"].as<double>() : 0.0));
+    std::vector<dlib::rectangle> priority_regions;
+    for (const std::string& region : options["priority-region"].as<std::vector<std::string>>()) {
+        const dlib::rectangle original_region = parse_region(region);
+        priority_regions.push_back(dlib::rectangle(
+            static_cast<long>(original_region.left() / downscaling_factor), static_cast<long>(original_region.top() / downscaling_factor),
+            static_cast<long>(original_region.right() / downscaling_factor), static_cast<long>(original_region.bottom() / downscaling_factor)));
+    }
+    size_t incomplete_image_count = 0;
+
+    // A detected blob can extend (and have its seed) outside the labeled areas, so with
+    // detection levels the images are inferred as a whole, and the results stay the same
+    const bool use_detection_levels = std::any_of(detection_levels.begin(), detection_levels.end(), [](double level) { return level > 0.0; });
+    const bool labeled_areas_only = options.count("labeled-areas-only") > 0 && !inspect && !use_deadline && !use_detection_levels;
+    if (options.count("labeled-areas-only") > 0 && use_detection_levels) {
+        std::cout << "Detection levels in use - inferring the whole images instead of the labeled areas only" << std::endl;
+    }
+    dlib::matrix<unsigned long> labeled_blobs;
+    size_t labeled_area_tile_count = 0;
+
+    // The gap between packed images is the same as the overlap between tiles
+    const bool pack_small_images = options.count("pack-small-images") > 0 && !inspect && !labeled_areas_only && !use_deadline;
+    canvas_packer packer(tiling_parameters.max_tile_width, tiling_parameters.max_tile_height, min_input_dimension);
+    std::deque<std::pair<sample, result_image_type>> packed_samples; // a deque, so that the items can point into it
+    std::vector<annonet_canvas_item> canvas_items;
+
+    const auto infer_canvas = [&]() {
+        if (use_stub_net) {
+            annonet_infer_canvas(stub_net, canvas_items, packer.get_margin(), gains, detection_levels, temp);
+        }
+        else {
+            annonet_infer_canvas(net, canvas_items, packer.get_margin(), gains, detection_levels, temp);
+        }
+        for (auto& packed_sample : packed_samples) {
+            finish_sample(packed_sample.first, packed_sample.second);
+        }
+        packed_samples.clear();
+        canvas_items.clear();
+        packer.clear();
+    };
+
     for (size_t i = 0, end = files.size(); i < end; ++i)
     {
         std::cout << "\rProcessing image " << (i + 1) << " of " << end << "...";
@@ -447,38 +802,120 @@ int main(int argc, char** argv) try
 
         const auto& input_image = sample.input_image;
 
-        result_image.filename = sample.image_filenames.image_filename + "_result.png";
+        if (inspect) {
+            const annonet_inspection_result inspection_result = use_stub_net
+                ? annonet_inspect(stub_net, input_image, gains, detection_levels, tiling_parameters, tile_order, temp, fixed_shape_tiles)
+                : annonet_inspect(net, input_image, gains, detection_levels, tiling_parameters, tile_order, temp, fixed_shape_tiles);
+
+            processed_pixel_count += static_cast<double>(input_image.nr()) * input_image.nc();
+            inspected_tile_count += inspection_result.processed_tile_count;
+            total_tile_count += inspection_result.tile_count;
+
+            if (inspection_result.defect_found) {
+                ++defective_image_count;
+                // report the location in the original (not downscaled) image
+                const long x = inspection_result.location.x() * sample.original_width / std::max(1L, input_image.nc());
+                const long y = inspection_result.location.y() * sample.original_height / std::max(1L, input_image.nr());
+                std::cout << "\rFAIL " << sample.image_filenames.image_filename << ": class " << inspection_result.class_index
+                    << " at (" << x << ", " << y << "), after " << inspection_result.processed_tile_count << " of " << inspection_result.tile_count << " tiles" << std::endl;
+            }
+            else {
+                std::cout << "\rPASS " << sample.image_filenames.image_filename << std::endl;
+            }
+            continue;
+        }
+
+        result_image.filename = get_result_filename(sample.image_filenames.image_filename);
         result_image.label_image.set_size(input_image.nr(), input_image.nc());
         result_image.original_width = sample.original_width;
         result_image.original_height = sample.original_height;
 
-        annonet_infer(net, sample.input_image, result_image.label_image, gains, detection_levels, tiling_parameters, temp);
+        if (pack_small_images && packer.fits(input_image.nc(), input_image.nr())) {
+            annonet_canvas_item canvas_item;
+            if (!packer.try_add(input_image.nc(), input_image.nr(), canvas_item.image_rect_in_canvas)) {
+                infer_canvas();
+                const bool added = packer.try_add(input_image.nc(), input_image.nr(), canvas_item.image_rect_in_canvas);
+                DLIB_CASSERT(added);
+            }
+            packed_samples.emplace_back(std::move(sample), std::move(result_image));
+            canvas_item.input_image = &packed_samples.back().first.input_image;
+            canvas_item.result_image = &packed_samples.back().second.label_image;
+            canvas_items.push_back(canvas_item);
+            continue;
+        }
 
-        for (const auto& labeled_points : sample.labeled_points_by_class) {
-            const uint16_t ground_truth_value = labeled_points.first;
-            for (const dlib::point& point : labeled_points.second) {
-                const uint16_t predicted_value = result_image.label_image(point.y(), point.x());
-                ++confusion_matrix_per_pixel[ground_truth_value][predicted_value];
+        if (use_deadline) {
+            // the time it took to read the image is not counted
+            const auto deadline = std::chrono::steady_clock::now() + deadline_duration;
+            const annonet_anytime_result anytime_result = use_stub_net
+                ? annonet_infer_until(stub_net, sample.input_image, deadline, result_image.label_image, result_image.coverage_mask, gains, detection_levels, tiling_parameters, tile_order, priority_regions, temp, fixed_shape_tiles)
+                : annonet_infer_until(net, sample.input_image, deadline, result_image.label_image, result_image.coverage_mask, gains, detection_levels, tiling_parameters, tile_order, priority_regions, temp, fixed_shape_tiles);
+            if (!anytime_result.completed) {
+                ++incomplete_image_count;
+                std::cout << "\rDeadline hit: " << anytime_result.processed_tile_count << " of " << anytime_result.tile_count << " tiles processed for " << sample.image_filenames.image_filename << std::endl;
+            }
+        }
+        else if (labeled_areas_only && !sample.labeled_points_by_class.empty()) {
+            // the receptive-field margin is the same as the overlap between tiles
+            const std::vector<dlib::rectangle> regions = get_labeled_regions(sample, min_input_dimension, labeled_blobs);
+            labeled_area_tile_count += use_stub_net
+                ? annonet_infer_regions(stub_net, sample.input_image, regions, result_image.label_image, gains, detection_levels, tiling_parameters, temp, fixed_shape_tiles)
+                : annonet_infer_regions(net, sample.input_image, regions, result_image.label_image, gains, detection_levels, tiling_parameters, temp, fixed_shape_tiles);
+        }
+        else {
+            if (labeled_areas_only) {
+                // otherwise the result would be all clean, and look like a perfect one
+                std::cout << "\rNo labeled areas in " << sample.image_filenames.image_filename << " - inferring the whole image" << std::endl;
+            }
+            if (use_stub_net) {
+                annonet_infer(stub_net, sample.input_image, result_image.label_image, gains, detection_levels, tiling_parameters, temp, fixed_shape_tiles);
+            }
+            else {
+                annonet_infer(net, sample.input_image, result_image.label_image, gains, detection_levels, tiling_parameters, temp, fixed_shape_tiles);
             }
-            ground_truth_count += labeled_points.second.size();
         }
 
-        update_confusion_matrix_per_region(confusion_matrix_per_region, sample.labeled_points_by_class, sample.label_image, result_image.label_image, update_confusion_matrix_per_region_temp);
+        finish_sample(sample, result_image);
+    }
 
-        result_image_write_requests.enqueue(result_image);
+    if (!canvas_items.empty()) {
+        infer_canvas();
     }
 
     const auto t1 = std::chrono::steady_clock::now();
 
-    std::cout << "\nAll " << files.size() << " images processed in "
-        << std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count() / 1000.0 << " seconds!" << std::endl;
+    const double elapsed_seconds = std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count() / 1000.0;
+
+    std::cout << "\nAll " << files.size() << " images processed in " << elapsed_seconds << " seconds!" << std::endl;
 
-    for (size_t i = 0, end = files.size(); i < end; ++i) {
+    if (use_deadline) {
+        std::cout << incomplete_image_count << " of " << files.size() << " images were not completely processed by the deadline" << std::endl;
+    }
+
+    if (labeled_areas_only) {
+        std::cout << labeled_area_tile_count << " tiles covering labeled areas inferred" << std::endl;
+    }
+
+    if (inspect) {
+        std::cout << defective_image_count << " of " << files.size() << " images failed; "
+            << inspected_tile_count << " of " << total_tile_count << " tiles inspected" << std::endl;
+    }
+
+    if (options.count("benchmark-result-file")) {
+        write_benchmark_results(options["benchmark-result-file"].as<std::string>(), {
+            { "images_per_second", files.size() / std::max(elapsed_seconds, 1e-3) },
+            { "megapixels_per_second", processed_pixel_count / 1e6 / std::max(elapsed_seconds, 1e-3) },
+        });
+    }
+
+    for (size_t i = 0; i < result_image_count; ++i) {
         bool ok;
         result_image_write_results.dequeue(ok);
     }
 
-    std::cout << "All result images written!" << std::endl;
+    if (result_image_count > 0) {
+        std::cout << "All result images written!" << std::endl;
+    }
 
     full_image_read_requests.disable();
     result_image_write_requests.disable();
@@ -491,6 +928,9 @@ int main(int argc, char** argv) try
     }
 
     if (ground_truth_count) {
+        if (incomplete_image_count > 0) {
+            std::cout << std::endl << "The confusion matrices cover only the tiles processed before the deadline" << std::endl;
+        }
         std::cout << std::endl << "Confusion matrix per pixel:" << std::endl;
         print_confusion_matrix(confusion_matrix_per_pixel, anno_classes);
 
@@ -0,0 +1,325 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+*/
+
+#include "annonet_kernels.h"
+
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define ANNONET_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else // _MSC_VER
+#include <cpuid.h>
+#endif // _MSC_VER
+#include <immintrin.h>
+#endif
+
+// The project-wide compiler flags only assume the baseline instruction set, so
+// with gcc and clang the wider kernels need to be enabled function by function.
+// (With msvc, the intrinsics are always available.)
+#ifdef __GNUC__
+#define ANNONET_TARGET(isa) __attribute__((target(isa)))
+#else // __GNUC__
+#define ANNONET_TARGET(isa)
+#endif // __GNUC__
+
+#if defined(ANNONET_X86) && (defined(__GNUC__) || (defined(_MSC_VER) && _MSC_VER >= 1910))
+#define ANNONET_HAVE_AVX512_KERNELS
+#endif
+
+namespace {
+
+// ----------------------------------------------------------------------------------------
+
+    size_t decode_rgba_labels_generic(const uint32_t* rgba, size_t count, const uint32_t* colors, const uint16_t* labels_by_color, size_t color_count, uint16_t* labels)
+    {
+        // Masks consist mostly of runs of the same color
+        bool have_previous = false;
+        uint32_t previous_color = 0;
+        uint16_t previous_label = 0;
+
+        for (size_t i = 0; i < count; ++i) {
+            // (the pixels are typically dlib::rgb_alpha_pixel, hence memcpy instead of a plain load)
+            uint32_t color;
+            std::memcpy(&color, rgba + i, sizeof(color));
+            if (!have_previous || color != previous_color) {
+                size_t j = 0;
+                while (j < color_count && colors[j] != color) {
+                    ++j;
+                }
+                if (j == color_count) {
+                    return i;
+                }
+                have_previous = true;
+                previous_color = color;
+                previous_label = labels_by_color[j];
+            }
+            labels[i] = previous_label;
+        }
+        return count;
+    }
+
+    void colorize_labels_generic(const uint16_t* labels, size_t count, const uint32_t* palette, size_t palette_size, uint32_t* rgba)
+    {
+        for (size_t i = 0; i < count; ++i) {
+            const uint16_t label = labels[i];
+            const uint32_t color = label < palette_size ? palette[label] : 0;
+            std::memcpy(rgba + i, &color, sizeof(color));
+        }
+    }
+
+#ifdef ANNONET_X86
+
+// ----------------------------------------------------------------------------------------
+
+    // In the vectorized versions, the colors are tried in reverse order, so that the
+    // first matching color wins - just like in the generic version.
+
+    ANNONET_TARGET("sse4.1")
+    size_t decode_rgba_labels_sse41(const uint32_t* rgba, size_t count, const uint32_t* colors, const uint16_t* labels_by_color, size_t color_count, uint16_t* labels)
+    {
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgba + i));
+            __m128i result = _mm_setzero_si128();
+            __m128i found = _mm_setzero_si128();
+            for (size_t j = color_count; j-- > 0; ) {
+                const __m128i match = _mm_cmpeq_epi32(pixels, _mm_set1_epi32(static_cast<int>(colors[j])));
+                result = _mm_blendv_epi8(result, _mm_set1_epi32(labels_by_color[j]), match);
+                found = _mm_or_si128(found, match);
+            }
+            if (_mm_movemask_ps(_mm_castsi128_ps(found)) != 0xF) {
+                return i + decode_rgba_labels_generic(rgba + i, 4, colors, labels_by_color, color_count, labels + i);
+            }
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(labels + i), _mm_packus_epi32(result, result));
+        }
+        return i + decode_rgba_labels_generic(rgba + i, count - i, colors, labels_by_color, color_count, labels + i);
+    }
+
+// ----------------------------------------------------------------------------------------
+
+    ANNONET_TARGET("avx2")
+    size_t decode_rgba_labels_avx2(const uint32_t* rgba, size_t count, const uint32_t* colors, const uint16_t* labels_by_color, size_t color_count, uint16_t* labels)
+    {
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            const __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rgba + i));
+            __m256i result = _mm256_setzero_si256();
+            __m256i found = _mm256_setzero_si256();
+            for (size_t j = color_count; j-- > 0; ) {
+                const __m256i match = _mm256_cmpeq_epi32(pixels, _mm256_set1_epi32(static_cast<int>(colors[j])));
+                result = _mm256_blendv_epi8(result, _mm256_set1_epi32(labels_by_color[j]), match);
+                found = _mm256_or_si256(found, match);
+            }
+            if (_mm256_movemask_ps(_mm256_castsi256_ps(found)) != 0xFF) {
+                return i + decode_rgba_labels_generic(rgba + i, 8, colors, labels_by_color, color_count, labels + i);
+            }
+            // packus works within 128-bit lanes, so gather the two useful quadwords
+            const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(result, result), 0x08);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(labels + i), _mm256_castsi256_si128(packed));
+        }
+        return i + decode_rgba_labels_generic(rgba + i, count - i, colors, labels_by_color, color_count, labels + i);
+    }
+
+    ANNONET_TARGET("avx2")
+    void colorize_labels_avx2(const uint16_t* labels, size_t count, const uint32_t* palette, size_t palette_size, uint32_t* rgba)
+    {
+        const __m256i palette_size_vector = _mm256_set1_epi32(static_cast<int>(palette_size));
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            const __m256i indexes = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(labels + i)));
+            const __m256i valid = _mm256_cmpgt_epi32(palette_size_vector, indexes);
+            const __m256i colors = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), reinterpret_cast<const int*>(palette), indexes, valid, 4);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(rgba + i), colors);
+        }
+        colorize_labels_generic(labels + i, count - i, palette, palette_size, rgba + i);
+    }
+
+// ----------------------------------------------------------------------------------------
+
+#ifdef ANNONET_HAVE_AVX512_KERNELS
+
+    ANNONET_TARGET("avx512f")
+    size_t decode_rgba_labels_avx512(const uint32_t* rgba, size_t count, const uint32_t* colors, const uint16_t* labels_by_color, size_t color_count, uint16_t* labels)
+    {
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16) {
+            const __m512i pixels = _mm512_loadu_si512(rgba + i);
+            __m512i result = _mm512_setzero_si512();
+            __mmask16 found = 0;
+            for (size_t j = color_count; j-- > 0; ) {
+                const __mmask16 match = _mm512_cmpeq_epi32_mask(pixels, _mm512_set1_epi32(static_cast<int>(colors[j])));
+                result = _mm512_mask_mov_epi32(result, match, _mm512_set1_epi32(labels_by_color[j]));
+                found |= match;
+            }
+            if (found != 0xFFFF) {
+                return i + decode_rgba_labels_generic(rgba + i, 16, colors, labels_by_color, color_count, labels + i);
+            }
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(labels + i), _mm512_cvtepi32_epi16(result));
+        }
+        return i + decode_rgba_labels_generic(rgba + i, count - i, colors, labels_by_color, color_count, labels + i);
+    }
+
+    ANNONET_TARGET("avx512f")
+    void colorize_labels_avx512(const uint16_t* labels, size_t count, const uint32_t* palette, size_t palette_size, uint32_t* rgba)
+    {
+        const __m512i palette_size_vector = _mm512_set1_epi32(static_cast<int>(palette_size));
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16) {
+            const __m512i indexes = _mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(labels + i)));
+            const __mmask16 valid = _mm512_cmplt_epi32_mask(indexes, palette_size_vector);
+            const __m512i colors = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), valid, indexes, palette, 4);
+            _mm512_storeu_si512(rgba + i, colors);
+        }
+        colorize_labels_generic(labels + i, count - i, palette, palette_size, rgba + i);
+    }
+
+#endif // ANNONET_HAVE_AVX512_KERNELS
+
+// ----------------------------------------------------------------------------------------
+
+    void cpuid(unsigned int leaf, unsigned int subleaf, unsigned int registers[4])
+    {
+#ifdef _MSC_VER
+        int r[4];
+        __cpuidex(r, static_cast<int>(leaf), static_cast<int>(subleaf));
+        for (int i = 0; i < 4; ++i) {
+            registers[i] = static_cast<unsigned int>(r[i]);
+        }
+#else // _MSC_VER
+        __cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif // _MSC_VER
+    }
+
+    uint64_t get_enabled_os_features()
+    {
+#ifdef _MSC_VER
+        return _xgetbv(0);
+#else // _MSC_VER
+        uint32_t eax = 0, edx = 0;
+        __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif // _MSC_VER
+    }
+
+#endif // ANNONET_X86
+
+// ----------------------------------------------------------------------------------------
+
+    const annonet_kernels generic_kernels = { isa_level::generic, decode_rgba_labels_generic, colorize_labels_generic };
+#ifdef ANNONET_X86
+    const annonet_kernels sse41_kernels = { isa_level::sse41, decode_rgba_labels_sse41, colorize_labels_generic };
+    const annonet_kernels avx2_kernels = { isa_level::avx2, decode_rgba_labels_avx2, colorize_labels_avx2 };
+#ifdef ANNONET_HAVE_AVX512_KERNELS
+    const annonet_kernels avx512_kernels = { isa_level::avx512, decode_rgba_labels_avx512, colorize_labels_avx512 };
+#endif // ANNONET_HAVE_AVX512_KERNELS
+#endif // ANNONET_X86
+
+    const annonet_kernels& get_kernels_for(isa_level isa)
+    {
+        switch (isa) {
+#ifdef ANNONET_X86
+        case isa_level::sse41: return sse41_kernels;
+        case isa_level::avx2: return avx2_kernels;
+#ifdef ANNONET_HAVE_AVX512_KERNELS
+        case isa_level::avx512: return avx512_kernels;
+#endif // ANNONET_HAVE_AVX512_KERNELS
+#endif // ANNONET_X86
+        default: return generic_kernels;
+        }
+    }
+
+    std::atomic<const annonet_kernels*> selected_kernels(nullptr);
+}
+
+// ----------------------------------------------------------------------------------------
+
+isa_level detect_isa_level()
+{
+#ifdef ANNONET_X86
+    unsigned int leaf0[4], leaf1[4], leaf7[4] = { 0, 0, 0, 0 };
+    cpuid(0, 0, leaf0);
+    cpuid(1, 0, leaf1);
+    if (leaf0[0] >= 7) {
+        cpuid(7, 0, leaf7);
+    }
+
+    const bool sse41 = (leaf1[2] & (1u << 19)) != 0;
+    const bool osxsave = (leaf1[2] & (1u << 27)) != 0;
+    const bool avx = (leaf1[2] & (1u << 28)) != 0;
+    const bool avx2 = (leaf7[1] & (1u << 5)) != 0;
+    const bool avx512f = (leaf7[1] & (1u << 16)) != 0;
+
+    // The OS must also save the wider registers on context switches
+    const uint64_t os_features = osxsave ? get_enabled_os_features() : 0;
+    const bool os_avx = (os_features & 0x06) == 0x06;
+    const bool os_avx512 = (os_features & 0xE6) == 0xE6;
+
+#ifdef ANNONET_HAVE_AVX512_KERNELS
+    if (avx512f && os_avx512) {
+        return isa_level::avx512;
+    }
+#endif // ANNONET_HAVE_AVX512_KERNELS
+    if (avx && avx2 && os_avx) {
+        return isa_level::avx2;
+    }
+    if (sse41) {
+        return isa_level::sse41;
+    }
+#endif // ANNONET_X86
+    return isa_level::generic;
+}
+
+isa_level parse_isa_level(const std::string& name)
+{
+    for (const isa_level isa : { isa_level::generic, isa_level::sse41, isa_level::avx2, isa_level::avx512 }) {
+        if (name == to_string(isa)) {
+            return isa;
+        }
+    }
+    throw std::runtime_error("Unknown instruction set level: " + name + " (supported: generic, sse41, avx2, avx512)");
+}
+
+std::string to_string(isa_level isa)
+{
+    switch (isa) {
+    case isa_level::sse41: return "sse41";
+    case isa_level::avx2: return "avx2";
+    case isa_level::avx512: return "avx512";
+    default: return "generic";
+    }
+}
+
+const annonet_kernels& get_kernels()
+{
+    const annonet_kernels* kernels = selected_kernels.load();
+    if (!kernels) {
+        kernels = &get_kernels_for(detect_isa_level());
+        selected_kernels.store(kernels);
+    }
+    return *kernels;
+}
+
+void select_kernels(isa_level isa)
+{
+    const isa_level supported = detect_isa_level();
+    if (static_cast<int>(isa) > static_cast<int>(supported)) {
+        throw std::runtime_error("Instruction set level " + to_string(isa) + " requested, but only " + to_string(supported) + " is supported");
+    }
+    selected_kernels.store(&get_kernels_for(isa));
+}
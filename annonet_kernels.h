@@ -0,0 +1,82 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+
+    The hot per-pixel loops are compiled for several instruction sets, and the
+    best one supported by the CPU is picked at run time. This way the same
+    binary runs on older PCs, and still makes use of AVX2 or AVX-512 when they
+    are available.
+*/
+
+#ifndef ANNONET_KERNELS_H
+#define ANNONET_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// ----------------------------------------------------------------------------------------
+
+enum class isa_level
+{
+    generic = 0,
+    sse41 = 1,
+    avx2 = 2,
+    avx512 = 3
+};
+
+// The best level supported by both the CPU (and the OS) and this build
+isa_level detect_isa_level();
+
+isa_level parse_isa_level(const std::string& name);
+
+std::string to_string(isa_level isa);
+
+// ----------------------------------------------------------------------------------------
+
+struct annonet_kernels
+{
+    isa_level isa;
+
+    // Maps each packed RGBA pixel to the label of the matching color. Returns the
+    // index of the first pixel whose color is not in the table, or count if all
+    // the colors were known. (On error, the labels are left partly unwritten.)
+    size_t (*decode_rgba_labels)(
+        const uint32_t* rgba,
+        size_t count,
+        const uint32_t* colors,
+        const uint16_t* labels_by_color,
+        size_t color_count,
+        uint16_t* labels
+    );
+
+    // Maps each label to its packed RGBA color. Labels outside the palette map to
+    // zero (that is, to the ignore color).
+    void (*colorize_labels)(
+        const uint16_t* labels,
+        size_t count,
+        const uint32_t* palette,
+        size_t palette_size,
+        uint32_t* rgba
+    );
+};
+
+// The kernels of the selected level; detect_isa_level() is used unless
+// select_kernels has been called
+const annonet_kernels& get_kernels();
+
+// Meant to be called at startup, before any other threads use the kernels.
+// Throws if the CPU does not support the requested level.
+void select_kernels(isa_level isa);
+
+#endif // ANNONET_KERNELS_H
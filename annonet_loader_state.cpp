@@ -0,0 +1,164 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+*/
+
+#include "annonet_loader_state.h"
+#include "annonet_tar.h"
+
+#include <dlib/serialize.h>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <unordered_set>
+
+namespace {
+    const std::string loader_state_magic = "annoloaderstate";
+    const int loader_state_version = 2;
+}
+
+// ----------------------------------------------------------------------------------------
+
+void save_loader_state(const loader_state& state, const std::string& filename)
+{
+    const std::string temporary_filename = filename + ".tmp";
+
+    {
+        std::ofstream out(temporary_filename, std::ios::binary);
+        dlib::serialize(loader_state_magic, out);
+        dlib::serialize(loader_state_version, out);
+        dlib::serialize(state.seed, out);
+        dlib::serialize(state.crop_counts, out);
+        dlib::serialize(state.hot_image_filenames, out);
+
+        if (!out) {
+            std::cerr << "Warning: unable to write " << filename << std::endl;
+            out.close();
+            std::remove(temporary_filename.c_str());
+            return;
+        }
+    }
+
+    std::remove(filename.c_str());
+    std::rename(temporary_filename.c_str(), filename.c_str());
+}
+
+bool load_loader_state(loader_state& state, const std::string& filename)
+{
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+
+    try {
+        std::string magic;
+        int version = 0;
+        dlib::deserialize(magic, in);
+        dlib::deserialize(version, in);
+        if (magic != loader_state_magic || version != loader_state_version) {
+            return false;
+        }
+
+        dlib::deserialize(state.seed, in);
+        dlib::deserialize(state.crop_counts, in);
+        dlib::deserialize(state.hot_image_filenames, in);
+        return true;
+    }
+    catch (dlib::serialization_error&) {
+        state = loader_state();
+        return false;
+    }
+}
+
+// ----------------------------------------------------------------------------------------
+
+recent_image_tracker::recent_image_tracker(size_t capacity)
+    : capacity(std::max<size_t>(1, capacity))
+{
+}
+
+void recent_image_tracker::add(const std::string& image_filename)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!recent.empty() && recent.back() == image_filename) {
+        return;
+    }
+    recent.push_back(image_filename);
+    while (recent.size() > capacity) {
+        recent.pop_front();
+    }
+}
+
+std::vector<std::string> recent_image_tracker::get(size_t max_count) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::vector<std::string> result;
+    std::unordered_set<std::string> seen;
+    for (auto i = recent.rbegin(); i != recent.rend() && result.size() < max_count; ++i) {
+        if (seen.insert(*i).second) {
+            result.push_back(*i);
+        }
+    }
+    return result;
+}
+
+// ----------------------------------------------------------------------------------------
+
+void seed_crop_random_number_generator(dlib::rand& rnd, uint64_t seed, size_t loader_index, uint64_t crop_index)
+{
+    rnd.set_seed(std::to_string(seed) + ":" + std::to_string(loader_index) + ":" + std::to_string(crop_index));
+}
+
+// ----------------------------------------------------------------------------------------
+
+trainer_state_watch::trainer_state_watch(const std::string& synchronization_filename)
+{
+    filenames[0] = synchronization_filename;
+    filenames[1] = synchronization_filename + "_";
+    for (size_t i = 0; i < 2; ++i) {
+        stamps[i] = get_stamp(filenames[i]);
+    }
+}
+
+bool trainer_state_watch::has_been_written()
+{
+    bool written = false;
+    for (size_t i = 0; i < 2; ++i) {
+        const stamp current = get_stamp(filenames[i]);
+        if (current.exists && !(current == stamps[i])) {
+            written = true;
+        }
+        stamps[i] = current;
+    }
+    return written;
+}
+
+bool trainer_state_watch::stamp::operator== (const stamp& that) const
+{
+    return exists == that.exists && size == that.size && modification_time == that.modification_time;
+}
+
+trainer_state_watch::stamp trainer_state_watch::get_stamp(const std::string& filename)
+{
+    stamp result;
+    try {
+        get_file_stamp(filename, result.size, result.modification_time);
+        result.exists = true;
+    }
+    catch (std::exception&) {
+        // not written yet
+    }
+    return result;
+}
@@ -0,0 +1,106 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+
+    The trainer state file lets an interrupted training resume the solver,
+    but the data loaders would start cold: an empty image cache, and fresh
+    random number generators. The loader state file, written whenever the
+    trainer state has been written, records how far the trainer had got in
+    the crops of each loader, and the images that were hot in the cache, so
+    that a resumed training can reload those images (in parallel) before its
+    first step, and continue with the crops that come next.
+
+    To make continuing possible, a loader reseeds its random number generator
+    for every crop, from a seed shared by the loaders, the index of the loader
+    and the index of the crop.
+*/
+
+#ifndef ANNONET_LOADER_STATE_H
+#define ANNONET_LOADER_STATE_H
+
+#include <dlib/rand.h>
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// ----------------------------------------------------------------------------------------
+
+struct loader_state
+{
+    uint64_t seed = 0;
+    std::vector<uint64_t> crop_counts; // one per loader thread: the crops taken by the trainer
+    std::vector<std::string> hot_image_filenames; // most recently used first
+};
+
+// Writes via a temporary file, so that an interruption never leaves a partial state behind
+void save_loader_state(const loader_state& state, const std::string& filename);
+
+// Returns false if there is no (valid) state file
+bool load_loader_state(loader_state& state, const std::string& filename);
+
+// ----------------------------------------------------------------------------------------
+
+// The image cache can't list its entries, so the recent requests are tracked separately
+class recent_image_tracker
+{
+public:
+    recent_image_tracker(size_t capacity);
+
+    void add(const std::string& image_filename);
+
+    // Distinct, most recently used first
+    std::vector<std::string> get(size_t max_count) const;
+
+private:
+    const size_t capacity;
+    mutable std::mutex mutex;
+    std::deque<std::string> recent;
+};
+
+// ----------------------------------------------------------------------------------------
+
+// Makes rnd the generator of the given crop; the same arguments give the same generator
+void seed_crop_random_number_generator(dlib::rand& rnd, uint64_t seed, size_t loader_index, uint64_t crop_index);
+
+// ----------------------------------------------------------------------------------------
+
+// The trainer writes its state in its own thread, so the file is watched instead; dlib
+// writes the file and the file with an underscore appended in turns
+class trainer_state_watch
+{
+public:
+    trainer_state_watch(const std::string& synchronization_filename);
+
+    // True if the trainer state has been written since the previous call
+    bool has_been_written();
+
+private:
+    struct stamp
+    {
+        bool exists = false;
+        uint64_t size = 0;
+        int64_t modification_time = 0;
+
+        bool operator== (const stamp& that) const;
+    };
+
+    static stamp get_stamp(const std::string& filename);
+
+    std::string filenames[2];
+    stamp stamps[2];
+};
+
+#endif // ANNONET_LOADER_STATE_H
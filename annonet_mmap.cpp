@@ -0,0 +1,115 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+*/
+
+#include "annonet_mmap.h"
+
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <dlib/windows_magic.h>
+#include <windows.h>
+#else // _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // _WIN32
+
+#ifdef _WIN32
+
+memory_mapped_file::memory_mapped_file(const std::string& filename)
+    : filename(filename)
+{
+    file_handle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file_handle == INVALID_HANDLE_VALUE) {
+        file_handle = nullptr;
+        throw std::runtime_error("Unable to open " + filename);
+    }
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file_handle, &file_size)) {
+        CloseHandle(file_handle);
+        throw std::runtime_error("Unable to get the size of " + filename);
+    }
+
+    mapped_size = static_cast<size_t>(file_size.QuadPart);
+
+    if (mapped_size > 0) {
+        mapping_handle = CreateFileMappingA(file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping_handle == NULL) {
+            CloseHandle(file_handle);
+            throw std::runtime_error("Unable to map " + filename);
+        }
+
+        mapped_data = static_cast<const char*>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+        if (mapped_data == nullptr) {
+            CloseHandle(mapping_handle);
+            CloseHandle(file_handle);
+            throw std::runtime_error("Unable to map " + filename);
+        }
+    }
+}
+
+memory_mapped_file::~memory_mapped_file()
+{
+    if (mapped_data) {
+        UnmapViewOfFile(mapped_data);
+    }
+    if (mapping_handle) {
+        CloseHandle(mapping_handle);
+    }
+    if (file_handle) {
+        CloseHandle(file_handle);
+    }
+}
+
+#else // _WIN32
+
+memory_mapped_file::memory_mapped_file(const std::string& filename)
+    : filename(filename)
+{
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Unable to open " + filename);
+    }
+
+    struct stat file_status;
+    if (fstat(fd, &file_status) != 0) {
+        close(fd);
+        throw std::runtime_error("Unable to get the size of " + filename);
+    }
+
+    mapped_size = static_cast<size_t>(file_status.st_size);
+
+    if (mapped_size > 0) {
+        void* const address = mmap(nullptr, mapped_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (address == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("Unable to map " + filename);
+        }
+        mapped_data = static_cast<const char*>(address);
+    }
+
+    close(fd); // the mapping stays valid
+}
+
+memory_mapped_file::~memory_mapped_file()
+{
+    if (mapped_data) {
+        munmap(const_cast<char*>(mapped_data), mapped_size);
+    }
+}
+
+#endif // _WIN32
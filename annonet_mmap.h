@@ -0,0 +1,50 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+*/
+
+#ifndef ANNONET_MMAP_H
+#define ANNONET_MMAP_H
+
+#include <cstddef>
+#include <string>
+
+// ----------------------------------------------------------------------------------------
+
+// A read-only view of a whole file, mapped into memory
+class memory_mapped_file
+{
+public:
+    memory_mapped_file(const std::string& filename);
+    ~memory_mapped_file();
+
+    memory_mapped_file(const memory_mapped_file&) = delete;
+    memory_mapped_file& operator=(const memory_mapped_file&) = delete;
+
+    const char* data() const { return mapped_data; }
+    size_t size() const { return mapped_size; }
+
+    const std::string& get_filename() const { return filename; }
+
+private:
+    const std::string filename;
+    const char* mapped_data = nullptr;
+    size_t mapped_size = 0;
+
+#ifdef _WIN32
+    void* file_handle = nullptr;
+    void* mapping_handle = nullptr;
+#endif // _WIN32
+};
+
+#endif // ANNONET_MMAP_H
@@ -0,0 +1,110 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+*/
+
+#include "annonet_net_variant.h"
+#include "dlib-dnn-pimpl-wrapper/NetPimpl.h"
+
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct annonet_net_variant
+{
+    NetPimpl::RuntimeNet net;
+    NetPimpl::input_type input;
+    std::vector<double> gains;
+    dlib::matrix<uint16_t> labels;
+    std::string last_error;
+};
+
+int annonet_net_variant_api_version()
+{
+    return ANNONET_NET_VARIANT_API_VERSION;
+}
+
+annonet_net_variant* annonet_net_variant_create()
+{
+    try {
+        return new annonet_net_variant;
+    }
+    catch (...) {
+        return nullptr;
+    }
+}
+
+void annonet_net_variant_destroy(annonet_net_variant* net)
+{
+    delete net;
+}
+
+int annonet_net_variant_deserialize(annonet_net_variant* net, const char* data, size_t size)
+{
+    try {
+        net->net.Deserialize(std::istringstream(std::string(data, size)));
+        return 0;
+    }
+    catch (std::exception& e) {
+        net->last_error = e.what();
+        return 1;
+    }
+}
+
+int annonet_net_variant_infer(annonet_net_variant* net, const void* pixels, size_t pixel_size, long nr, long nc, const double* gains, size_t gain_count, const uint16_t** labels, long* labels_nr, long* labels_nc)
+{
+    try {
+        if (pixel_size != sizeof(NetPimpl::input_type::type)) {
+            throw std::runtime_error("Unexpected pixel size " + std::to_string(pixel_size) + " - the net module has been built for another input type");
+        }
+        net->input.set_size(nr, nc);
+        if (nr > 0 && nc > 0) {
+            std::memcpy(&net->input(0, 0), pixels, static_cast<size_t>(nr) * static_cast<size_t>(nc) * pixel_size);
+        }
+        net->gains.assign(gains, gains + gain_count);
+        net->labels = net->net(net->input, net->gains);
+
+        *labels = net->labels.size() > 0 ? &net->labels(0, 0) : nullptr;
+        *labels_nr = net->labels.nr();
+        *labels_nc = net->labels.nc();
+        return 0;
+    }
+    catch (std::exception& e) {
+        net->last_error = e.what();
+        return 1;
+    }
+}
+
+int annonet_net_variant_get_output(annonet_net_variant* net, const float** data, long long* num_samples, long long* k, long long* nr, long long* nc)
+{
+    try {
+        const dlib::tensor& output = net->net.GetOutput();
+        *data = output.host();
+        *num_samples = output.num_samples();
+        *k = output.k();
+        *nr = output.nr();
+        *nc = output.nc();
+        return 0;
+    }
+    catch (std::exception& e) {
+        net->last_error = e.what();
+        return 1;
+    }
+}
+
+const char* annonet_net_variant_last_error(const annonet_net_variant* net)
+{
+    return net->last_error.c_str();
+}
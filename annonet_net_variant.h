@@ -0,0 +1,80 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+
+    The net can additionally be built as a separate module (annonet_net_avx2)
+    with dlib's AVX code paths enabled. The module is loaded only when the CPU
+    supports AVX2, so the programs themselves stay at the baseline instruction
+    set. Only plain C types cross the module boundary: the module has its own
+    copy of dlib and of the C++ runtime, and nothing of either is shared.
+*/
+
+#ifndef ANNONET_NET_VARIANT_H
+#define ANNONET_NET_VARIANT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#define ANNONET_NET_VARIANT_EXPORT __declspec(dllexport)
+#else // _WIN32
+#define ANNONET_NET_VARIANT_EXPORT __attribute__((visibility("default")))
+#endif // _WIN32
+
+extern "C" {
+
+// Bumped whenever any of the functions below changes
+#define ANNONET_NET_VARIANT_API_VERSION 1
+
+typedef struct annonet_net_variant annonet_net_variant;
+
+ANNONET_NET_VARIANT_EXPORT int annonet_net_variant_api_version();
+
+ANNONET_NET_VARIANT_EXPORT annonet_net_variant* annonet_net_variant_create();
+
+ANNONET_NET_VARIANT_EXPORT void annonet_net_variant_destroy(annonet_net_variant* net);
+
+// The functions below return zero on success. On failure, the reason is
+// available through annonet_net_variant_last_error.
+ANNONET_NET_VARIANT_EXPORT int annonet_net_variant_deserialize(annonet_net_variant* net, const char* data, size_t size);
+
+// The pixels are NetPimpl::input_type pixels, row by row without padding. The
+// labels stay valid until the next call.
+ANNONET_NET_VARIANT_EXPORT int annonet_net_variant_infer(
+    annonet_net_variant* net,
+    const void* pixels,
+    size_t pixel_size,
+    long nr,
+    long nc,
+    const double* gains,
+    size_t gain_count,
+    const uint16_t** labels,
+    long* labels_nr,
+    long* labels_nc
+);
+
+// The output tensor of the latest infer call; stays valid until the next call
+ANNONET_NET_VARIANT_EXPORT int annonet_net_variant_get_output(
+    annonet_net_variant* net,
+    const float** data,
+    long long* num_samples,
+    long long* k,
+    long long* nr,
+    long long* nc
+);
+
+ANNONET_NET_VARIANT_EXPORT const char* annonet_net_variant_last_error(const annonet_net_variant* net);
+
+}
+
+#endif // ANNONET_NET_VARIANT_H
@@ -0,0 +1,163 @@
+/*
+    This program packs an anno dataset into shard files for annonet_train. The
+    images and the masks are decoded (and downscaled) once, and written to a few
+    large files that can be read sequentially.
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_pack program.
+    3. Run:
+       ./annonet_pack /path/to/anno/data -o /path/to/shards
+    4. Train on the shards:
+       ./annonet_train --input-shards /path/to/shards
+
+    The samples are written in a random order, so that even consecutive samples
+    of a single shard are not correlated.
+*/
+
+#include "annonet.h"
+#include "annonet_kernels.h"
+#include "annonet_shards.h"
+
+#include "cxxopts/include/cxxopts.hpp"
+#include <dlib/dir_nav.h>
+#include <dlib/threads.h>
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+using namespace std;
+using namespace dlib;
+
+// ----------------------------------------------------------------------------------------
+
+int main(int argc, char** argv) try
+{
+    if (argc == 1)
+    {
+        cout << "You call this program like this: " << endl;
+        cout << "./annonet_pack /path/to/anno/data -o /path/to/shards" << endl;
+        return 1;
+    }
+
+    cxxopts::Options options("annonet_pack", "Pack anno datasets into shard files for fast sequential reading");
+
+    std::ostringstream hardware_concurrency;
+    hardware_concurrency << std::thread::hardware_concurrency();
+
+    options.add_options()
+        ("i,input-directory", "Input image directory", cxxopts::value<std::string>())
+        ("o,output-directory", "Output directory for the shard files", cxxopts::value<std::string>())
+        ("d,initial-downscaling-factor", "The initial downscaling factor (>= 1.0)", cxxopts::value<double>()->default_value("1.0"))
+        ("shard-size", "Approximate maximum size of each shard file, in megabytes", cxxopts::value<double>()->default_value("1024"))
+        ("compression-level", "zlib compression level (1 = fastest, 9 = smallest)", cxxopts::value<int>()->default_value("1"))
+        ("seed", "Random seed for the order of the samples", cxxopts::value<std::string>()->default_value("annonet"))
+        ("thread-count", "Number of decoder threads", cxxopts::value<unsigned int>()->default_value(hardware_concurrency.str()))
+        ;
+
+    try {
+        options.parse_positional("input-directory");
+        options.parse(argc, argv);
+
+        cxxopts::check_required(options, { "input-directory", "output-directory" });
+
+        if (options["initial-downscaling-factor"].as<double>() <= 0.0) {
+            throw std::runtime_error("The downscaling factor has to be strictly positive.");
+        }
+        if (options["shard-size"].as<double>() <= 0.0) {
+            throw std::runtime_error("The shard size has to be strictly positive.");
+        }
+    }
+    catch (std::exception& e) {
+        cerr << e.what() << std::endl;
+        cerr << std::endl;
+        cerr << options.help() << std::endl;
+        return 2;
+    }
+
+    const std::string input_directory = options["input-directory"].as<std::string>();
+    const std::string output_directory = options["output-directory"].as<std::string>();
+    const double downscaling_factor = options["initial-downscaling-factor"].as<double>();
+    const uint64_t max_shard_size = static_cast<uint64_t>(options["shard-size"].as<double>() * 1024 * 1024);
+    const int compression_level = std::max(0, std::min(9, options["compression-level"].as<int>()));
+    const auto thread_count = std::max(1U, options["thread-count"].as<unsigned int>());
+
+    std::cout << "Input directory = " << input_directory << std::endl;
+    std::cout << "Output directory = " << output_directory << std::endl;
+    std::cout << "Downscaling factor = " << downscaling_factor << std::endl;
+    std::cout << "Instruction set level = " << to_string(get_kernels().isa) << std::endl;
+
+    shard_header header;
+    header.anno_classes_json = read_anno_classes_file(input_directory);
+    header.downscaling_factor = downscaling_factor;
+
+    const auto anno_classes = parse_anno_classes(header.anno_classes_json);
+
+    std::vector<image_filenames> image_files = find_image_files(input_directory, true);
+    std::cout << "images in dataset: " << image_files.size() << std::endl;
+    if (image_files.empty()) {
+        std::cout << "Didn't find an anno dataset. " << std::endl;
+        return 1;
+    }
+
+    dlib::rand rnd(options["seed"].as<std::string>());
+    for (size_t i = image_files.size() - 1; i > 0; --i) {
+        std::swap(image_files[i], image_files[rnd.get_random_32bit_number() % (i + 1)]);
+    }
+
+    create_directory(output_directory);
+
+    size_t shard_count = 0;
+    std::unique_ptr<shard_writer> writer;
+
+    const auto start_new_shard = [&]() {
+        std::ostringstream filename;
+        filename << output_directory << "/" << std::setfill('0') << std::setw(5) << shard_count++ << ".annoshard";
+        writer.reset(new shard_writer(filename.str(), header));
+    };
+
+    // Decode in parallel, a batch at a time, and write each batch in order
+    const size_t batch_size = 4 * thread_count;
+    std::vector<shard_record> records(batch_size);
+    std::vector<std::string> errors(batch_size);
+
+    size_t samples_written = 0, samples_failed = 0;
+
+    for (size_t batch_begin = 0; batch_begin < image_files.size(); batch_begin += batch_size) {
+        const size_t batch_end = std::min(batch_begin + batch_size, image_files.size());
+
+        parallel_for(thread_count, batch_begin, batch_end, [&](long i) {
+            const sample sample = read_sample(image_files[i], anno_classes, true, downscaling_factor);
+            errors[i - batch_begin] = sample.error;
+            if (sample.error.empty()) {
+                records[i - batch_begin] = compress_sample(sample, compression_level);
+            }
+        });
+
+        for (size_t i = batch_begin; i < batch_end; ++i) {
+            if (!errors[i - batch_begin].empty()) {
+                std::cout << std::endl << "Skipping " << image_files[i].image_filename << ": " << errors[i - batch_begin] << std::endl;
+                ++samples_failed;
+                continue;
+            }
+            if (!writer || writer->get_bytes_written() >= max_shard_size) {
+                start_new_shard();
+            }
+            writer->write(records[i - batch_begin]);
+            ++samples_written;
+        }
+
+        std::cout << "\rPacked " << batch_end << " of " << image_files.size() << " images into " << shard_count << " shards" << std::flush;
+    }
+
+    writer.reset();
+
+    std::cout << std::endl << "Done! " << samples_written << " samples written, " << samples_failed << " skipped" << std::endl;
+}
+catch(std::exception& e)
+{
+    cout << e.what() << endl;
+    return 1;
+}
@@ -0,0 +1,612 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+*/
+
+#include "annonet_parallel_decode.h"
+
+#include <dlib/external/zlib/zlib.h>
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <thread>
+
+namespace {
+    std::atomic<unsigned int> parallel_decode_thread_count(std::max(1U, std::thread::hardware_concurrency()));
+
+    // Splitting smaller images isn't worth the trouble
+    const uint64_t min_parallel_decode_pixel_count = 16 * 1024 * 1024;
+
+    const unsigned char png_signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    const char band_chunk_type[] = "anBD";
+    const size_t max_idat_chunk_size = 8 * 1024 * 1024;
+
+    uint16_t read_big_endian_16(const unsigned char* data)
+    {
+        return static_cast<uint16_t>((data[0] << 8) | data[1]);
+    }
+
+    uint32_t read_big_endian_32(const unsigned char* data)
+    {
+        return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | uint32_t(data[3]);
+    }
+
+    uint64_t read_big_endian_64(const unsigned char* data)
+    {
+        return (uint64_t(read_big_endian_32(data)) << 32) | read_big_endian_32(data + 4);
+    }
+
+    void append_big_endian_32(std::string& out, uint32_t value)
+    {
+        out.push_back(static_cast<char>(value >> 24));
+        out.push_back(static_cast<char>(value >> 16));
+        out.push_back(static_cast<char>(value >> 8));
+        out.push_back(static_cast<char>(value));
+    }
+
+    void append_big_endian_64(std::string& out, uint64_t value)
+    {
+        append_big_endian_32(out, static_cast<uint32_t>(value >> 32));
+        append_big_endian_32(out, static_cast<uint32_t>(value));
+    }
+
+    // ------------------------------------------------------------------------------------
+
+    struct jpeg_frame
+    {
+        size_t height_offset = 0; // where the height is, in the SOF segment
+        long width = 0;
+        long height = 0;
+        int component_count = 0;
+        int max_h = 1;
+        int max_v = 1;
+        long restart_interval = 0;
+        size_t scan_offset = 0; // where the entropy-coded data begins
+    };
+
+    // Reads the headers up to the first scan; returns false for anything other than a
+    // baseline (or extended) sequential Huffman-coded single-scan JPEG
+    bool parse_jpeg_headers(const unsigned char* data, size_t size, jpeg_frame& frame)
+    {
+        size_t position = 2; // SOI
+
+        while (position + 4 <= size) {
+            if (data[position] != 0xff) {
+                return false;
+            }
+            const unsigned char marker = data[position + 1];
+            if (marker == 0xff) {
+                ++position; // fill byte
+                continue;
+            }
+
+            const size_t length = read_big_endian_16(data + position + 2);
+            if (length < 2 || position + 2 + length > size) {
+                return false;
+            }
+            const unsigned char* const segment = data + position + 4;
+
+            if (marker == 0xc0 || marker == 0xc1) {
+                if (length < 8) {
+                    return false;
+                }
+                frame.height_offset = position + 5;
+                frame.height = read_big_endian_16(segment + 1);
+                frame.width = read_big_endian_16(segment + 3);
+                frame.component_count = segment[5];
+                if (length < 8 + 3u * frame.component_count) {
+                    return false;
+                }
+                for (int i = 0; i < frame.component_count; ++i) {
+                    frame.max_h = std::max(frame.max_h, segment[6 + 3 * i + 1] >> 4);
+                    frame.max_v = std::max(frame.max_v, segment[6 + 3 * i + 1] & 0x0f);
+                }
+            }
+            else if ((marker >= 0xc2 && marker <= 0xcf) && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+                return false; // progressive, lossless, or arithmetic coding
+            }
+            else if (marker == 0xdd) {
+                if (length < 4) {
+                    return false;
+                }
+                frame.restart_interval = read_big_endian_16(segment);
+            }
+            else if (marker == 0xda) {
+                const int scan_component_count = segment[0];
+                if (frame.width <= 0 || frame.height <= 0 || scan_component_count != frame.component_count) {
+                    return false; // e.g., a non-interleaved multi-scan file
+                }
+                frame.scan_offset = position + 2 + length;
+                return true;
+            }
+            else if (marker == 0xd9) {
+                return false;
+            }
+
+            position += 2 + length;
+        }
+
+        return false;
+    }
+
+    // ------------------------------------------------------------------------------------
+
+    // The row filters of PNG; see https://www.w3.org/TR/png/#9Filters
+    unsigned char paeth_predictor(int a, int b, int c)
+    {
+        const int p = a + b - c;
+        const int pa = std::abs(p - a);
+        const int pb = std::abs(p - b);
+        const int pc = std::abs(p - c);
+        if (pa <= pb && pa <= pc) {
+            return static_cast<unsigned char>(a);
+        }
+        return static_cast<unsigned char>(pb <= pc ? b : c);
+    }
+
+    void filter_row(int filter, const unsigned char* row, const unsigned char* previous, size_t row_size, int bpp, unsigned char* out)
+    {
+        for (size_t i = 0; i < row_size; ++i) {
+            const int a = i >= static_cast<size_t>(bpp) ? row[i - bpp] : 0;
+            const int b = previous[i];
+            const int c = i >= static_cast<size_t>(bpp) ? previous[i - bpp] : 0;
+            switch (filter) {
+            case 0: out[i] = row[i]; break;
+            case 1: out[i] = static_cast<unsigned char>(row[i] - a); break;
+            case 2: out[i] = static_cast<unsigned char>(row[i] - b); break;
+            case 3: out[i] = static_cast<unsigned char>(row[i] - (a + b) / 2); break;
+            default: out[i] = static_cast<unsigned char>(row[i] - paeth_predictor(a, b, c)); break;
+            }
+        }
+    }
+
+    void unfilter_row(int filter, unsigned char* row, const unsigned char* previous, size_t row_size, int bpp)
+    {
+        // the pixels on the left of the first pixel are zeros
+        const size_t first = std::min(row_size, static_cast<size_t>(bpp));
+
+        switch (filter) {
+        case 0:
+            break;
+        case 1:
+            for (size_t i = first; i < row_size; ++i) {
+                row[i] = static_cast<unsigned char>(row[i] + row[i - bpp]);
+            }
+            break;
+        case 2:
+            for (size_t i = 0; i < row_size; ++i) {
+                row[i] = static_cast<unsigned char>(row[i] + previous[i]);
+            }
+            break;
+        case 3:
+            for (size_t i = 0; i < first; ++i) {
+                row[i] = static_cast<unsigned char>(row[i] + previous[i] / 2);
+            }
+            for (size_t i = first; i < row_size; ++i) {
+                row[i] = static_cast<unsigned char>(row[i] + (row[i - bpp] + previous[i]) / 2);
+            }
+            break;
+        case 4:
+            for (size_t i = 0; i < first; ++i) {
+                row[i] = static_cast<unsigned char>(row[i] + previous[i]);
+            }
+            for (size_t i = first; i < row_size; ++i) {
+                row[i] = static_cast<unsigned char>(row[i] + paeth_predictor(row[i - bpp], previous[i], previous[i - bpp]));
+            }
+            break;
+        default:
+            throw std::runtime_error("Invalid PNG row filter");
+        }
+    }
+
+    void append_png_chunk(std::string& out, const char* type, const char* data, size_t size)
+    {
+        append_big_endian_32(out, static_cast<uint32_t>(size));
+        const size_t crc_begin = out.size();
+        out.append(type, 4);
+        out.append(data, size);
+        const uLong crc = crc32(0, reinterpret_cast<const Bytef*>(out.data() + crc_begin), static_cast<uInt>(out.size() - crc_begin));
+        append_big_endian_32(out, static_cast<uint32_t>(crc));
+    }
+
+    template <typename pixel_type>
+    void save_banded_png_impl(const dlib::matrix<pixel_type>& image, const std::string& filename, long band_height, int compression_level, int channels, unsigned char color_type)
+    {
+        const long width = image.nc();
+        const long height = image.nr();
+        const size_t row_size = width * channels;
+
+        if (width <= 0 || height <= 0) {
+            throw std::runtime_error("Can't write an empty image: " + filename);
+        }
+        band_height = std::max(1L, band_height);
+
+        z_stream stream = {};
+        if (deflateInit(&stream, compression_level) != Z_OK) {
+            throw std::runtime_error("Unable to initialize zlib");
+        }
+
+        std::string idat;
+        std::vector<uint64_t> band_offsets;
+
+        const std::vector<unsigned char> zero_row(row_size, 0);
+        std::vector<unsigned char> band_data;
+        std::vector<unsigned char> candidate(row_size);
+
+        for (long band_begin = 0; band_begin < height; band_begin += band_height) {
+            const long band_end = std::min(height, band_begin + band_height);
+
+            // the raw deflate data of band 0 begins right after the zlib header
+            band_offsets.push_back(band_begin == 0 ? 2 : stream.total_out);
+
+            band_data.resize((band_end - band_begin) * (row_size + 1));
+            unsigned char* out = band_data.data();
+
+            for (long r = band_begin; r < band_end; ++r, out += row_size + 1) {
+                const unsigned char* const row = reinterpret_cast<const unsigned char*>(&image(r, 0));
+                const unsigned char* const previous = r > band_begin ? reinterpret_cast<const unsigned char*>(&image(r - 1, 0)) : zero_row.data();
+
+                // The usual heuristic: the smallest sum of absolute (signed) differences.
+                // The first row of a band may use only None and Sub, which don't refer to
+                // the previous row.
+                const int filter_count = r > band_begin ? 5 : 2;
+                uint64_t best_cost = std::numeric_limits<uint64_t>::max();
+                for (int filter = 0; filter < filter_count; ++filter) {
+                    filter_row(filter, row, previous, row_size, channels, candidate.data());
+                    uint64_t cost = 0;
+                    for (size_t i = 0; i < row_size; ++i) {
+                        cost += std::abs(static_cast<signed char>(candidate[i]));
+                    }
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        out[0] = static_cast<unsigned char>(filter);
+                        std::copy(candidate.begin(), candidate.end(), out + 1);
+                    }
+                }
+            }
+
+            stream.next_in = band_data.data();
+            stream.avail_in = static_cast<uInt>(band_data.size());
+
+            const int flush = band_end < height ? Z_FULL_FLUSH : Z_FINISH;
+
+            while (true) {
+                const size_t written = stream.total_out;
+                idat.resize(written + std::max<size_t>(deflateBound(&stream, stream.avail_in), 64 * 1024));
+                stream.next_out = reinterpret_cast<Bytef*>(&idat[written]);
+                stream.avail_out = static_cast<uInt>(idat.size() - written);
+
+                const int result = deflate(&stream, flush);
+                if (result == Z_STREAM_ERROR) {
+                    deflateEnd(&stream);
+                    throw std::runtime_error("Unable to compress " + filename);
+                }
+                idat.resize(stream.total_out);
+
+                // a flush is complete when deflate doesn't use up all the output space
+                if (flush == Z_FINISH ? result == Z_STREAM_END : stream.avail_out > 0) {
+                    break;
+                }
+            }
+        }
+
+        deflateEnd(&stream);
+
+        std::string png(reinterpret_cast<const char*>(png_signature), sizeof(png_signature));
+
+        std::string header;
+        append_big_endian_32(header, static_cast<uint32_t>(width));
+        append_big_endian_32(header, static_cast<uint32_t>(height));
+        header.push_back(8); // bit depth
+        header.push_back(static_cast<char>(color_type));
+        header.append(3, '\0'); // compression, filter and interlace methods
+        append_png_chunk(png, "IHDR", header.data(), header.size());
+
+        std::string bands;
+        append_big_endian_32(bands, static_cast<uint32_t>(band_height));
+        append_big_endian_32(bands, static_cast<uint32_t>(band_offsets.size()));
+        for (const uint64_t offset : band_offsets) {
+            append_big_endian_64(bands, offset);
+        }
+        append_png_chunk(png, band_chunk_type, bands.data(), bands.size());
+
+        std::ofstream out(filename, std::ios::binary);
+        out.write(png.data(), png.size());
+
+        for (size_t offset = 0; offset < idat.size(); offset += max_idat_chunk_size) {
+            std::string chunk;
+            append_png_chunk(chunk, "IDAT", idat.data() + offset, std::min(max_idat_chunk_size, idat.size() - offset));
+            out.write(chunk.data(), chunk.size());
+        }
+
+        std::string end;
+        append_png_chunk(end, "IEND", nullptr, 0);
+        out.write(end.data(), end.size());
+
+        if (!out) {
+            throw std::runtime_error("Unable to write " + filename);
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------
+
+void set_parallel_decode_thread_count(unsigned int thread_count)
+{
+    parallel_decode_thread_count = std::max(1U, thread_count);
+}
+
+unsigned int get_parallel_decode_thread_count()
+{
+    return parallel_decode_thread_count;
+}
+
+// ----------------------------------------------------------------------------------------
+
+bool split_jpeg_into_bands(const char* data, size_t size, unsigned int max_band_count, jpeg_bands& bands)
+{
+    const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(data);
+
+    jpeg_frame frame;
+    if (max_band_count < 2 || !parse_jpeg_headers(bytes, size, frame) || frame.restart_interval == 0) {
+        return false;
+    }
+    if (static_cast<uint64_t>(frame.width) * frame.height < min_parallel_decode_pixel_count) {
+        return false;
+    }
+
+    // In a single-component scan, each MCU is just one 8x8 block
+    const long mcu_width = frame.component_count > 1 ? 8 * frame.max_h : 8;
+    const long mcu_height = frame.component_count > 1 ? 8 * frame.max_v : 8;
+    const long mcus_per_row = (frame.width + mcu_width - 1) / mcu_width;
+    const long mcu_rows = (frame.height + mcu_height - 1) / mcu_height;
+    const long mcu_count = mcus_per_row * mcu_rows;
+
+    // Find the restart intervals
+    std::vector<size_t> segment_begins(1, frame.scan_offset), segment_ends;
+
+    for (size_t position = frame.scan_offset; position + 1 < size; ++position) {
+        if (bytes[position] != 0xff) {
+            continue;
+        }
+        const unsigned char marker = bytes[position + 1];
+        if (marker == 0x00 || marker == 0xff) {
+            continue; // a stuffed zero or a fill byte
+        }
+        segment_ends.push_back(position);
+        if (marker >= 0xd0 && marker <= 0xd7) {
+            segment_begins.push_back(position + 2);
+            ++position;
+        }
+        else if (marker == 0xd9) {
+            break;
+        }
+        else {
+            return false; // another scan, or DNL
+        }
+    }
+
+    const long segment_count = static_cast<long>(segment_begins.size());
+    if (segment_ends.size() != segment_begins.size() || segment_count != (mcu_count + frame.restart_interval - 1) / frame.restart_interval) {
+        return false;
+    }
+
+    // The bands have to start at segments that start at MCU rows
+    const long target_mcu_rows_per_band = (mcu_rows + max_band_count - 1) / max_band_count;
+
+    std::vector<long> band_first_segments(1, 0);
+    long current_band_first_mcu_row = 0;
+
+    for (long segment = 1; segment < segment_count; ++segment) {
+        const long first_mcu = segment * frame.restart_interval;
+        if (first_mcu % mcus_per_row != 0) {
+            continue;
+        }
+        const long mcu_row = first_mcu / mcus_per_row;
+        if (mcu_row - current_band_first_mcu_row >= target_mcu_rows_per_band) {
+            band_first_segments.push_back(segment);
+            current_band_first_mcu_row = mcu_row;
+        }
+    }
+
+    if (band_first_segments.size() < 2) {
+        return false;
+    }
+
+    bands.width = frame.width;
+    bands.height = frame.height;
+    bands.first_rows.clear();
+    bands.jpegs.clear();
+
+    for (size_t band = 0; band < band_first_segments.size(); ++band) {
+        const long first_segment = band_first_segments[band];
+        const long end_segment = band + 1 < band_first_segments.size() ? band_first_segments[band + 1] : segment_count;
+
+        const long first_row = first_segment * frame.restart_interval / mcus_per_row * mcu_height;
+        const long end_row = end_segment < segment_count ? end_segment * frame.restart_interval / mcus_per_row * mcu_height : frame.height;
+
+        std::string jpeg(data, frame.scan_offset);
+        jpeg[frame.height_offset] = static_cast<char>((end_row - first_row) >> 8);
+        jpeg[frame.height_offset + 1] = static_cast<char>(end_row - first_row);
+
+        for (long segment = first_segment; segment < end_segment; ++segment) {
+            if (segment > first_segment) {
+                // The restart markers have to be numbered from zero in each band
+                jpeg.push_back(static_cast<char>(0xff));
+                jpeg.push_back(static_cast<char>(0xd0 + (segment - first_segment - 1) % 8));
+            }
+            jpeg.append(data + segment_begins[segment], data + segment_ends[segment]);
+        }
+
+        jpeg.push_back(static_cast<char>(0xff));
+        jpeg.push_back(static_cast<char>(0xd9));
+
+        bands.first_rows.push_back(first_row);
+        bands.jpegs.push_back(std::move(jpeg));
+    }
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------
+
+bool parse_banded_png(const char* data, size_t size, banded_png& png)
+{
+    const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(data);
+
+    if (size < sizeof(png_signature) || std::memcmp(bytes, png_signature, sizeof(png_signature)) != 0) {
+        return false;
+    }
+
+    bool has_bands = false;
+    png.idat.clear();
+
+    for (size_t position = sizeof(png_signature); position + 12 <= size; ) {
+        const size_t length = read_big_endian_32(bytes + position);
+        const char* const type = data + position + 4;
+        const unsigned char* const chunk = bytes + position + 8;
+
+        if (position + 12 + length > size) {
+            return false;
+        }
+
+        if (std::memcmp(type, "IHDR", 4) == 0) {
+            if (length < 13) {
+                return false;
+            }
+            png.width = read_big_endian_32(chunk);
+            png.height = read_big_endian_32(chunk + 4);
+            const unsigned char bit_depth = chunk[8];
+            const unsigned char color_type = chunk[9];
+            const unsigned char interlace_method = chunk[12];
+            switch (color_type) {
+            case 0: png.channels = 1; break;
+            case 2: png.channels = 3; break;
+            case 4: png.channels = 2; break;
+            case 6: png.channels = 4; break;
+            default: return false; // palette
+            }
+            if (bit_depth != 8 || interlace_method != 0 || png.width <= 0 || png.height <= 0) {
+                return false;
+            }
+            // the IHDR chunk comes first, so small images are let go before copying anything
+            if (static_cast<uint64_t>(png.width) * png.height < min_parallel_decode_pixel_count) {
+                return false;
+            }
+        }
+        else if (std::memcmp(type, band_chunk_type, 4) == 0) {
+            if (length < 8) {
+                return false;
+            }
+            png.band_height = read_big_endian_32(chunk);
+            const size_t band_count = read_big_endian_32(chunk + 4);
+            if (png.band_height <= 0 || length < 8 + 8 * band_count || band_count != static_cast<size_t>((png.height + png.band_height - 1) / png.band_height)) {
+                return false;
+            }
+            png.band_offsets.resize(band_count);
+            for (size_t i = 0; i < band_count; ++i) {
+                png.band_offsets[i] = read_big_endian_64(chunk + 8 + 8 * i);
+            }
+            has_bands = true;
+        }
+        else if (std::memcmp(type, "IDAT", 4) == 0) {
+            if (!has_bands) {
+                return false; // not written by us; no need to look any further
+            }
+            png.idat.insert(png.idat.end(), chunk, chunk + length);
+        }
+        else if (std::memcmp(type, "IEND", 4) == 0) {
+            break;
+        }
+
+        position += 12 + length;
+    }
+
+    if (!has_bands || png.idat.empty()) {
+        return false;
+    }
+    for (size_t i = 0; i < png.band_offsets.size(); ++i) {
+        if (png.band_offsets[i] >= png.idat.size() || (i > 0 && png.band_offsets[i] <= png.band_offsets[i - 1])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void decode_png_band(const banded_png& png, size_t band_index, const std::function<void(long, const unsigned char*)>& row_callback)
+{
+    const long first_row = band_index * png.band_height;
+    const long end_row = std::min(png.height, first_row + png.band_height);
+    const size_t row_size = png.width * png.channels;
+
+    const uint64_t begin = png.band_offsets[band_index];
+    const uint64_t end = band_index + 1 < png.band_offsets.size() ? png.band_offsets[band_index + 1] : png.idat.size();
+
+    z_stream stream = {};
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) { // raw deflate data, no zlib header
+        throw std::runtime_error("Unable to initialize zlib");
+    }
+
+    stream.next_in = const_cast<Bytef*>(png.idat.data() + begin);
+    stream.avail_in = static_cast<uInt>(end - begin);
+
+    // the filter type byte, and then the row
+    std::vector<unsigned char> current(row_size + 1), previous(row_size + 1, 0);
+
+    try {
+        for (long r = first_row; r < end_row; ++r) {
+            stream.next_out = current.data();
+            stream.avail_out = static_cast<uInt>(current.size());
+
+            while (stream.avail_out > 0) {
+                const int result = inflate(&stream, Z_SYNC_FLUSH);
+                if (result == Z_STREAM_END && stream.avail_out > 0) {
+                    throw std::runtime_error("Truncated PNG band");
+                }
+                if (result != Z_OK && result != Z_STREAM_END) {
+                    throw std::runtime_error("Corrupt PNG band");
+                }
+                if (result == Z_OK && stream.avail_in == 0 && stream.avail_out > 0) {
+                    throw std::runtime_error("Truncated PNG band");
+                }
+            }
+
+            unfilter_row(current[0], current.data() + 1, previous.data() + 1, row_size, png.channels);
+            row_callback(r, current.data() + 1);
+            std::swap(current, previous);
+        }
+    }
+    catch (...) {
+        inflateEnd(&stream);
+        throw;
+    }
+
+    inflateEnd(&stream);
+}
+
+void save_banded_png(const dlib::matrix<unsigned char>& image, const std::string& filename, long band_height, int compression_level)
+{
+    save_banded_png_impl(image, filename, band_height, compression_level, 1, 0);
+}
+
+void save_banded_png(const dlib::matrix<dlib::rgb_pixel>& image, const std::string& filename, long band_height, int compression_level)
+{
+    save_banded_png_impl(image, filename, band_height, compression_level, 3, 2);
+}
+
+void save_banded_png(const dlib::matrix<dlib::rgb_alpha_pixel>& image, const std::string& filename, long band_height, int compression_level)
+{
+    save_banded_png_impl(image, filename, band_height, compression_level, 4, 6);
+}
@@ -0,0 +1,165 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+
+    Decoding a huge (hundreds of megapixels) image on a single thread easily
+    takes longer than everything else done to it. Two kinds of files can be
+    decoded a horizontal band per thread instead:
+
+    - JPEG files that have restart markers (DRI) at the starts of MCU rows:
+      each band is decoded as a separate small JPEG, made of the original
+      headers and the entropy-coded segments of the band. Seams can differ
+      very slightly from a single-threaded decode, if the chroma is
+      subsampled and smoothly upsampled.
+    - "Banded" PNG files, as written by save_banded_png (or annonet_convert
+      --format png). The compressor state is reset (Z_FULL_FLUSH) at the start
+      of each band, and the first row of a band never refers to the previous
+      row, so each band can be inflated and unfiltered independently. The
+      band offsets are stored in a private anBD chunk; to any other PNG
+      decoder the files are perfectly ordinary PNG files.
+
+    Everything else (and small images) goes to the ordinary decoders.
+*/
+
+#ifndef ANNONET_PARALLEL_DECODE_H
+#define ANNONET_PARALLEL_DECODE_H
+
+#include "annonet_image_formats.h"
+
+#include <dlib/image_io.h>
+#include <dlib/threads.h>
+#include <functional>
+
+// ----------------------------------------------------------------------------------------
+
+// Defaults to the number of hardware threads; 1 disables parallel decoding
+void set_parallel_decode_thread_count(unsigned int thread_count);
+unsigned int get_parallel_decode_thread_count();
+
+// ----------------------------------------------------------------------------------------
+
+struct jpeg_bands
+{
+    long width = 0;
+    long height = 0;
+    std::vector<long> first_rows;
+    std::vector<std::string> jpegs; // each one a complete JPEG file
+};
+
+// Returns false if the data can't (or needn't) be split
+bool split_jpeg_into_bands(const char* data, size_t size, unsigned int max_band_count, jpeg_bands& bands);
+
+struct banded_png
+{
+    long width = 0;
+    long height = 0;
+    int channels = 0;
+    long band_height = 0;
+    std::vector<uint64_t> band_offsets; // in idat, where each raw deflate band starts
+    std::vector<unsigned char> idat;
+};
+
+// Returns false if this is not a banded PNG file, is too small to be worth splitting, or
+// uses features (such as 16-bit samples, palettes or interlacing) that the banded decoder
+// doesn't support
+bool parse_banded_png(const char* data, size_t size, banded_png& png);
+
+// Calls row_callback(row, pixels) for each row of the band, in order
+void decode_png_band(const banded_png& png, size_t band_index, const std::function<void(long, const unsigned char*)>& row_callback);
+
+void save_banded_png(const dlib::matrix<unsigned char>& image, const std::string& filename, long band_height = 256, int compression_level = 6);
+void save_banded_png(const dlib::matrix<dlib::rgb_pixel>& image, const std::string& filename, long band_height = 256, int compression_level = 6);
+void save_banded_png(const dlib::matrix<dlib::rgb_alpha_pixel>& image, const std::string& filename, long band_height = 256, int compression_level = 6);
+
+// ----------------------------------------------------------------------------------------
+
+namespace parallel_decode_impl {
+
+    // Runs task(i) for each band; the first error (if any) is thrown afterwards
+    template <typename task_type>
+    void for_each_band(size_t band_count, const task_type& task)
+    {
+        std::vector<std::string> errors(band_count);
+
+        dlib::parallel_for(std::min<size_t>(band_count, get_parallel_decode_thread_count()), 0, band_count, [&](long i) {
+            try {
+                task(i);
+            }
+            catch (std::exception& e) {
+                errors[i] = e.what();
+            }
+        });
+
+        for (const std::string& error : errors) {
+            if (!error.empty()) {
+                throw std::runtime_error(error);
+            }
+        }
+    }
+}
+
+template <typename image_type>
+bool load_jpeg_in_parallel(image_type& image, const char* data, size_t size, const std::string& name)
+{
+    jpeg_bands bands;
+    if (!split_jpeg_into_bands(data, size, get_parallel_decode_thread_count(), bands)) {
+        return false;
+    }
+
+    image.set_size(bands.height, bands.width);
+
+    parallel_decode_impl::for_each_band(bands.jpegs.size(), [&](size_t i) {
+        const std::string& jpeg = bands.jpegs[i];
+        image_type band;
+        dlib::load_jpeg(band, reinterpret_cast<const unsigned char*>(jpeg.data()), jpeg.size());
+
+        const long first_row = bands.first_rows[i];
+        const long row_count = (i + 1 < bands.first_rows.size() ? bands.first_rows[i + 1] : bands.height) - first_row;
+
+        if (band.nr() != row_count || band.nc() != bands.width) {
+            throw std::runtime_error("Unexpected band size when decoding " + name);
+        }
+
+        for (long r = 0; r < row_count; ++r) {
+            std::copy(&band(r, 0), &band(r, 0) + bands.width, &image(first_row + r, 0));
+        }
+    });
+
+    return true;
+}
+
+template <typename image_type>
+bool load_banded_png_in_parallel(image_type& image, const char* data, size_t size, const std::string& name)
+{
+    banded_png png;
+    if (get_parallel_decode_thread_count() < 2 || !parse_banded_png(data, size, png)) {
+        return false;
+    }
+
+    image.set_size(png.height, png.width);
+
+    parallel_decode_impl::for_each_band(png.band_offsets.size(), [&](size_t i) {
+        try {
+            decode_png_band(png, i, [&](long row, const unsigned char* pixels) {
+                image_formats_impl::assign_row(&image(row, 0), pixels, png.width, png.channels);
+            });
+        }
+        catch (std::exception& e) {
+            throw std::runtime_error(std::string(e.what()) + ": " + name);
+        }
+    });
+
+    return true;
+}
+
+#endif // ANNONET_PARALLEL_DECODE_H
@@ -15,6 +15,11 @@
 
 #include "annonet_parse_anno_classes.h"
 #include <rapidjson/document.h>
+#include <rapidjson/prettywriter.h>
+#include <rapidjson/stringbuffer.h>
+#include <algorithm>
+#include <limits>
+#include <sstream>
 
 // ----------------------------------------------------------------------------------------
 
@@ -25,37 +30,22 @@ bool operator == (const dlib::rgb_alpha_pixel& a, const dlib::rgb_alpha_pixel& b
 
 // ----------------------------------------------------------------------------------------
 
-std::vector<AnnoClass> parse_anno_classes(const std::string& json)
-{
-    if (json.empty()) {
-        // Use the default anno classes
-        return std::vector<AnnoClass>{
-            AnnoClass(0, dlib::rgb_alpha_pixel(0, 255, 0, 64), "clean"),
-            AnnoClass(1, dlib::rgb_alpha_pixel(255, 255, 0, 128), "minor defect"),
-            AnnoClass(2, dlib::rgb_alpha_pixel(255, 0, 0, 128), "major defect"),
-        };
-    }
-
-    rapidjson::Document doc;
-    doc.Parse(json.c_str());
-    if (doc.HasParseError()) {
-        throw std::runtime_error("Error parsing json\n" + json);
-    }
-
-    if (!doc.IsObject()) {
-        throw std::runtime_error("Unexpected anno classes json content - the document should be an object");
-    }
+namespace {
 
-    const auto anno_classes_member = doc.FindMember("anno_classes");
+    void parse_anno_classes_document(const std::string& json, rapidjson::Document& doc)
+    {
+        doc.Parse(json.c_str());
+        if (doc.HasParseError()) {
+            throw std::runtime_error("Error parsing json\n" + json);
+        }
 
-    if (anno_classes_member == doc.MemberEnd() || !anno_classes_member->value.IsArray()) {
-        throw std::runtime_error("Unexpected anno classes json content - there should be an anno_classes array");
+        if (!doc.IsObject()) {
+            throw std::runtime_error("Unexpected anno classes json content - the document should be an object");
+        }
     }
 
-    std::vector<AnnoClass> anno_classes;
-
-    for (rapidjson::SizeType i = 0, end = anno_classes_member->value.Size(); i < end; ++i) {
-        const auto& anno_class = anno_classes_member->value[i];
+    AnnoClass parse_anno_class(const rapidjson::Value& anno_class, uint16_t index)
+    {
         const auto name_member = anno_class.FindMember("name");
         const auto color_member = anno_class.FindMember("color");
         if (name_member == anno_class.MemberEnd()) {
@@ -83,8 +73,206 @@ std::vector<AnnoClass> parse_anno_classes(const std::string& json)
             throw std::runtime_error("Unexpected anno classes json content - rgba (0, 0, 0, 0) is reserved for pixels to be ignored");
         }
 
-        anno_classes.push_back(AnnoClass(i, rgba_value, name_member->value.GetString()));
+        return AnnoClass(index, rgba_value, name_member->value.GetString());
+    }
+
+    void write_anno_class(rapidjson::PrettyWriter<rapidjson::StringBuffer>& writer, const AnnoClass& anno_class, bool write_index)
+    {
+        writer.StartObject();
+        writer.Key("name");
+        writer.String(anno_class.classlabel.c_str());
+        if (write_index) {
+            writer.Key("index");
+            writer.Int(anno_class.index);
+        }
+        writer.Key("color");
+        writer.StartObject();
+        writer.Key("red");
+        writer.Int(anno_class.rgba_label.red);
+        writer.Key("green");
+        writer.Int(anno_class.rgba_label.green);
+        writer.Key("blue");
+        writer.Int(anno_class.rgba_label.blue);
+        writer.Key("alpha");
+        writer.Int(anno_class.rgba_label.alpha);
+        writer.EndObject();
+        writer.EndObject();
+    }
+}
+
+std::vector<AnnoClass> parse_anno_classes(const std::string& json)
+{
+    if (json.empty()) {
+        // Use the default anno classes
+        return std::vector<AnnoClass>{
+            AnnoClass(0, dlib::rgb_alpha_pixel(0, 255, 0, 64), "clean"),
+            AnnoClass(1, dlib::rgb_alpha_pixel(255, 255, 0, 128), "minor defect"),
+            AnnoClass(2, dlib::rgb_alpha_pixel(255, 0, 0, 128), "major defect"),
+        };
+    }
+
+    rapidjson::Document doc;
+    parse_anno_classes_document(json, doc);
+
+    const auto anno_classes_member = doc.FindMember("anno_classes");
+
+    if (anno_classes_member == doc.MemberEnd() || !anno_classes_member->value.IsArray()) {
+        throw std::runtime_error("Unexpected anno classes json content - there should be an anno_classes array");
+    }
+
+    std::vector<AnnoClass> anno_classes;
+
+    for (rapidjson::SizeType i = 0, end = anno_classes_member->value.Size(); i < end; ++i) {
+        anno_classes.push_back(parse_anno_class(anno_classes_member->value[i], i));
     }
 
     return anno_classes;
 }
+
+std::vector<AnnoClass> parse_decoding_anno_classes(const std::string& json)
+{
+    const std::vector<AnnoClass> anno_classes = parse_anno_classes(json);
+
+    if (json.empty()) {
+        return anno_classes;
+    }
+
+    rapidjson::Document doc;
+    parse_anno_classes_document(json, doc);
+
+    const auto decoding_classes_member = doc.FindMember("decoding_classes");
+
+    if (decoding_classes_member == doc.MemberEnd()) {
+        return anno_classes;
+    }
+
+    if (!decoding_classes_member->value.IsArray()) {
+        throw std::runtime_error("Unexpected anno classes json content - decoding_classes should be an array");
+    }
+
+    std::vector<AnnoClass> decoding_classes;
+
+    for (rapidjson::SizeType i = 0, end = decoding_classes_member->value.Size(); i < end; ++i) {
+        const auto& decoding_class = decoding_classes_member->value[i];
+        const auto index_member = decoding_class.FindMember("index");
+        if (index_member == decoding_class.MemberEnd() || !index_member->value.IsUint() || index_member->value.GetUint() >= anno_classes.size()) {
+            throw std::runtime_error("Unexpected anno classes json content - each decoding class should have the index of one of the anno classes");
+        }
+        decoding_classes.push_back(parse_anno_class(decoding_class, static_cast<uint16_t>(index_member->value.GetUint())));
+    }
+
+    return decoding_classes;
+}
+
+// ----------------------------------------------------------------------------------------
+
+std::string anno_classes_to_json(const std::vector<AnnoClass>& anno_classes)
+{
+    return anno_classes_to_json(anno_classes, std::vector<AnnoClass>());
+}
+
+std::string anno_classes_to_json(const std::vector<AnnoClass>& anno_classes, const std::vector<AnnoClass>& decoding_classes)
+{
+    rapidjson::StringBuffer buffer;
+    rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(buffer);
+
+    writer.StartObject();
+    writer.Key("anno_classes");
+    writer.StartArray();
+    for (const AnnoClass& anno_class : anno_classes) {
+        write_anno_class(writer, anno_class, false);
+    }
+    writer.EndArray();
+    if (!decoding_classes.empty()) {
+        writer.Key("decoding_classes");
+        writer.StartArray();
+        for (const AnnoClass& decoding_class : decoding_classes) {
+            write_anno_class(writer, decoding_class, true);
+        }
+        writer.EndArray();
+    }
+    writer.EndObject();
+
+    return buffer.GetString();
+}
+
+// ----------------------------------------------------------------------------------------
+
+std::vector<std::pair<uint16_t, uint16_t>> parse_class_remap(const std::vector<std::string>& remap_specs)
+{
+    std::vector<std::pair<uint16_t, uint16_t>> remap;
+
+    for (const std::string& remap_spec : remap_specs) {
+        const size_t separator = remap_spec.find(':');
+        try {
+            if (separator == std::string::npos) {
+                throw std::invalid_argument(remap_spec);
+            }
+            const unsigned long from = std::stoul(remap_spec.substr(0, separator));
+            const unsigned long to = std::stoul(remap_spec.substr(separator + 1));
+            if (from > std::numeric_limits<uint16_t>::max() || to > std::numeric_limits<uint16_t>::max()) {
+                throw std::out_of_range(remap_spec);
+            }
+            remap.push_back(std::make_pair(static_cast<uint16_t>(from), static_cast<uint16_t>(to)));
+        }
+        catch (std::logic_error&) {
+            throw std::runtime_error("Invalid class remapping: " + remap_spec + " (expected from:to, e.g. 2:1)");
+        }
+    }
+
+    return remap;
+}
+
+remapped_anno_classes remap_anno_classes(const std::vector<AnnoClass>& anno_classes, const std::vector<std::pair<uint16_t, uint16_t>>& remap)
+{
+    std::vector<uint16_t> targets;
+    for (const AnnoClass& anno_class : anno_classes) {
+        if (anno_class.index >= targets.size()) {
+            targets.resize(anno_class.index + 1);
+        }
+        targets[anno_class.index] = anno_class.index;
+    }
+
+    const auto is_class = [&](uint16_t index) {
+        return std::find_if(anno_classes.begin(), anno_classes.end(), [index](const AnnoClass& anno_class) { return anno_class.index == index; }) != anno_classes.end();
+    };
+
+    for (const auto& from_to : remap) {
+        if (!is_class(from_to.first) || !is_class(from_to.second)) {
+            std::ostringstream error;
+            error << "Unable to remap class " << from_to.first << " to " << from_to.second << ": no such class";
+            throw std::runtime_error(error.str());
+        }
+        targets[from_to.first] = from_to.second;
+    }
+
+    // Follow chains like 3:2 2:1, so that every class ends up in one that is kept
+    std::vector<uint16_t> final_targets(targets.size());
+    for (size_t i = 0; i < targets.size(); ++i) {
+        uint16_t target = targets[i];
+        for (size_t steps = 0; targets[target] != target; ++steps) {
+            if (steps > targets.size()) {
+                throw std::runtime_error("The class remapping has a cycle");
+            }
+            target = targets[target];
+        }
+        final_targets[i] = target;
+    }
+    targets = final_targets;
+
+    remapped_anno_classes result;
+
+    std::vector<uint16_t> output_indexes(targets.size(), 0);
+    for (const AnnoClass& anno_class : anno_classes) {
+        if (targets[anno_class.index] == anno_class.index) {
+            output_indexes[anno_class.index] = static_cast<uint16_t>(result.output_classes.size());
+            result.output_classes.push_back(AnnoClass(output_indexes[anno_class.index], anno_class.rgba_label, anno_class.classlabel));
+        }
+    }
+
+    for (const AnnoClass& anno_class : anno_classes) {
+        result.decoding_classes.push_back(AnnoClass(output_indexes[targets[anno_class.index]], anno_class.rgba_label, anno_class.classlabel));
+    }
+
+    return result;
+}
@@ -40,4 +40,34 @@ namespace {
 
 std::vector<AnnoClass> parse_anno_classes(const std::string& json);
 
+// The classes for decoding the label images: those saved by anno_classes_to_json along
+// with a class remapping, or else the anno classes themselves
+std::vector<AnnoClass> parse_decoding_anno_classes(const std::string& json);
+
+std::string anno_classes_to_json(const std::vector<AnnoClass>& anno_classes);
+
+// Saves also the decoding classes of a class remapping, so that the label images can
+// later be decoded the same way as in training
+std::string anno_classes_to_json(const std::vector<AnnoClass>& anno_classes, const std::vector<AnnoClass>& decoding_classes);
+
+// ----------------------------------------------------------------------------------------
+
+// Each from:to pair makes the pixels of class "from" count as class "to"; e.g., 2:1 merges
+// the major defects into the minor ones
+std::vector<std::pair<uint16_t, uint16_t>> parse_class_remap(const std::vector<std::string>& remap_specs);
+
+struct remapped_anno_classes
+{
+    // For decoding the label images: all the original colors, but with remapped (and
+    // possibly shared) indexes
+    std::vector<AnnoClass> decoding_classes;
+
+    // What the net outputs: the classes that are left, renumbered from 0 in the original
+    // order, so that the indexes stay contiguous
+    std::vector<AnnoClass> output_classes;
+};
+
+// The remapping is built into the color-to-index table, so it costs nothing when loading
+remapped_anno_classes remap_anno_classes(const std::vector<AnnoClass>& anno_classes, const std::vector<std::pair<uint16_t, uint16_t>>& remap);
+
 #endif // ANNONET_PARSE_ANNO_CLASSES_H
\ No newline at end of file
@@ -0,0 +1,141 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+*/
+
+#include "annonet_rescan.h"
+#include "annonet_tar.h"
+
+#include <iostream>
+#include <unordered_map>
+
+// ----------------------------------------------------------------------------------------
+
+std::vector<stamped_image_filenames> stamp_image_files(const std::vector<image_filenames>& image_files, bool stamp)
+{
+    std::vector<stamped_image_filenames> results(image_files.size());
+
+    for (size_t i = 0; i < image_files.size(); ++i) {
+        stamped_image_filenames& result = results[i];
+        result.filenames = image_files[i];
+
+        if (stamp) {
+            try {
+                get_file_stamp(result.filenames.image_filename, result.image_offset, result.image_size, result.image_modification_time);
+                if (!result.filenames.label_filename.empty()) {
+                    get_file_stamp(result.filenames.label_filename, result.label_offset, result.label_size, result.label_modification_time);
+                }
+            }
+            catch (std::exception&) {
+                // removed after the scan; reading the sample will report it
+            }
+        }
+    }
+
+    return results;
+}
+
+std::vector<image_filenames> get_filenames(const std::vector<stamped_image_filenames>& image_files)
+{
+    std::vector<image_filenames> results;
+    results.reserve(image_files.size());
+    for (const stamped_image_filenames& image_file : image_files) {
+        results.push_back(image_file.filenames);
+    }
+    return results;
+}
+
+// ----------------------------------------------------------------------------------------
+
+dataset_rescanner::dataset_rescanner(
+    const std::string& anno_data_folder,
+    const std::vector<stamped_image_filenames>& initial_image_files,
+    std::chrono::seconds interval,
+    change_handler on_change
+)
+    : anno_data_folder(anno_data_folder)
+    , interval(interval)
+    , on_change(on_change)
+    , image_files(initial_image_files)
+{
+    thread = std::thread([this]() { run(); });
+}
+
+dataset_rescanner::~dataset_rescanner()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    stop_requested.notify_all();
+    thread.join();
+}
+
+void dataset_rescanner::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stop_requested.wait_for(lock, interval, [this]() { return stop; })) {
+        lock.unlock();
+        try {
+            rescan();
+        }
+        catch (std::exception& e) {
+            std::cout << std::endl << "Unable to rescan " << anno_data_folder << ": " << e.what() << std::endl;
+        }
+        lock.lock();
+    }
+}
+
+void dataset_rescanner::rescan()
+{
+    if (is_tar_archive(anno_data_folder)) {
+        reload_tar_archive_if_changed(anno_data_folder);
+    }
+
+    std::vector<stamped_image_filenames> rescanned = stamp_image_files(find_image_files(anno_data_folder, true, false), true);
+
+    std::unordered_map<std::string, const stamped_image_filenames*> previous;
+    for (const stamped_image_filenames& image_file : image_files) {
+        previous[image_file.filenames.image_filename] = &image_file;
+    }
+
+    size_t added = 0, modified = 0;
+    for (const stamped_image_filenames& image_file : rescanned) {
+        const auto i = previous.find(image_file.filenames.image_filename);
+        if (i == previous.end()) {
+            ++added;
+        }
+        else {
+            if (!(*i->second == image_file)) {
+                ++modified;
+            }
+            previous.erase(i);
+        }
+    }
+    const size_t removed = previous.size();
+
+    if (added == 0 && modified == 0 && removed == 0) {
+        return;
+    }
+
+    std::cout << std::endl << "Rescanned " << anno_data_folder << ": " << added << " added, " << modified << " modified, " << removed << " removed" << std::endl;
+
+    if (rescanned.empty()) {
+        std::cout << "Keeping the previous images, as there are none left" << std::endl;
+        return;
+    }
+
+    on_change(rescanned);
+
+    image_files = std::move(rescanned);
+}
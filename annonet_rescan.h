@@ -0,0 +1,109 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+
+    Long trainings can pick up new and modified annotations without being
+    restarted: the dataset is rescanned periodically in a background thread,
+    and each file is stamped with its size and modification time (and a member
+    of a tar archive with its own header, including its offset). A modified
+    file thus looks like a new one to the sample cache, and the stale sample
+    simply ages out.
+*/
+
+#ifndef ANNONET_RESCAN_H
+#define ANNONET_RESCAN_H
+
+#include "annonet.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// ----------------------------------------------------------------------------------------
+
+struct stamped_image_filenames
+{
+    image_filenames filenames;
+    uint64_t image_offset = 0; // only for members of tar archives
+    uint64_t image_size = 0;
+    int64_t image_modification_time = 0;
+    uint64_t label_offset = 0;
+    uint64_t label_size = 0;
+    int64_t label_modification_time = 0;
+};
+
+inline bool operator==(const stamped_image_filenames& a, const stamped_image_filenames& b)
+{
+    return a.filenames.image_filename == b.filenames.image_filename
+        && a.filenames.label_filename == b.filenames.label_filename
+        && a.image_offset == b.image_offset
+        && a.image_size == b.image_size
+        && a.image_modification_time == b.image_modification_time
+        && a.label_offset == b.label_offset
+        && a.label_size == b.label_size
+        && a.label_modification_time == b.label_modification_time;
+}
+
+namespace std {
+    template <>
+    struct hash<stamped_image_filenames> {
+        std::size_t operator()(const stamped_image_filenames& s) const {
+            return hash<string>()(s.filenames.image_filename + ", " + s.filenames.label_filename)
+                ^ hash<int64_t>()(s.image_modification_time + 31 * s.label_modification_time);
+        }
+    };
+}
+
+// If stamp is false, the stamps are left zero (saves a couple of stat calls per file)
+std::vector<stamped_image_filenames> stamp_image_files(const std::vector<image_filenames>& image_files, bool stamp);
+
+std::vector<image_filenames> get_filenames(const std::vector<stamped_image_filenames>& image_files);
+
+// ----------------------------------------------------------------------------------------
+
+class dataset_rescanner
+{
+public:
+    typedef std::function<void(const std::vector<stamped_image_filenames>&)> change_handler;
+
+    // Calls on_change (in the background thread) whenever images have been added, removed
+    // or modified; if on_change throws, the error is printed, and the change is retried on
+    // the next rescan
+    dataset_rescanner(
+        const std::string& anno_data_folder,
+        const std::vector<stamped_image_filenames>& initial_image_files,
+        std::chrono::seconds interval,
+        change_handler on_change
+    );
+
+    ~dataset_rescanner();
+
+private:
+    void run();
+    void rescan();
+
+    const std::string anno_data_folder;
+    const std::chrono::seconds interval;
+    const change_handler on_change;
+
+    std::vector<stamped_image_filenames> image_files;
+
+    std::mutex mutex;
+    std::condition_variable stop_requested;
+    bool stop = false;
+    std::thread thread;
+};
+
+#endif // ANNONET_RESCAN_H
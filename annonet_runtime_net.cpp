@@ -0,0 +1,217 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+*/
+
+#include "annonet_runtime_net.h"
+#include "annonet_kernels.h"
+#include "annonet_net_variant.h"
+
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <dlib/windows_magic.h>
+#include <windows.h>
+#else // _WIN32
+#include <dlfcn.h>
+#include <unistd.h>
+#endif // _WIN32
+
+namespace {
+
+#ifdef _WIN32
+    const char* const avx2_module_name = "annonet_net_avx2.dll";
+#else // _WIN32
+    const char* const avx2_module_name = "libannonet_net_avx2.so";
+#endif // _WIN32
+
+    // The directory of the running program, including the trailing separator; or
+    // an empty string if it cannot be found out
+    std::string get_program_directory()
+    {
+        std::string path;
+#ifdef _WIN32
+        char buffer[MAX_PATH];
+        const DWORD length = GetModuleFileNameA(NULL, buffer, MAX_PATH);
+        if (length > 0 && length < MAX_PATH) {
+            path.assign(buffer, length);
+        }
+#else // _WIN32
+        char buffer[4096];
+        const ssize_t length = readlink("/proc/self/exe", buffer, sizeof(buffer));
+        if (length > 0 && static_cast<size_t>(length) < sizeof(buffer)) {
+            path.assign(buffer, static_cast<size_t>(length));
+        }
+#endif // _WIN32
+        const size_t separator = path.find_last_of("/\\");
+        return separator == std::string::npos ? std::string() : path.substr(0, separator + 1);
+    }
+}
+
+// ----------------------------------------------------------------------------------------
+
+struct annonet_runtime_net::module
+{
+    // Returns nullptr if the module is not there, or does not match this program
+    static std::unique_ptr<module> load(const std::string& filename)
+    {
+        std::unique_ptr<module> result(new module);
+#ifdef _WIN32
+        result->handle = LoadLibraryA(filename.c_str());
+#else // _WIN32
+        result->handle = dlopen(filename.c_str(), RTLD_NOW | RTLD_LOCAL);
+#endif // _WIN32
+        if (!result->handle) {
+            return nullptr;
+        }
+
+        typedef int(*api_version_function)();
+        api_version_function api_version = nullptr;
+
+        const bool found = result->get_function("annonet_net_variant_api_version", api_version)
+            && result->get_function("annonet_net_variant_create", result->create)
+            && result->get_function("annonet_net_variant_destroy", result->destroy)
+            && result->get_function("annonet_net_variant_deserialize", result->deserialize)
+            && result->get_function("annonet_net_variant_infer", result->infer)
+            && result->get_function("annonet_net_variant_get_output", result->get_output)
+            && result->get_function("annonet_net_variant_last_error", result->last_error);
+
+        if (!found || api_version() != ANNONET_NET_VARIANT_API_VERSION) {
+            return nullptr;
+        }
+        return result;
+    }
+
+    ~module()
+    {
+        if (handle) {
+#ifdef _WIN32
+            FreeLibrary(static_cast<HMODULE>(handle));
+#else // _WIN32
+            dlclose(handle);
+#endif // _WIN32
+        }
+    }
+
+    template <typename Function>
+    bool get_function(const char* name, Function& function)
+    {
+#ifdef _WIN32
+        function = reinterpret_cast<Function>(GetProcAddress(static_cast<HMODULE>(handle), name));
+#else // _WIN32
+        function = reinterpret_cast<Function>(dlsym(handle, name));
+#endif // _WIN32
+        return function != nullptr;
+    }
+
+    void* handle = nullptr;
+
+    decltype(&annonet_net_variant_create) create = nullptr;
+    decltype(&annonet_net_variant_destroy) destroy = nullptr;
+    decltype(&annonet_net_variant_deserialize) deserialize = nullptr;
+    decltype(&annonet_net_variant_infer) infer = nullptr;
+    decltype(&annonet_net_variant_get_output) get_output = nullptr;
+    decltype(&annonet_net_variant_last_error) last_error = nullptr;
+};
+
+// ----------------------------------------------------------------------------------------
+
+annonet_runtime_net::annonet_runtime_net()
+{
+#ifndef DLIB_USE_CUDA
+    if (get_kernels().isa >= isa_level::avx2) {
+        variant_module = module::load(get_program_directory() + avx2_module_name);
+        if (variant_module) {
+            variant_net = variant_module->create();
+            if (!variant_net) {
+                variant_module.reset();
+            }
+        }
+    }
+#endif // DLIB_USE_CUDA
+    if (!variant_net) {
+        in_process_net.reset(new NetPimpl::RuntimeNet);
+    }
+}
+
+annonet_runtime_net::~annonet_runtime_net()
+{
+    if (variant_net) {
+        variant_module->destroy(variant_net);
+    }
+}
+
+std::string annonet_runtime_net::GetVariantName() const
+{
+    return variant_net ? "avx2 module" : "in-process";
+}
+
+void annonet_runtime_net::Deserialize(const std::string& serialized_net)
+{
+    if (variant_net) {
+        if (variant_module->deserialize(variant_net, serialized_net.data(), serialized_net.size()) != 0) {
+            throw std::runtime_error(variant_module->last_error(variant_net));
+        }
+    }
+    else {
+        in_process_net->Deserialize(std::istringstream(serialized_net));
+    }
+}
+
+dlib::matrix<uint16_t> annonet_runtime_net::operator() (const NetPimpl::input_type& input_image, const std::vector<double>& gains)
+{
+    if (!variant_net) {
+        return (*in_process_net)(input_image, gains);
+    }
+
+    output_copied = false;
+
+    const uint16_t* labels = nullptr;
+    long labels_nr = 0;
+    long labels_nc = 0;
+
+    const void* pixels = input_image.size() > 0 ? &input_image(0, 0) : nullptr;
+
+    if (variant_module->infer(variant_net, pixels, sizeof(NetPimpl::input_type::type), input_image.nr(), input_image.nc(), gains.data(), gains.size(), &labels, &labels_nr, &labels_nc) != 0) {
+        throw std::runtime_error(variant_module->last_error(variant_net));
+    }
+
+    dlib::matrix<uint16_t> result(labels_nr, labels_nc);
+    if (result.size() > 0) {
+        std::memcpy(&result(0, 0), labels, static_cast<size_t>(result.size()) * sizeof(uint16_t));
+    }
+    return result;
+}
+
+const dlib::tensor& annonet_runtime_net::GetOutput() const
+{
+    if (!variant_net) {
+        return in_process_net->GetOutput();
+    }
+
+    if (!output_copied) {
+        const float* data = nullptr;
+        long long num_samples = 0, k = 0, nr = 0, nc = 0;
+        if (variant_module->get_output(variant_net, &data, &num_samples, &k, &nr, &nc) != 0) {
+            throw std::runtime_error(variant_module->last_error(variant_net));
+        }
+        output.set_size(num_samples, k, nr, nc);
+        if (output.size() > 0) {
+            std::memcpy(output.host_write_only(), data, output.size() * sizeof(float));
+        }
+        output_copied = true;
+    }
+    return output;
+}
@@ -0,0 +1,66 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+
+    The runtime net used by annonet_infer. When the selected instruction set
+    level is AVX2 or better, and the annonet_net_avx2 module is found next to
+    the program, the net runs in the module; otherwise it runs in-process, as
+    NetPimpl::RuntimeNet built for the baseline instruction set.
+*/
+
+#ifndef ANNONET_RUNTIME_NET_H
+#define ANNONET_RUNTIME_NET_H
+
+#include "dlib-dnn-pimpl-wrapper/NetPimpl.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+struct annonet_net_variant;
+
+class annonet_runtime_net
+{
+public:
+    // Picks the variant according to get_kernels(), so select_kernels has to be
+    // called first (if at all)
+    annonet_runtime_net();
+    ~annonet_runtime_net();
+
+    annonet_runtime_net(const annonet_runtime_net&) = delete;
+    annonet_runtime_net& operator= (const annonet_runtime_net&) = delete;
+
+    // For example, "avx2 module" or "in-process"
+    std::string GetVariantName() const;
+
+    void Deserialize(const std::string& serialized_net);
+
+    // Same contract as NetPimpl::RuntimeNet
+    dlib::matrix<uint16_t> operator() (const NetPimpl::input_type& input_image, const std::vector<double>& gains = std::vector<double>());
+
+    const dlib::tensor& GetOutput() const;
+
+private:
+    struct module;
+
+    std::unique_ptr<module> variant_module;
+    annonet_net_variant* variant_net = nullptr;
+
+    std::unique_ptr<NetPimpl::RuntimeNet> in_process_net;
+
+    // The module's output is copied only when asked for
+    mutable dlib::resizable_tensor output;
+    mutable bool output_copied = false;
+};
+
+#endif // ANNONET_RUNTIME_NET_H
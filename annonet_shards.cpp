@@ -0,0 +1,431 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+*/
+
+#include "annonet_shards.h"
+
+#include <dlib/dir_nav.h>
+#include <dlib/external/zlib/zlib.h>
+#include <algorithm>
+#include <ctime>
+#include <sstream>
+#include <type_traits>
+
+namespace {
+    const std::string shard_magic = "annoshard";
+    const int shard_version = 1;
+
+    // The pixels are written as a raw block, because serializing them one by one is slow
+    template <typename pixel_type>
+    void serialize_pixels(const dlib::matrix<pixel_type>& image, std::ostream& out)
+    {
+        static_assert(std::is_trivially_copyable<pixel_type>::value, "The pixels are copied as raw bytes");
+        dlib::serialize(image.nr(), out);
+        dlib::serialize(image.nc(), out);
+        if (image.size() > 0) {
+            out.write(reinterpret_cast<const char*>(&image(0, 0)), image.size() * sizeof(pixel_type));
+        }
+    }
+
+    template <typename pixel_type>
+    void deserialize_pixels(dlib::matrix<pixel_type>& image, std::istream& in)
+    {
+        long nr = 0, nc = 0;
+        dlib::deserialize(nr, in);
+        dlib::deserialize(nc, in);
+        image.set_size(nr, nc);
+        if (image.size() > 0) {
+            in.read(reinterpret_cast<char*>(&image(0, 0)), image.size() * sizeof(pixel_type));
+        }
+        if (!in) {
+            throw dlib::serialization_error("Truncated image data");
+        }
+    }
+
+    // The labeled points are in row-major order, so they are stored as horizontal runs
+    void serialize_labeled_points(const std::unordered_map<uint16_t, std::deque<dlib::point>>& labeled_points_by_class, std::ostream& out)
+    {
+        dlib::serialize(static_cast<uint64_t>(labeled_points_by_class.size()), out);
+
+        for (const auto& labeled_points : labeled_points_by_class) {
+            std::vector<long> runs; // row, first column, length
+
+            for (const dlib::point& point : labeled_points.second) {
+                const size_t n = runs.size();
+                if (n > 0 && runs[n - 3] == point.y() && runs[n - 2] + runs[n - 1] == point.x()) {
+                    ++runs[n - 1];
+                }
+                else {
+                    runs.push_back(point.y());
+                    runs.push_back(point.x());
+                    runs.push_back(1);
+                }
+            }
+
+            dlib::serialize(labeled_points.first, out);
+            dlib::serialize(runs, out);
+        }
+    }
+
+    void deserialize_labeled_points(std::unordered_map<uint16_t, std::deque<dlib::point>>& labeled_points_by_class, std::istream& in)
+    {
+        labeled_points_by_class.clear();
+
+        uint64_t class_count = 0;
+        dlib::deserialize(class_count, in);
+
+        std::vector<long> runs;
+
+        for (uint64_t i = 0; i < class_count; ++i) {
+            uint16_t label = 0;
+            dlib::deserialize(label, in);
+            dlib::deserialize(runs, in);
+
+            if (runs.size() % 3 != 0) {
+                throw dlib::serialization_error("Invalid labeled point runs");
+            }
+
+            std::deque<dlib::point>& points = labeled_points_by_class[label];
+
+            for (size_t j = 0; j < runs.size(); j += 3) {
+                const long y = runs[j];
+                for (long x = runs[j + 1], end = runs[j + 1] + runs[j + 2]; x < end; ++x) {
+                    points.push_back(dlib::point(x, y));
+                }
+            }
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------
+
+shard_record compress_sample(const sample& sample, int compression_level)
+{
+    std::ostringstream payload;
+    dlib::serialize(sample.image_filenames.image_filename, payload);
+    dlib::serialize(sample.image_filenames.label_filename, payload);
+    dlib::serialize(sample.original_width, payload);
+    dlib::serialize(sample.original_height, payload);
+    serialize_pixels(sample.input_image, payload);
+    serialize_pixels(sample.label_image, payload);
+    serialize_labeled_points(sample.labeled_points_by_class, payload);
+
+    const std::string uncompressed = payload.str();
+
+    shard_record record;
+    record.uncompressed_size = uncompressed.size();
+
+    uLongf compressed_size = compressBound(static_cast<uLong>(uncompressed.size()));
+    record.compressed.resize(compressed_size);
+
+    const int result = compress2(
+        reinterpret_cast<Bytef*>(record.compressed.data()), &compressed_size,
+        reinterpret_cast<const Bytef*>(uncompressed.data()), static_cast<uLong>(uncompressed.size()),
+        compression_level);
+
+    if (result != Z_OK) {
+        throw std::runtime_error("Unable to compress " + sample.image_filenames.image_filename);
+    }
+
+    record.compressed.resize(compressed_size);
+
+    return record;
+}
+
+sample decompress_sample(const shard_record& record)
+{
+    sample sample;
+
+    if (!record.error.empty()) {
+        sample.error = record.error;
+        return sample;
+    }
+
+    try {
+        std::string uncompressed(record.uncompressed_size, '\0');
+        uLongf uncompressed_size = static_cast<uLongf>(record.uncompressed_size);
+
+        const int result = uncompress(
+            reinterpret_cast<Bytef*>(&uncompressed[0]), &uncompressed_size,
+            reinterpret_cast<const Bytef*>(record.compressed.data()), static_cast<uLong>(record.compressed.size()));
+
+        if (result != Z_OK || uncompressed_size != record.uncompressed_size) {
+            throw std::runtime_error("Unable to decompress a shard record");
+        }
+
+        std::istringstream payload(uncompressed);
+        dlib::deserialize(sample.image_filenames.image_filename, payload);
+        dlib::deserialize(sample.image_filenames.label_filename, payload);
+        dlib::deserialize(sample.original_width, payload);
+        dlib::deserialize(sample.original_height, payload);
+        deserialize_pixels(sample.input_image, payload);
+        deserialize_pixels(sample.label_image, payload);
+        deserialize_labeled_points(sample.labeled_points_by_class, payload);
+    }
+    catch (std::exception& e) {
+        sample.error = e.what();
+    }
+
+    return sample;
+}
+
+// ----------------------------------------------------------------------------------------
+
+shard_writer::shard_writer(const std::string& filename, const shard_header& header)
+    : filename(filename)
+    , out(filename, std::ios::binary)
+{
+    dlib::serialize(shard_magic, out);
+    dlib::serialize(shard_version, out);
+    dlib::serialize(header.anno_classes_json, out);
+    dlib::serialize(header.downscaling_factor, out);
+
+    if (!out) {
+        throw std::runtime_error("Unable to write " + filename);
+    }
+}
+
+void shard_writer::write(const shard_record& record)
+{
+    dlib::serialize(record.uncompressed_size, out);
+    dlib::serialize(record.compressed, out);
+
+    if (!out) {
+        throw std::runtime_error("Unable to write " + filename);
+    }
+}
+
+uint64_t shard_writer::get_bytes_written()
+{
+    return static_cast<uint64_t>(out.tellp());
+}
+
+shard_reader::shard_reader(const std::string& filename)
+    : filename(filename)
+    , in(filename, std::ios::binary)
+{
+    if (!in) {
+        throw std::runtime_error("Unable to open " + filename);
+    }
+
+    std::string magic;
+    int version = 0;
+
+    try {
+        dlib::deserialize(magic, in);
+        dlib::deserialize(version, in);
+    }
+    catch (dlib::serialization_error&) {
+        throw std::runtime_error(filename + " is not a shard file");
+    }
+
+    if (magic != shard_magic) {
+        throw std::runtime_error(filename + " is not a shard file");
+    }
+    if (version != shard_version) {
+        std::ostringstream error;
+        error << "Unsupported shard version " << version << " in " << filename;
+        throw std::runtime_error(error.str());
+    }
+
+    dlib::deserialize(header.anno_classes_json, in);
+    dlib::deserialize(header.downscaling_factor, in);
+}
+
+bool shard_reader::read(shard_record& record)
+{
+    if (in.peek() == std::char_traits<char>::eof()) {
+        return false;
+    }
+
+    record.error.clear();
+    dlib::deserialize(record.uncompressed_size, in);
+    dlib::deserialize(record.compressed, in);
+    return true;
+}
+
+std::vector<std::string> find_shard_files(const std::vector<std::string>& paths)
+{
+    std::vector<std::string> shard_files;
+
+    for (const std::string& path : paths) {
+        try {
+            const std::vector<dlib::file> files = dlib::get_files_in_directory_tree(dlib::directory(path), dlib::match_ending(".annoshard"));
+            for (const dlib::file& file : files) {
+                shard_files.push_back(file.full_name());
+            }
+        }
+        catch (dlib::directory::dir_not_found&) {
+            shard_files.push_back(path); // not a directory, so supposedly a shard file
+        }
+    }
+
+    std::sort(shard_files.begin(), shard_files.end());
+
+    return shard_files;
+}
+
+shard_header read_common_shard_header(const std::vector<std::string>& shard_files)
+{
+    if (shard_files.empty()) {
+        throw std::runtime_error("No shard files found");
+    }
+
+    const shard_header header = shard_reader(shard_files.front()).get_header();
+
+    for (size_t i = 1; i < shard_files.size(); ++i) {
+        const shard_header other = shard_reader(shard_files[i]).get_header();
+        if (other.anno_classes_json != header.anno_classes_json) {
+            throw std::runtime_error("The anno classes of " + shard_files[i] + " differ from those of " + shard_files.front());
+        }
+        if (other.downscaling_factor != header.downscaling_factor) {
+            throw std::runtime_error("The downscaling factor of " + shard_files[i] + " differs from that of " + shard_files.front());
+        }
+    }
+
+    return header;
+}
+
+// ----------------------------------------------------------------------------------------
+
+shuffled_shard_samples::shuffled_shard_samples(
+    const std::vector<std::string>& shard_files,
+    size_t buffer_size,
+    size_t uses_per_sample,
+    const std::function<void(sample&)>& prepare_sample
+)
+    : shard_files(shard_files)
+    , buffer_size(std::max(static_cast<size_t>(1), buffer_size))
+    , uses_per_sample(std::max(static_cast<size_t>(1), uses_per_sample))
+    , prepare_sample(prepare_sample)
+    , records(16)
+    , read_count(0)
+{
+    if (shard_files.empty()) {
+        throw std::runtime_error("No shard files given");
+    }
+
+    slots.reserve(this->buffer_size);
+
+    reader = std::thread([this]() { read_shards(); });
+}
+
+shuffled_shard_samples::~shuffled_shard_samples()
+{
+    records.disable();
+    reader.join();
+}
+
+void shuffled_shard_samples::read_shards()
+{
+    dlib::rand rnd(time(0));
+
+    std::vector<std::string> shard_order = shard_files;
+
+    while (records.is_enabled()) {
+        for (size_t i = shard_order.size() - 1; i > 0; --i) {
+            std::swap(shard_order[i], shard_order[rnd.get_random_32bit_number() % (i + 1)]);
+        }
+
+        size_t records_in_pass = 0;
+
+        for (const std::string& shard_file : shard_order) {
+            shard_record record;
+            try {
+                shard_reader shard(shard_file);
+                while (shard.read(record)) {
+                    records.enqueue(record);
+                    ++records_in_pass;
+                    if (!records.is_enabled()) {
+                        return;
+                    }
+                }
+            }
+            catch (std::exception& e) {
+                record.error = shard_file + ": " + e.what();
+                records.enqueue(record);
+                ++records_in_pass;
+            }
+
+            if (!records.is_enabled()) {
+                return;
+            }
+        }
+
+        if (records_in_pass == 0) {
+            shard_record record;
+            record.error = "No samples in the shard files";
+            records.enqueue(record);
+        }
+    }
+}
+
+std::shared_ptr<sample> shuffled_shard_samples::next_sample()
+{
+    std::shared_ptr<sample> result(new sample);
+
+    shard_record record;
+    if (!records.dequeue(record)) {
+        result->error = "The shard reader has been stopped";
+        return result;
+    }
+
+    *result = decompress_sample(record);
+    ++read_count;
+
+    if (result->error.empty()) {
+        prepare_sample(*result);
+    }
+
+    return result;
+}
+
+std::shared_ptr<sample> shuffled_shard_samples::get(dlib::rand& rnd)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    if (slots.size() + slots_being_filled < buffer_size) {
+        // Still filling up the buffer: use the new sample right away
+        ++slots_being_filled;
+        lock.unlock();
+        const std::shared_ptr<sample> new_sample = next_sample();
+        lock.lock();
+        --slots_being_filled;
+
+        slot new_slot;
+        new_slot.content = new_sample;
+        new_slot.use_count = 1;
+        slots.push_back(new_slot);
+        slot_filled.notify_all();
+        return new_sample;
+    }
+
+    slot_filled.wait(lock, [this]() { return !slots.empty(); });
+
+    const size_t index = rnd.get_random_32bit_number() % slots.size();
+    const std::shared_ptr<sample> result = slots[index].content;
+
+    if (++slots[index].use_count >= uses_per_sample && !slots[index].being_replaced) {
+        // Other threads keep using the old sample until the replacement is ready
+        slots[index].being_replaced = true;
+        lock.unlock();
+        const std::shared_ptr<sample> replacement = next_sample();
+        lock.lock();
+        slots[index].content = replacement;
+        slots[index].use_count = 0;
+        slots[index].being_replaced = false;
+    }
+
+    return result;
+}
@@ -0,0 +1,142 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+
+    Shards are large files of already decoded (and downscaled) samples, written by
+    the annonet_pack program. They are read strictly sequentially, which is much
+    faster than random access to many small image files on network storage.
+    Each sample is compressed separately, so that the training data loaders can
+    decompress them in parallel.
+*/
+
+#ifndef ANNONET_SHARDS_H
+#define ANNONET_SHARDS_H
+
+#include "annonet.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// ----------------------------------------------------------------------------------------
+
+struct shard_header
+{
+    std::string anno_classes_json;
+    double downscaling_factor = 1.0;
+};
+
+// One compressed sample, as stored in a shard
+struct shard_record
+{
+    uint64_t uncompressed_size = 0;
+    std::vector<char> compressed;
+    std::string error;
+};
+
+shard_record compress_sample(const sample& sample, int compression_level);
+
+sample decompress_sample(const shard_record& record);
+
+// ----------------------------------------------------------------------------------------
+
+class shard_writer
+{
+public:
+    shard_writer(const std::string& filename, const shard_header& header);
+
+    void write(const shard_record& record);
+
+    uint64_t get_bytes_written();
+
+private:
+    const std::string filename;
+    std::ofstream out;
+};
+
+class shard_reader
+{
+public:
+    shard_reader(const std::string& filename);
+
+    const shard_header& get_header() const { return header; }
+
+    // Returns false at the end of the shard
+    bool read(shard_record& record);
+
+private:
+    const std::string filename;
+    std::ifstream in;
+    shard_header header;
+};
+
+// Expands directories to the shard files (*.annoshard) in them
+std::vector<std::string> find_shard_files(const std::vector<std::string>& paths);
+
+// Throws if the shards do not share the same anno classes and downscaling factor
+shard_header read_common_shard_header(const std::vector<std::string>& shard_files);
+
+// ----------------------------------------------------------------------------------------
+
+// Streams the samples of the shards endlessly, in a random shard order on each pass,
+// and hands them out through a shuffle buffer: each sample stays in the buffer until
+// it has been used uses_per_sample times, and is then replaced by the next sample of
+// the stream. The samples are decompressed by the calling threads.
+class shuffled_shard_samples
+{
+public:
+    shuffled_shard_samples(
+        const std::vector<std::string>& shard_files,
+        size_t buffer_size,
+        size_t uses_per_sample,
+        const std::function<void(sample&)>& prepare_sample
+    );
+
+    ~shuffled_shard_samples();
+
+    std::shared_ptr<sample> get(dlib::rand& rnd);
+
+    // The number of samples decompressed so far
+    size_t get_read_count() const { return read_count; }
+
+private:
+    void read_shards();
+
+    std::shared_ptr<sample> next_sample();
+
+    const std::vector<std::string> shard_files;
+    const size_t buffer_size;
+    const size_t uses_per_sample;
+    const std::function<void(sample&)> prepare_sample;
+
+    struct slot
+    {
+        std::shared_ptr<sample> content;
+        size_t use_count = 0;
+        bool being_replaced = false;
+    };
+
+    std::mutex mutex;
+    std::condition_variable slot_filled;
+    std::vector<slot> slots;
+    size_t slots_being_filled = 0;
+
+    dlib::pipe<shard_record> records;
+    std::atomic<size_t> read_count;
+    std::thread reader;
+};
+
+#endif // ANNONET_SHARDS_H
@@ -0,0 +1,68 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+*/
+
+#include "annonet_stub_net.h"
+
+annonet_stub_net::annonet_stub_net(uint16_t class_count, double threshold)
+    : class_count(class_count)
+    , threshold(threshold)
+{
+    DLIB_CASSERT(class_count >= 1);
+}
+
+dlib::matrix<uint16_t> annonet_stub_net::operator() (const NetPimpl::input_type& input_image, const std::vector<double>& gains)
+{
+    const long nr = input_image.nr();
+    const long nc = input_image.nc();
+
+    output.set_size(1, class_count, nr, nc);
+
+    float* const out_data = output.host_write_only();
+    const long plane_size = nr * nc;
+
+    dlib::matrix<uint16_t> result(nr, nc);
+
+    for (long r = 0; r < nr; ++r) {
+        for (long c = 0; c < nc; ++c) {
+            // Synthetic logits: class 0 wins up to the threshold (ties go to the lower
+            // class index), class 1 above it, and the other classes trail behind class 1
+            // in order
+            const double level = dlib::get_pixel_intensity(input_image(r, c));
+            const float distance = static_cast<float>((level - threshold) / 32.0);
+
+            uint16_t label = 0;
+            double max_value = -std::numeric_limits<double>::infinity();
+
+            for (uint16_t k = 0; k < class_count; ++k) {
+                const float logit = k == 0 ? -distance : distance - (k - 1);
+                out_data[k * plane_size + r * nc + c] = logit;
+                const double value = logit + (k < gains.size() ? gains[k] : 0.0);
+                if (value > max_value) {
+                    max_value = value;
+                    label = k;
+                }
+            }
+
+            result(r, c) = label;
+        }
+    }
+
+    return result;
+}
+
+const dlib::tensor& annonet_stub_net::GetOutput() const
+{
+    return output;
+}
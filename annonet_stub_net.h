@@ -0,0 +1,45 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+
+    The stub net is a stand-in for NetPimpl::RuntimeNet that does no convolutions
+    at all. It is used to measure the overhead of everything around the net:
+    reading, tiling, stitching, post-processing and writing.
+*/
+
+#ifndef ANNONET_STUB_NET_H
+#define ANNONET_STUB_NET_H
+
+#include "dlib-dnn-pimpl-wrapper/NetPimpl.h"
+
+class annonet_stub_net
+{
+public:
+    // Pixels brighter than the threshold are labeled as class 1 (when there is
+    // one), and all the other pixels - including those exactly at the threshold -
+    // as class 0.
+    annonet_stub_net(uint16_t class_count, double threshold = 128.0);
+
+    // Same contract as NetPimpl::RuntimeNet: returns the labels, and makes the
+    // (synthetic) logits available through GetOutput()
+    dlib::matrix<uint16_t> operator() (const NetPimpl::input_type& input_image, const std::vector<double>& gains = std::vector<double>());
+
+    const dlib::tensor& GetOutput() const;
+
+private:
+    const uint16_t class_count;
+    const double threshold;
+    dlib::resizable_tensor output;
+};
+
+#endif // ANNONET_STUB_NET_H
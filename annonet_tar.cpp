@@ -0,0 +1,450 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+*/
+
+#include "annonet_tar.h"
+
+#include <dlib/serialize.h>
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+namespace {
+    const size_t tar_block_size = 512;
+    const std::string tar_index_magic = "annotarindex";
+    const int tar_index_version = 2;
+
+    void get_size_and_modification_time(const std::string& filename, uint64_t& size, int64_t& modification_time)
+    {
+#ifdef _WIN32
+        struct _stat64 status;
+        if (_stat64(filename.c_str(), &status) != 0) {
+            throw std::runtime_error("Unable to get the status of " + filename);
+        }
+#else // _WIN32
+        struct stat status;
+        if (stat(filename.c_str(), &status) != 0) {
+            throw std::runtime_error("Unable to get the status of " + filename);
+        }
+#endif // _WIN32
+        size = static_cast<uint64_t>(status.st_size);
+        modification_time = static_cast<int64_t>(status.st_mtime);
+    }
+
+    // Numeric header fields are octal text, or base-256 for very large values
+    uint64_t parse_tar_number(const char* field, size_t field_size)
+    {
+        const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(field);
+
+        uint64_t value = 0;
+
+        if (bytes[0] & 0x80) {
+            for (size_t i = 1; i < field_size; ++i) {
+                value = (value << 8) | bytes[i];
+            }
+            return value;
+        }
+
+        for (size_t i = 0; i < field_size && bytes[i] != '\0'; ++i) {
+            if (bytes[i] >= '0' && bytes[i] <= '7') {
+                value = value * 8 + (bytes[i] - '0');
+            }
+            else if (bytes[i] != ' ') {
+                break;
+            }
+        }
+
+        return value;
+    }
+
+    std::string parse_tar_string(const char* field, size_t field_size)
+    {
+        return std::string(field, std::find(field, field + field_size, '\0'));
+    }
+
+    std::string normalize_member_name(std::string name)
+    {
+        while (name.compare(0, 2, "./") == 0) {
+            name.erase(0, 2);
+        }
+        return name;
+    }
+
+    // Finds the path of a PAX extended header, if there is one
+    std::string parse_pax_path(const char* data, size_t size, const std::string& archive_filename)
+    {
+        std::string path;
+        size_t position = 0;
+        while (position < size) {
+            // each record is: "<length> <key>=<value>\n", where the length covers the whole record
+            const char* const record = data + position;
+            const size_t remaining = size - position;
+            size_t length = 0;
+            size_t i = 0;
+            while (i < remaining && record[i] >= '0' && record[i] <= '9' && length <= remaining) {
+                length = length * 10 + (record[i] - '0');
+                ++i;
+            }
+            if (i == 0 || length > remaining || length < i + 2 || record[i] != ' ' || record[length - 1] != '\n') {
+                throw std::runtime_error("Malformed pax header in " + archive_filename);
+            }
+            const std::string content(record + i + 1, record + length - 1);
+            if (content.compare(0, 5, "path=") == 0) {
+                path = content.substr(5);
+            }
+            position += length;
+        }
+        return path;
+    }
+
+    bool is_regular_file(const std::string& path)
+    {
+#ifdef _WIN32
+        struct _stat64 status;
+        return _stat64(path.c_str(), &status) == 0 && (status.st_mode & _S_IFREG) != 0;
+#else // _WIN32
+        struct stat status;
+        return stat(path.c_str(), &status) == 0 && S_ISREG(status.st_mode);
+#endif // _WIN32
+    }
+}
+
+// ----------------------------------------------------------------------------------------
+
+tar_archive::tar_archive(const std::string& filename)
+    : file(filename)
+{
+    get_size_and_modification_time(filename, archive_size, archive_modification_time);
+
+    const std::string index_filename = filename + ".annoindex";
+
+    if (!load_index(index_filename, archive_size, archive_modification_time)) {
+        build_index();
+        save_index(index_filename, archive_size, archive_modification_time);
+    }
+}
+
+bool tar_archive::is_up_to_date() const
+{
+    uint64_t size = 0;
+    int64_t modification_time = 0;
+    get_size_and_modification_time(get_filename(), size, modification_time);
+    return size == archive_size && modification_time == archive_modification_time;
+}
+
+bool tar_archive::contains(const std::string& member_name) const
+{
+    return members.find(member_name) != members.end();
+}
+
+std::pair<const char*, size_t> tar_archive::get_member_data(const std::string& member_name) const
+{
+    const auto i = members.find(member_name);
+    if (i == members.end()) {
+        throw std::runtime_error("No " + member_name + " in " + get_filename());
+    }
+    return std::make_pair(file.data() + i->second.offset, static_cast<size_t>(i->second.size));
+}
+
+void tar_archive::get_member_stamp(const std::string& member_name, uint64_t& offset, uint64_t& size, int64_t& modification_time) const
+{
+    const auto i = members.find(member_name);
+    if (i == members.end()) {
+        throw std::runtime_error("No " + member_name + " in " + get_filename());
+    }
+    offset = i->second.offset;
+    size = i->second.size;
+    modification_time = i->second.modification_time;
+}
+
+bool tar_archive::load_index(const std::string& index_filename, uint64_t archive_size, int64_t archive_modification_time)
+{
+    std::ifstream in(index_filename, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+
+    try {
+        std::string magic;
+        int version = 0;
+        uint64_t indexed_archive_size = 0;
+        int64_t indexed_archive_modification_time = 0;
+        std::vector<uint64_t> offsets, sizes;
+        std::vector<int64_t> modification_times;
+
+        dlib::deserialize(magic, in);
+        dlib::deserialize(version, in);
+        if (magic != tar_index_magic || version != tar_index_version) {
+            return false;
+        }
+
+        dlib::deserialize(indexed_archive_size, in);
+        dlib::deserialize(indexed_archive_modification_time, in);
+        if (indexed_archive_size != archive_size || indexed_archive_modification_time != archive_modification_time) {
+            return false; // stale
+        }
+
+        dlib::deserialize(member_names, in);
+        dlib::deserialize(offsets, in);
+        dlib::deserialize(sizes, in);
+        dlib::deserialize(modification_times, in);
+
+        if (offsets.size() != member_names.size() || sizes.size() != member_names.size() || modification_times.size() != member_names.size()) {
+            return false;
+        }
+
+        members.clear();
+        for (size_t i = 0; i < member_names.size(); ++i) {
+            if (offsets[i] + sizes[i] > file.size()) {
+                return false;
+            }
+            member& m = members[member_names[i]];
+            m.offset = offsets[i];
+            m.size = sizes[i];
+            m.modification_time = modification_times[i];
+        }
+
+        return true;
+    }
+    catch (dlib::serialization_error&) {
+        member_names.clear();
+        members.clear();
+        return false;
+    }
+}
+
+void tar_archive::build_index()
+{
+    std::cout << "Indexing " << get_filename() << "..." << std::endl;
+
+    member_names.clear();
+    members.clear();
+
+    const char* const data = file.data();
+    const uint64_t size = file.size();
+
+    std::string long_name; // from a preceding GNU or PAX header
+
+    uint64_t position = 0;
+
+    while (position + tar_block_size <= size) {
+        const char* const header = data + position;
+
+        if (std::all_of(header, header + tar_block_size, [](char c) { return c == '\0'; })) {
+            break; // end of archive
+        }
+
+        const uint64_t member_size = parse_tar_number(header + 124, 12);
+        const char type = header[156];
+        const uint64_t member_offset = position + tar_block_size;
+
+        if (member_offset + member_size > size) {
+            throw std::runtime_error(get_filename() + " is truncated");
+        }
+
+        if (type == 'L') {
+            long_name = parse_tar_string(data + member_offset, static_cast<size_t>(member_size));
+        }
+        else if (type == 'x') {
+            long_name = parse_pax_path(data + member_offset, static_cast<size_t>(member_size), get_filename());
+        }
+        else {
+            if (type == '0' || type == '\0' || type == '7') {
+                std::string name = long_name;
+                if (name.empty()) {
+                    name = parse_tar_string(header, 100);
+                    if (std::memcmp(header + 257, "ustar", 5) == 0) {
+                        const std::string prefix = parse_tar_string(header + 345, 155);
+                        if (!prefix.empty()) {
+                            name = prefix + "/" + name;
+                        }
+                    }
+                }
+                name = normalize_member_name(name);
+
+                if (members.find(name) == members.end()) {
+                    member_names.push_back(name);
+                }
+                member& m = members[name]; // a later copy replaces an earlier one, like in tar itself
+                m.offset = member_offset;
+                m.size = member_size;
+                m.modification_time = static_cast<int64_t>(parse_tar_number(header + 136, 12));
+            }
+            long_name.clear();
+        }
+
+        position = member_offset + (member_size + tar_block_size - 1) / tar_block_size * tar_block_size;
+    }
+
+    std::cout << "Indexed " << member_names.size() << " files" << std::endl;
+}
+
+void tar_archive::save_index(const std::string& index_filename, uint64_t archive_size, int64_t archive_modification_time) const
+{
+    std::vector<uint64_t> offsets, sizes;
+    std::vector<int64_t> modification_times;
+    offsets.reserve(member_names.size());
+    sizes.reserve(member_names.size());
+    modification_times.reserve(member_names.size());
+    for (const std::string& member_name : member_names) {
+        const member& m = members.find(member_name)->second;
+        offsets.push_back(m.offset);
+        sizes.push_back(m.size);
+        modification_times.push_back(m.modification_time);
+    }
+
+    // Write to a temporary file first, so that concurrent readers never see a partial index
+    const std::string temporary_filename = index_filename + ".tmp";
+
+    {
+        std::ofstream out(temporary_filename, std::ios::binary);
+        dlib::serialize(tar_index_magic, out);
+        dlib::serialize(tar_index_version, out);
+        dlib::serialize(archive_size, out);
+        dlib::serialize(archive_modification_time, out);
+        dlib::serialize(member_names, out);
+        dlib::serialize(offsets, out);
+        dlib::serialize(sizes, out);
+        dlib::serialize(modification_times, out);
+
+        if (!out) {
+            // not fatal: the archive may well be on a read-only share
+            std::cerr << "Warning: unable to cache the index of " << get_filename() << std::endl;
+            out.close();
+            std::remove(temporary_filename.c_str());
+            return;
+        }
+    }
+
+    std::remove(index_filename.c_str());
+    std::rename(temporary_filename.c_str(), index_filename.c_str());
+}
+
+// ----------------------------------------------------------------------------------------
+
+void get_file_stamp(const std::string& path, uint64_t& size, int64_t& modification_time)
+{
+    uint64_t offset = 0;
+    get_file_stamp(path, offset, size, modification_time);
+}
+
+void get_file_stamp(const std::string& path, uint64_t& offset, uint64_t& size, int64_t& modification_time)
+{
+    std::string archive_filename, member_name;
+    if (split_tar_path(path, archive_filename, member_name)) {
+        get_tar_archive(archive_filename)->get_member_stamp(member_name, offset, size, modification_time);
+    }
+    else {
+        offset = 0;
+        get_size_and_modification_time(path, size, modification_time);
+    }
+}
+
+namespace {
+    // Beyond this many open archives, the least recently used one is let go of; it stays
+    // mapped until its last reader is done with it
+    const size_t max_open_tar_archive_count = 16;
+
+    struct open_tar_archive
+    {
+        std::shared_ptr<const tar_archive> archive;
+        std::list<std::string>::iterator recency;
+    };
+
+    std::mutex tar_archives_mutex;
+    std::list<std::string> tar_archive_recency; // most recently used first
+    std::unordered_map<std::string, open_tar_archive> tar_archives;
+
+    // The mutex has to be locked
+    void set_open_tar_archive(const std::string& filename, const std::shared_ptr<const tar_archive>& archive)
+    {
+        const auto i = tar_archives.find(filename);
+        if (i != tar_archives.end()) {
+            i->second.archive = archive;
+            tar_archive_recency.splice(tar_archive_recency.begin(), tar_archive_recency, i->second.recency);
+            return;
+        }
+
+        tar_archive_recency.push_front(filename);
+        open_tar_archive& opened = tar_archives[filename];
+        opened.archive = archive;
+        opened.recency = tar_archive_recency.begin();
+
+        while (tar_archives.size() > max_open_tar_archive_count) {
+            tar_archives.erase(tar_archive_recency.back());
+            tar_archive_recency.pop_back();
+        }
+    }
+}
+
+std::shared_ptr<const tar_archive> get_tar_archive(const std::string& filename)
+{
+    std::lock_guard<std::mutex> lock(tar_archives_mutex);
+
+    const auto i = tar_archives.find(filename);
+    if (i != tar_archives.end()) {
+        tar_archive_recency.splice(tar_archive_recency.begin(), tar_archive_recency, i->second.recency);
+        return i->second.archive;
+    }
+
+    const std::shared_ptr<const tar_archive> archive = std::make_shared<tar_archive>(filename);
+    set_open_tar_archive(filename, archive);
+    return archive;
+}
+
+void reload_tar_archive_if_changed(const std::string& filename)
+{
+    const std::shared_ptr<const tar_archive> archive = get_tar_archive(filename);
+    if (archive->is_up_to_date()) {
+        return;
+    }
+
+    // Index the new archive without holding the lock, as that may take a while
+    const std::shared_ptr<const tar_archive> reloaded = std::make_shared<tar_archive>(filename);
+
+    std::lock_guard<std::mutex> lock(tar_archives_mutex);
+    set_open_tar_archive(filename, reloaded);
+}
+
+bool is_tar_archive(const std::string& path)
+{
+    const std::string extension = ".tar";
+    if (path.size() < extension.size()) {
+        return false;
+    }
+    std::string ending = path.substr(path.size() - extension.size());
+    std::transform(ending.begin(), ending.end(), ending.begin(), ::tolower);
+    // a directory may be named like an archive, too
+    return ending == extension && is_regular_file(path);
+}
+
+bool split_tar_path(const std::string& path, std::string& archive_filename, std::string& member_name)
+{
+    for (size_t separator = path.find_first_of("/\\"); separator != std::string::npos; separator = path.find_first_of("/\\", separator + 1)) {
+        const std::string candidate = path.substr(0, separator);
+        if (is_tar_archive(candidate)) {
+            archive_filename = candidate;
+            member_name = path.substr(separator + 1);
+            return true;
+        }
+    }
+    return false;
+}
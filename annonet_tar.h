@@ -0,0 +1,98 @@
+/*
+    This example shows how to train a semantic segmentation net using images
+    annotated in the "anno" program (see https://github.com/reunanen/anno).
+
+    Instructions:
+    1. Use anno to label some data.
+    2. Build the annonet_train program.
+    3. Run:
+       ./annonet_train /path/to/anno/data
+    4. Wait while the network is being trained.
+    5. Build the annonet_infer example program.
+    6. Run:
+       ./annonet_infer /path/to/anno/data
+
+    Uncompressed tar archives can be used in place of directories, without
+    extracting them. A file inside an archive is referred to as
+    /path/to/archive.tar/path/inside/archive.png. The offsets of the member
+    files are indexed on first use, and the index is cached next to the archive
+    (archive.tar.annoindex).
+*/
+
+#ifndef ANNONET_TAR_H
+#define ANNONET_TAR_H
+
+#include "annonet_mmap.h"
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// ----------------------------------------------------------------------------------------
+
+class tar_archive
+{
+public:
+    // Loads the cached index if it is up to date, and builds (and caches) it otherwise
+    tar_archive(const std::string& filename);
+
+    const std::string& get_filename() const { return file.get_filename(); }
+
+    // In archive order
+    const std::vector<std::string>& get_member_names() const { return member_names; }
+
+    bool contains(const std::string& member_name) const;
+
+    // Points into the memory-mapped archive; throws if there is no such member
+    std::pair<const char*, size_t> get_member_data(const std::string& member_name) const;
+
+    // From the member's own header: its data offset in the archive, its size, and its
+    // modification time; throws if there is no such member
+    void get_member_stamp(const std::string& member_name, uint64_t& offset, uint64_t& size, int64_t& modification_time) const;
+
+    // False if the archive file has been replaced or modified since it was opened
+    bool is_up_to_date() const;
+
+private:
+    struct member
+    {
+        uint64_t offset = 0;
+        uint64_t size = 0;
+        int64_t modification_time = 0;
+    };
+
+    bool load_index(const std::string& index_filename, uint64_t archive_size, int64_t archive_modification_time);
+    void build_index();
+    void save_index(const std::string& index_filename, uint64_t archive_size, int64_t archive_modification_time) const;
+
+    const memory_mapped_file file;
+    uint64_t archive_size = 0;
+    int64_t archive_modification_time = 0;
+    std::vector<std::string> member_names;
+    std::unordered_map<std::string, member> members;
+};
+
+// Each archive is opened only once, and then shared by all the threads; only the most
+// recently used archives are kept open, so the others get unmapped once nobody uses them
+std::shared_ptr<const tar_archive> get_tar_archive(const std::string& filename);
+
+// Opens the archive again if it has changed; readers holding on to the old one can keep
+// using it
+void reload_tar_archive_if_changed(const std::string& filename);
+
+// True for an existing regular file named *.tar
+bool is_tar_archive(const std::string& path);
+
+// Splits /path/to/archive.tar/member into its parts; returns false for ordinary paths
+bool split_tar_path(const std::string& path, std::string& archive_filename, std::string& member_name);
+
+// For checking whether a file has changed; a member of an archive is stamped by its own
+// header, so that rewriting the archive does not make every member look changed
+void get_file_stamp(const std::string& path, uint64_t& size, int64_t& modification_time);
+
+// As above, plus the offset of a member in its archive (zero for ordinary files), so
+// that a member replaced by a later copy of the same size and time is noticed as well
+void get_file_stamp(const std::string& path, uint64_t& offset, uint64_t& size, int64_t& modification_time);
+
+#endif // ANNONET_TAR_H
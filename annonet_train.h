@@ -14,8 +14,10 @@
 */
 
 #include "dlib-dnn-pimpl-wrapper/NetPimpl.h"
-#include <unordered_map>
+#include <algorithm>
+#include <cmath>
 #include <numeric>
+#include <vector>
 
 void set_weights (
     const dlib::matrix<uint16_t>& unweighted_label_image,
@@ -27,36 +29,44 @@ void set_weights (
     const long nr = unweighted_label_image.nr();
     const long nc = unweighted_label_image.nc();
 
-    std::unordered_map<uint16_t, size_t> label_counts;
+    // Labels are small dense integers, so plain vectors indexed by label are used
+    // instead of hash maps; this is in the inner loop of every training crop
+    std::vector<size_t> label_counts;
 
     for (int r = 0; r < nr; ++r) {
         for (int c = 0; c < nc; ++c) {
             const uint16_t label = unweighted_label_image(r, c);
             if (label != dlib::loss_multiclass_log_per_pixel_::label_to_ignore) {
+                if (label >= label_counts.size()) {
+                    label_counts.resize(label + 1);
+                }
                 ++label_counts[label];
             }
         }
     }
 
-    const size_t total_count = std::accumulate(label_counts.begin(), label_counts.end(), 0,
-        [&](size_t total, const std::pair<uint16_t, size_t>& item) { return total + item.second; });
+    const size_t total_count = std::accumulate(label_counts.begin(), label_counts.end(), static_cast<size_t>(0));
+    const size_t present_label_count = label_counts.size() - std::count(label_counts.begin(), label_counts.end(), 0);
 
-    std::unordered_map<uint16_t, double> label_weights;
+    std::vector<double> label_weights(label_counts.size(), 0.0);
 
     if (total_count > 0) {
-        const double average_count = total_count / static_cast<double>(label_counts.size());
+        const double average_count = total_count / static_cast<double>(present_label_count);
 
         double total_unnormalized_weight = 0.0;
-        for (const auto& item : label_counts) {
-            const double unnormalized_label_weight = pow(average_count / item.second, class_weight);
-            label_weights[item.first] = unnormalized_label_weight;
-            total_unnormalized_weight += item.second * unnormalized_label_weight;
+        for (size_t label = 0; label < label_counts.size(); ++label) {
+            const size_t count = label_counts[label];
+            if (count > 0) {
+                const double unnormalized_label_weight = pow(average_count / count, class_weight);
+                label_weights[label] = unnormalized_label_weight;
+                total_unnormalized_weight += count * unnormalized_label_weight;
+            }
         }
 
         // normalize label weights
         const double target_total_weight = total_count * pow(nr * nc / static_cast<double>(total_count), image_weight);
-        for (auto& item : label_weights) {
-            item.second *= target_total_weight / total_unnormalized_weight;
+        for (double& label_weight : label_weights) {
+            label_weight *= target_total_weight / total_unnormalized_weight;
         }
     }
 
@@ -71,6 +81,101 @@ void set_weights (
     }
 }
 
+// Computes the label weights once, from the pixel counts of the whole dataset (indexed by
+// label), instead of from each crop; normalized so that the average labeled pixel of the
+// dataset has a weight of 1
+std::vector<double> compute_global_label_weights(
+    const std::vector<uint64_t>& label_counts,
+    double class_weight // Try 0.0 for equally balanced pixels, and 1.0 for equally balanced classes
+)
+{
+    const uint64_t total_count = std::accumulate(label_counts.begin(), label_counts.end(), static_cast<uint64_t>(0));
+    const size_t present_label_count = label_counts.size() - std::count(label_counts.begin(), label_counts.end(), 0);
+
+    std::vector<double> label_weights(label_counts.size(), 0.0);
+
+    if (total_count > 0) {
+        const double average_count = total_count / static_cast<double>(present_label_count);
+
+        double total_unnormalized_weight = 0.0;
+        for (size_t label = 0; label < label_counts.size(); ++label) {
+            const uint64_t count = label_counts[label];
+            if (count > 0) {
+                label_weights[label] = pow(average_count / count, class_weight);
+                total_unnormalized_weight += count * label_weights[label];
+            }
+        }
+
+        for (double& label_weight : label_weights) {
+            label_weight *= total_count / total_unnormalized_weight;
+        }
+    }
+
+    return label_weights;
+}
+
+// Like above, but looks the label weights up instead of counting the labels of the crop.
+// The image weight still scales up the crops that have ignored pixels; labels that the
+// dataset-wide counts didn't have get a weight of 1.
+void set_weights (
+    const dlib::matrix<uint16_t>& unweighted_label_image,
+    NetPimpl::training_label_type& weighted_label_image,
+    const std::vector<double>& global_label_weights,
+    double image_weight  // Try 0.0 for equally balanced pixels, and 1.0 for equally balanced images
+)
+{
+    const long nr = unweighted_label_image.nr();
+    const long nc = unweighted_label_image.nc();
+
+    weighted_label_image.set_size(nr, nc);
+
+    long ignored_count = 0;
+
+    for (int r = 0; r < nr; ++r) {
+        for (int c = 0; c < nc; ++c) {
+            const uint16_t label = unweighted_label_image(r, c);
+            double weight = 0.0;
+            if (label == dlib::loss_multiclass_log_per_pixel_::label_to_ignore) {
+                ++ignored_count;
+            }
+            else {
+                weight = label < global_label_weights.size() && global_label_weights[label] > 0.0 ? global_label_weights[label] : 1.0;
+            }
+            weighted_label_image(r, c) = dlib::loss_multiclass_log_per_pixel_weighted_::weighted_label(label, weight);
+        }
+    }
+
+    // The second pass is needed only if something was ignored
+    if (ignored_count > 0 && ignored_count < nr * nc && image_weight != 0.0) {
+        const double image_scaler = pow(nr * nc / static_cast<double>(nr * nc - ignored_count), image_weight);
+        for (int r = 0; r < nr; ++r) {
+            for (int c = 0; c < nc; ++c) {
+                weighted_label_image(r, c).weight *= image_scaler;
+            }
+        }
+    }
+}
+
+// The number of learning rates, from the initial one, that are still at least the minimum;
+// the shrink factor has to be strictly between 0 and 1
+int get_learning_rate_stage_count(double initial_learning_rate, double learning_rate_shrink_factor, double min_learning_rate)
+{
+    if (initial_learning_rate < min_learning_rate) {
+        return 0;
+    }
+    // the epsilon keeps e.g. 0.1 * 0.1^5 from falling just below 1e-6
+    return static_cast<int>(std::floor(std::log(min_learning_rate / initial_learning_rate) / std::log(learning_rate_shrink_factor) + 1e-9)) + 1;
+}
+
+// When training for a fixed time, each learning rate gets an equal share of the time; this
+// is the highest learning rate allowed after the given fraction of the time budget
+double get_time_budgeted_learning_rate(double elapsed_fraction, double initial_learning_rate, double learning_rate_shrink_factor, double min_learning_rate)
+{
+    const int stage_count = get_learning_rate_stage_count(initial_learning_rate, learning_rate_shrink_factor, min_learning_rate);
+    const int stage = std::min(stage_count - 1, static_cast<int>(std::floor(std::max(0.0, elapsed_fraction) * stage_count)));
+    return initial_learning_rate * std::pow(learning_rate_shrink_factor, std::max(0, stage));
+}
+
 dlib::rectangle random_rect_containing_point(
     dlib::rand& rnd,
     const dlib::point& point,
@@ -14,17 +14,28 @@
 */
 
 #include "annonet.h"
+#include "annonet_class_index.h"
+#include "annonet_crops.h"
+#include "annonet_kernels.h"
+#include "annonet_loader_state.h"
+#include "annonet_rescan.h"
+#include "annonet_shards.h"
 #include "annonet_train.h"
 
-#include "cpp-read-file-in-memory/read-file-in-memory.h"
 #include "cxxopts/include/cxxopts.hpp"
 #include "lru-timday/shared_lru_cache_using_std.h"
 #include <dlib/image_transforms.h>
 #include <dlib/dir_nav.h>
+#include <dlib/threads.h>
 
+#include <algorithm>
+#include <atomic>
+#include <fstream>
 #include <iostream>
 #include <iterator>
+#include <memory>
 #include <thread>
+#include <unordered_map>
 
 using namespace std;
 using namespace dlib;
@@ -41,19 +52,14 @@ rectangle make_cropping_rect_around_defect(
 
 // ----------------------------------------------------------------------------------------
 
-namespace std {
-    template <>
-    struct hash<image_filenames> {
-        std::size_t operator()(const image_filenames& image_filenames) const {
-            return hash<string>()(image_filenames.image_filename + ", " + image_filenames.label_filename);
-        }
-    };
-
-    bool operator ==(const image_filenames& a, const image_filenames& b) {
-        return a.image_filename == b.image_filename
-            && a.label_filename == b.label_filename;
-    }
-}
+// The data loaders pick their images from the current snapshot, which the rescanner may
+// replace at any time
+struct dataset_snapshot
+{
+    std::vector<stamped_image_filenames> image_files;
+    std::shared_ptr<const dataset_class_index> class_index;
+    std::shared_ptr<const class_stratified_sampler> class_sampler;
+};
 
 // ----------------------------------------------------------------------------------------
 
@@ -67,6 +73,10 @@ struct crop
 
     std::string warning;
     std::string error;
+
+    // which crop of which loader this is, for resuming the loaders
+    size_t loader_index = 0;
+    uint64_t crop_index = 0;
 };
 
 #ifdef DLIB_DNN_PIMPL_WRAPPER_GRAYSCALE_INPUT
@@ -92,30 +102,39 @@ struct randomly_crop_image_temp {
     dlib::matrix<uint16_t> label_image;
 };
 
-void randomly_crop_image(
+// Picks a class present in the sample (unless class_to_crop is given and present), and
+// extracts a crop around a random point of that class; the result is in crop.input_image
+// and crop.temporary_unweighted_label_image
+void extract_random_crop(
     int dim,
     const sample& full_sample,
     crop& crop,
     dlib::rand& rnd,
-    const cxxopts::Options& options,
-    randomly_crop_image_temp& temp
+    double further_downscaling_factor,
+    randomly_crop_image_temp& temp,
+    int class_to_crop = -1
 )
 {
     DLIB_CASSERT(!full_sample.labeled_points_by_class.empty());
 
-    const size_t class_index = rnd.get_random_32bit_number() % full_sample.labeled_points_by_class.size();
+    auto i = class_to_crop >= 0
+        ? full_sample.labeled_points_by_class.find(static_cast<uint16_t>(class_to_crop))
+        : full_sample.labeled_points_by_class.end();
+
+    if (i == full_sample.labeled_points_by_class.end()) {
+        const size_t class_index = rnd.get_random_32bit_number() % full_sample.labeled_points_by_class.size();
 
-    auto i = full_sample.labeled_points_by_class.begin();
+        i = full_sample.labeled_points_by_class.begin();
 
-    for (size_t j = 0; j < class_index; ++i, ++j) {
-        DLIB_CASSERT(i != full_sample.labeled_points_by_class.end());
+        for (size_t j = 0; j < class_index; ++i, ++j) {
+            DLIB_CASSERT(i != full_sample.labeled_points_by_class.end());
+        }
     }
     DLIB_CASSERT(i != full_sample.labeled_points_by_class.end());
     DLIB_CASSERT(!i->second.empty());
 
     const size_t point_index = rnd.get_random_64bit_number() % i->second.size();
 
-    const double further_downscaling_factor = options["further-downscaling-factor"].as<double>();
     const int dim_before_downscaling = std::round(dim * further_downscaling_factor);
 
     const rectangle rect = random_rect_containing_point(rnd, i->second[point_index], dim_before_downscaling, dim_before_downscaling, dlib::rectangle(0, 0, full_sample.input_image.nc() - 1, full_sample.input_image.nr() - 1));
@@ -136,8 +155,23 @@ void randomly_crop_image(
         extract_image_chip(full_sample.input_image, chip_details, crop.input_image, interpolate_bilinear());
         extract_image_chip(full_sample.label_image, chip_details, crop.temporary_unweighted_label_image, interpolate_nearest_neighbor());
     }
+}
 
-    set_weights(crop.temporary_unweighted_label_image, crop.label_image, options["class-weight"].as<double>(), options["image-weight"].as<double>());
+// The cheap part: weights, flips and noise; if global_label_weights is empty, the label
+// weights are computed from the crop itself
+void augment_crop(
+    crop& crop,
+    dlib::rand& rnd,
+    const cxxopts::Options& options,
+    const std::vector<double>& global_label_weights
+)
+{
+    if (global_label_weights.empty()) {
+        set_weights(crop.temporary_unweighted_label_image, crop.label_image, options["class-weight"].as<double>(), options["image-weight"].as<double>());
+    }
+    else {
+        set_weights(crop.temporary_unweighted_label_image, crop.label_image, global_label_weights, options["image-weight"].as<double>());
+    }
 
     // Randomly flip the input image and the labels.
     const bool allow_flip_left_right = options.count("allow-flip-left-right") > 0;
@@ -165,28 +199,114 @@ void randomly_crop_image(
 #endif // DLIB_DNN_PIMPL_WRAPPER_GRAYSCALE_INPUT
 }
 
-// ----------------------------------------------------------------------------------------
+void randomly_crop_image(
+    int dim,
+    const sample& full_sample,
+    crop& crop,
+    dlib::rand& rnd,
+    const cxxopts::Options& options,
+    const std::vector<double>& global_label_weights,
+    randomly_crop_image_temp& temp,
+    int class_to_crop = -1
+)
+{
+    extract_random_crop(dim, full_sample, crop, rnd, options["further-downscaling-factor"].as<double>(), temp, class_to_crop);
+    augment_crop(crop, rnd, options, global_label_weights);
+}
 
-std::string read_anno_classes_file(const std::string& folder)
+// Identifies the net that a fine-tuning run started from
+std::string get_net_fingerprint(const std::string& serialized_net)
 {
-    const std::vector<file> files = get_files_in_directory_tree(folder,
-        [](const file& name) {
-            return name.name() == "anno_classes.json";
-        }, 0); // do not scan subdirectories - the file must be in the root
+    uint64_t hash = 14695981039346656037ull; // FNV-1a
+    for (const char c : serialized_net) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    std::ostringstream fingerprint;
+    fingerprint << std::hex << hash << "-" << std::dec << serialized_net.size();
+    return fingerprint.str();
+}
 
-    if (files.empty()) {
-        std::cout << "Warning: no anno_classes.json file found in " + folder << std::endl;
-        std::cout << " --> Using the default anno classes" << std::endl;
-        return "";
+// A training net can be restored only from a trainer state file, so fine-tuning starts
+// from a copy of the state that the original training left next to its annonet.dnn.
+// Returns false if an interrupted fine-tuning of the same net is resumed instead.
+bool copy_initial_trainer_state(const std::string& net_filename, const std::string& serialized_initial_net, const std::string& synchronization_filename)
+{
+    const std::string source_filename = synchronization_filename + ".source";
+    const std::string fingerprint = get_net_fingerprint(serialized_initial_net);
+
+    if (std::ifstream(synchronization_filename, std::ios::binary) || std::ifstream(synchronization_filename + "_", std::ios::binary)) {
+        std::string resumed_fingerprint;
+        std::ifstream(source_filename) >> resumed_fingerprint;
+        if (resumed_fingerprint != fingerprint) {
+            throw std::runtime_error(synchronization_filename + " is left over from fine-tuning some other net than " + net_filename
+                + " - remove it (and " + synchronization_filename + "_) to start over");
+        }
+        std::cout << "Resuming the fine-tuning of " << net_filename << std::endl;
+        return false;
     }
 
-    if (files.size() > 1) {
-        throw std::runtime_error("Found multiple anno_classes.json files - this shouldn't happen");
+    const size_t separator = net_filename.find_last_of("/\\");
+    const std::string initial_state_filename = (separator == std::string::npos ? "" : net_filename.substr(0, separator + 1)) + "annonet_trainer_state_file.dat";
+
+    // the trainer alternates between two files; take the newer one
+    const std::string newest_initial_state_filename = dlib::select_newest_file(initial_state_filename, initial_state_filename + "_");
+
+    std::ifstream in(newest_initial_state_filename, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("No " + initial_state_filename + " found - fine-tuning needs the trainer state of the training that produced " + net_filename);
     }
+    std::ofstream out(synchronization_filename, std::ios::binary);
+    out << in.rdbuf();
+    if (!out) {
+        throw std::runtime_error("Unable to write " + synchronization_filename);
+    }
+    std::ofstream(source_filename) << fingerprint << std::endl;
+
+    std::cout << "Initializing from " << newest_initial_state_filename << std::endl;
+    return true;
+}
 
-    const std::string json = read_file_as_string(files.front());
+// The weights loaded from the copied trainer state have to be those saved in annonet.dnn;
+// the state file may well be from some other (later, or earlier) training
+void check_initial_trainer_state(NetPimpl::TrainingNet& training_net, const std::string& net_filename, const std::string& serialized_initial_net, const std::string& synchronization_filename)
+{
+    std::ostringstream serialized;
+    training_net.GetRuntimeNet().Serialize(serialized);
+
+    if (serialized.str() != serialized_initial_net) {
+        std::remove(synchronization_filename.c_str());
+        std::remove((synchronization_filename + "_").c_str());
+        std::remove((synchronization_filename + ".source").c_str());
+        throw std::runtime_error("The annonet_trainer_state_file.dat next to " + net_filename + " does not hold the weights of " + net_filename
+            + " - it has to be the state file of the very training that saved the net");
+    }
+}
 
-    return json;
+// The output layer is reused as is, so the classes have to be the same; so does the
+// scale of the images
+void check_fine_tuning_compatibility(
+    const std::string& net_filename,
+    const std::vector<AnnoClass>& net_anno_classes,
+    double net_downscaling_factor,
+    const std::vector<AnnoClass>& anno_classes,
+    double downscaling_factor
+)
+{
+    if (net_anno_classes.size() != anno_classes.size()) {
+        std::ostringstream error;
+        error << net_filename << " has " << net_anno_classes.size() << " classes, but the dataset has " << anno_classes.size();
+        throw std::runtime_error(error.str());
+    }
+    for (size_t i = 0; i < anno_classes.size(); ++i) {
+        if (net_anno_classes[i].index != anno_classes[i].index || pack_rgba_label(net_anno_classes[i].rgba_label) != pack_rgba_label(anno_classes[i].rgba_label)) {
+            throw std::runtime_error("The classes of " + net_filename + " differ from those of the dataset, starting from " + anno_classes[i].classlabel);
+        }
+    }
+    if (std::abs(net_downscaling_factor - downscaling_factor) > 1e-6 * downscaling_factor) {
+        std::ostringstream error;
+        error << net_filename << " was trained with a downscaling factor of " << net_downscaling_factor << ", but the current one is " << downscaling_factor;
+        throw std::runtime_error(error.str());
+    }
 }
 
 // ----------------------------------------------------------------------------------------
@@ -211,6 +331,15 @@ int main(int argc, char** argv) try
         ("d,initial-downscaling-factor", "The initial downscaling factor (>= 1.0)", cxxopts::value<double>()->default_value("1.0"))
         ("f,further-downscaling-factor", "The further downscaling factor (>= 1.0)", cxxopts::value<double>()->default_value("1.0"))
         ("i,input-directory", "Input image directory", cxxopts::value<std::string>())
+        ("input-shards", "Read the samples from these shard files (or directories of them) written by annonet_pack, instead of the input directory", cxxopts::value<std::vector<std::string>>())
+        ("shuffle-buffer-size", "Number of samples in the shuffle buffer, when reading shards", cxxopts::value<size_t>()->default_value("64"))
+        ("crops-per-sample", "Number of crops taken from each sample in the shuffle buffer before it is replaced, when reading shards", cxxopts::value<size_t>()->default_value("10"))
+        ("crop-file", "Train on the pre-extracted crops of this file, instead of decoding full images (the crops are sampled uniformly; of the sampling options, only --ignore-class applies)", cxxopts::value<std::string>())
+        ("materialize-crops", "Extract this many random crops into the crop file, and exit", cxxopts::value<size_t>())
+        ("class-stratified-sampling", "Pick a class uniformly first, and then an image that contains it (uses a class index cached in the input directory)")
+        ("class-index-file", "Cache the class index in this file, instead of annonet.annoclasses in the input directory (or next to an input archive)", cxxopts::value<std::string>())
+        ("global-class-weights", "Weigh the classes by their pixel counts in the whole dataset, instead of in each crop (uses the class index, too)")
+        ("rescan-interval", "Rescan the input directory for new and modified images every this many seconds (0 = never)", cxxopts::value<unsigned int>()->default_value("0"))
         ("u,allow-flip-upside-down", "Randomly flip input images upside down")
         ("l,allow-flip-left-right", "Randomly flip input images horizontally")
 #ifdef DLIB_DNN_PIMPL_WRAPPER_GRAYSCALE_INPUT
@@ -218,6 +347,7 @@ int main(int argc, char** argv) try
 #else // DLIB_DNN_PIMPL_WRAPPER_GRAYSCALE_INPUT
         ("o,allow-random-color-offset", "Randomly apply color offsets")
 #endif // DLIB_DNN_PIMPL_WRAPPER_GRAYSCALE_INPUT
+        ("remap-class", "Make the labels of a class count as another class, e.g. 2:1 (can be repeated); the remaining classes are renumbered, and --ignore-class refers to the new indexes", cxxopts::value<std::vector<std::string>>())
         ("ignore-class", "Ignore specific classes by index", cxxopts::value<std::vector<uint16_t>>())
         ("ignore-large-nonzero-regions-by-area", "Ignore large non-zero regions by area", cxxopts::value<double>())
         ("ignore-large-nonzero-regions-by-width", "Ignore large non-zero regions by width", cxxopts::value<double>())
@@ -228,29 +358,74 @@ int main(int argc, char** argv) try
         ("input-dimension-multiplier", "Size of input patches, relative to minimum required", cxxopts::value<double>()->default_value("3.0"))
         ("net-width-scaler", "Scaler of net width", cxxopts::value<double>()->default_value("1.0"))
         ("net-width-min-filter-count", "Minimum net width filter count", cxxopts::value<int>()->default_value("1"))
+        ("initialize-from", "Fine-tune this trained net (annonet.dnn), instead of starting from random weights; the annonet_trainer_state_file.dat of its training has to be in the same directory. The learning rate and the training length then default to 0.01 and 0.5", cxxopts::value<std::string>())
         ("initial-learning-rate", "Set initial learning rate", cxxopts::value<double>()->default_value("0.1"))
         ("learning-rate-shrink-factor", "Set learning rate shrink factor", cxxopts::value<double>()->default_value("0.1"))
         ("min-learning-rate", "Set minimum learning rate", cxxopts::value<double>()->default_value("1e-6"))
+        ("time-budget", "Train for at most this many minutes, with the learning rate schedule fitted to the time", cxxopts::value<double>())
         ("save-interval", "Save the resulting inference network every this many steps", cxxopts::value<size_t>()->default_value("1000"))
         ("t,relative-training-length", "Relative training length", cxxopts::value<double>()->default_value("2.0"))
         ("c,cached-image-count", "Cached image count", cxxopts::value<int>()->default_value("8"))
         ("data-loader-thread-count", "Number of data loader threads", cxxopts::value<unsigned int>()->default_value(default_data_loader_thread_count.str()))
         ("no-empty-label-image-warning", "Do not warn about empty label images")
+        ("no-dataset-validation", "Do not check all the images and label images before training (the results are cached along with the class index)")
+        ("benchmark-loader", "Only run the data loaders, without training, and report their throughput")
+        ("benchmark-duration", "Duration of the data loader benchmark, in seconds", cxxopts::value<double>()->default_value("30.0"))
+        ("benchmark-result-file", "Write the data loader benchmark results to this JSON file", cxxopts::value<std::string>())
+        ("force-isa", "Use the per-pixel kernels of this instruction set level: generic, sse41, avx2, or avx512 (default: the best supported)", cxxopts::value<std::string>())
         ;
 
     try {
         options.parse_positional("input-directory");
         options.parse(argc, argv);
 
-        cxxopts::check_required(options, { "input-directory" });
+        if (options.count("materialize-crops") == 1 && options.count("crop-file") == 0) {
+            throw std::runtime_error("The crops can be materialized only into a crop file.");
+        }
+
+        const bool has_input_crops = options.count("crop-file") == 1 && options.count("materialize-crops") == 0;
+
+        if (options.count("class-stratified-sampling") == 1 && (options.count("input-shards") == 1 || has_input_crops)) {
+            throw std::runtime_error("Class-stratified sampling is supported only when reading the input directory.");
+        }
+        if (options.count("global-class-weights") == 1 && (options.count("input-shards") == 1 || has_input_crops)) {
+            throw std::runtime_error("Global class weights are supported only when reading the input directory.");
+        }
+        if (options.count("remap-class") > 0 && (options.count("input-shards") == 1 || has_input_crops)) {
+            throw std::runtime_error("Class remapping is supported only when reading the input directory.");
+        }
+        if (options["rescan-interval"].as<unsigned int>() > 0 && (options.count("input-shards") == 1 || has_input_crops)) {
+            throw std::runtime_error("Rescanning is supported only when reading the input directory.");
+        }
+        if (has_input_crops && options.count("input-shards") == 1) {
+            throw std::runtime_error("The crops can be read either from a crop file or from shards, but not from both.");
+        }
+        if (has_input_crops && (options.count("initial-downscaling-factor") == 1 || options.count("further-downscaling-factor") == 1)) {
+            throw std::runtime_error("The downscaling factors of a crop file are fixed when the crops are materialized.");
+        }
+
+        if (options.count("input-shards") == 0 && !has_input_crops) {
+            cxxopts::check_required(options, { "input-directory" });
 
-        std::cout << "Input directory = " << options["input-directory"].as<std::string>() << std::endl;
-        std::cout << "Initial downscaling factor = " << options["initial-downscaling-factor"].as<double>() << std::endl;
+            std::cout << "Input directory = " << options["input-directory"].as<std::string>() << std::endl;
+            std::cout << "Initial downscaling factor = " << options["initial-downscaling-factor"].as<double>() << std::endl;
+        }
         std::cout << "Further downscaling factor = " << options["further-downscaling-factor"].as<double>() << std::endl;
 
         if (options["initial-downscaling-factor"].as<double>() <= 0.0 || options["further-downscaling-factor"].as<double>() <= 0.0) {
             throw std::runtime_error("The downscaling factors have to be strictly positive.");
         }
+        if (options.count("time-budget") == 1 && options["time-budget"].as<double>() <= 0.0) {
+            throw std::runtime_error("The time budget has to be strictly positive.");
+        }
+        if (options["learning-rate-shrink-factor"].as<double>() <= 0.0 || options["learning-rate-shrink-factor"].as<double>() >= 1.0) {
+            throw std::runtime_error("The learning rate shrink factor has to be strictly between 0 and 1.");
+        }
+
+        if (options.count("force-isa") == 1) {
+            select_kernels(parse_isa_level(options["force-isa"].as<std::string>()));
+        }
+        std::cout << "Instruction set level = " << to_string(get_kernels().isa) << std::endl;
     }
     catch (std::exception& e) {
         cerr << e.what() << std::endl;
@@ -259,8 +434,19 @@ int main(int argc, char** argv) try
         return 2;
     }
 
-    const double initial_downscaling_factor = options["initial-downscaling-factor"].as<double>();
-    const double further_downscaling_factor = options["further-downscaling-factor"].as<double>();
+    const size_t materialize_crop_count = options.count("materialize-crops") ? options["materialize-crops"].as<size_t>() : 0;
+    const bool use_crop_file = options.count("crop-file") > 0 && materialize_crop_count == 0;
+    const std::unique_ptr<crop_file_reader> crop_file(use_crop_file ? new crop_file_reader(options["crop-file"].as<std::string>()) : nullptr);
+
+    const bool use_shards = !use_crop_file && options.count("input-shards") > 0;
+    const std::vector<std::string> shard_files = use_shards ? find_shard_files(options["input-shards"].as<std::vector<std::string>>()) : std::vector<std::string>();
+    const shard_header shards = use_shards ? read_common_shard_header(shard_files) : shard_header();
+
+    const double initial_downscaling_factor
+        = use_crop_file ? crop_file->get_info().initial_downscaling_factor
+        : use_shards ? shards.downscaling_factor
+        : options["initial-downscaling-factor"].as<double>();
+    const double further_downscaling_factor = use_crop_file ? crop_file->get_info().further_downscaling_factor : options["further-downscaling-factor"].as<double>();
     const double ignore_large_nonzero_regions_by_area = options.count("ignore-large-nonzero-regions-by-area") ? options["ignore-large-nonzero-regions-by-area"].as<double>() : std::numeric_limits<double>::infinity();
     const double ignore_large_nonzero_regions_by_width = options.count("ignore-large-nonzero-regions-by-width") ? options["ignore-large-nonzero-regions-by-width"].as<double>() : std::numeric_limits<double>::infinity();
     const double ignore_large_nonzero_regions_by_height = options.count("ignore-large-nonzero-regions-by-height") ? options["ignore-large-nonzero-regions-by-height"].as<double>() : std::numeric_limits<double>::infinity();
@@ -270,14 +456,20 @@ int main(int argc, char** argv) try
     const auto input_dimension_multiplier = options["input-dimension-multiplier"].as<double>();
     const auto net_width_scaler = options["net-width-scaler"].as<double>();
     const auto net_width_min_filter_count = options["net-width-min-filter-count"].as<int>();
-    const auto initial_learning_rate = options["initial-learning-rate"].as<double>();
+    const bool fine_tune = options.count("initialize-from") > 0;
+
+    // A converged net needs only a short schedule, starting from a lower learning rate
+    const auto initial_learning_rate = fine_tune && options.count("initial-learning-rate") == 0 ? 0.01 : options["initial-learning-rate"].as<double>();
     const auto learning_rate_shrink_factor = options["learning-rate-shrink-factor"].as<double>();
     const auto min_learning_rate = options["min-learning-rate"].as<double>();
+    const double time_budget_seconds = options.count("time-budget") ? 60.0 * options["time-budget"].as<double>() : 0.0;
     const auto save_interval = options["save-interval"].as<size_t>();
-    const auto relative_training_length = std::max(0.01, options["relative-training-length"].as<double>());
+    const auto relative_training_length = std::max(0.01, fine_tune && options.count("relative-training-length") == 0 ? 0.5 : options["relative-training-length"].as<double>());
     const auto cached_image_count = options["cached-image-count"].as<int>();
     const auto data_loader_thread_count = std::max(1U, options["data-loader-thread-count"].as<unsigned int>());
     const bool warn_about_empty_label_images = options.count("no-empty-label-image-warning") == 0;
+    const bool benchmark_loader = options.count("benchmark-loader") > 0;
+    const auto benchmark_duration = options["benchmark-duration"].as<double>();
 
     std::cout << "Allow flipping input images upside down = " << (allow_flip_upside_down ? "yes" : "no") << std::endl;
     std::cout << "Minibatch size = " << minibatch_size << std::endl;
@@ -285,6 +477,9 @@ int main(int argc, char** argv) try
     std::cout << "Initial learning rate = " << initial_learning_rate << std::endl;
     std::cout << "Learning rate shrink factor = " << learning_rate_shrink_factor << std::endl;
     std::cout << "Min learning rate = " << min_learning_rate << std::endl;
+    if (time_budget_seconds > 0.0) {
+        std::cout << "Time budget = " << time_budget_seconds / 60.0 << " minutes" << std::endl;
+    }
     std::cout << "Save interval = " << save_interval << std::endl;
     std::cout << "Relative training length = " << relative_training_length << std::endl;
     std::cout << "Cached image count = " << cached_image_count << std::endl;
@@ -307,39 +502,188 @@ int main(int argc, char** argv) try
     const int actual_input_dimension = NetPimpl::RuntimeNet::GetRecommendedInputDimension(requested_input_dimension);
     std::cout << "Actual input dimension = " << actual_input_dimension << std::endl;
 
-    const auto anno_classes_json = read_anno_classes_file(options["input-directory"].as<std::string>());
-    const auto anno_classes = parse_anno_classes(anno_classes_json);
+    const auto dataset_anno_classes_json
+        = use_crop_file ? crop_file->get_info().anno_classes_json
+        : use_shards ? shards.anno_classes_json
+        : read_anno_classes_file(options["input-directory"].as<std::string>());
+
+    const std::vector<std::string> class_remap_specs = options.count("remap-class") > 0 ? options["remap-class"].as<std::vector<std::string>>() : std::vector<std::string>();
+    const remapped_anno_classes remapped_classes = remap_anno_classes(parse_anno_classes(dataset_anno_classes_json), parse_class_remap(class_remap_specs));
+
+    // The classes that the net outputs, and that are saved along with it
+    const std::vector<AnnoClass>& anno_classes = remapped_classes.output_classes;
+    const std::string anno_classes_json = class_remap_specs.empty() ? dataset_anno_classes_json : anno_classes_to_json(anno_classes, remapped_classes.decoding_classes);
+
+    // The labels are remapped already when the label images are decoded
+    const std::vector<AnnoClass>& decoding_anno_classes = remapped_classes.decoding_classes;
+    std::string classes_key = dataset_anno_classes_json;
+    for (const std::string& class_remap_spec : class_remap_specs) {
+        classes_key += "\nremap " + class_remap_spec;
+    }
+
+    if (!class_remap_specs.empty()) {
+        for (const AnnoClass& anno_class : decoding_anno_classes) {
+            cout << "Class " << anno_class.classlabel << " -> " << anno_class.index << " (" << anno_classes[anno_class.index].classlabel << ")" << endl;
+        }
+    }
+
+    std::string serialized_initial_net;
+    if (fine_tune) {
+        const std::string net_filename = options["initialize-from"].as<std::string>();
+        std::string net_anno_classes_json;
+        double net_downscaling_factor = 1.0;
+        deserialize(net_filename) >> net_anno_classes_json >> net_downscaling_factor >> serialized_initial_net;
+
+        check_fine_tuning_compatibility(net_filename, parse_anno_classes(net_anno_classes_json), net_downscaling_factor, anno_classes, initial_downscaling_factor * further_downscaling_factor);
+    }
 
     const unsigned long iterations_without_progress_threshold = static_cast<unsigned long>(std::round(relative_training_length * 2000));
     const unsigned long previous_loss_values_dump_amount = static_cast<unsigned long>(std::round(relative_training_length * 400));
     const unsigned long batch_normalization_running_stats_window_size = static_cast<unsigned long>(std::round(relative_training_length * 100));
 
-    NetPimpl::TrainingNet training_net;
+    std::vector<image_filenames> image_files;
 
-    std::vector<NetPimpl::input_type> samples;
-    std::vector<NetPimpl::training_label_type> labels;
+    if (use_crop_file) {
+        cout << "crops in crop file: " << crop_file->get_crop_count() << endl;
+        cout << "Downscaling factors (from the crop file) = " << initial_downscaling_factor << ", " << further_downscaling_factor << endl;
+        if (crop_file->get_info().dimension != actual_input_dimension) {
+            std::ostringstream error;
+            error << "The crops in " << options["crop-file"].as<std::string>() << " are " << crop_file->get_info().dimension << " pixels wide,"
+                << " but the input dimension is " << actual_input_dimension << " - use the same input dimension multiplier as when materializing the crops";
+            throw std::runtime_error(error.str());
+        }
+    }
+    else if (use_shards) {
+        cout << "shard files: " << shard_files.size() << endl;
+        cout << "Initial downscaling factor (from the shards) = " << initial_downscaling_factor << endl;
+    }
+    else {
+        cout << "\nSCANNING ANNO DATASET\n" << endl;
 
-    training_net.Initialize();
-    training_net.SetNetWidth(net_width_scaler, net_width_min_filter_count);
-    training_net.SetSynchronizationFile("annonet_trainer_state_file.dat", std::chrono::seconds(10 * 60));
-    training_net.BeVerbose();
-    training_net.SetClassCount(anno_classes.size());
-    training_net.SetLearningRate(initial_learning_rate);
-    training_net.SetLearningRateShrinkFactor(learning_rate_shrink_factor);
-    training_net.SetIterationsWithoutProgressThreshold(iterations_without_progress_threshold);
-    training_net.SetPreviousLossValuesDumpAmount(previous_loss_values_dump_amount);
-    training_net.SetAllBatchNormalizationRunningStatsWindowSizes(batch_normalization_running_stats_window_size);
+        image_files = find_image_files(options["input-directory"].as<std::string>(), true);
+        cout << "images in dataset: " << image_files.size() << endl;
+        if (image_files.size() == 0)
+        {
+            cout << "Didn't find an anno dataset. " << endl;
+            return 1;
+        }
+    }
 
-    cout << "\nSCANNING ANNO DATASET\n" << endl;
+    const bool class_stratified_sampling = options.count("class-stratified-sampling") > 0;
+    const auto rescan_interval = options["rescan-interval"].as<unsigned int>();
+
+    const bool validate_dataset = options.count("no-dataset-validation") == 0;
+
+    const auto make_dataset_snapshot = [&](std::vector<stamped_image_filenames> stamped_image_files, bool with_class_index) {
+        const auto snapshot = std::make_shared<dataset_snapshot>();
+        snapshot->image_files = std::move(stamped_image_files);
+        if (with_class_index || validate_dataset) {
+            const std::string manifest_filename = options.count("class-index-file")
+                ? options["class-index-file"].as<std::string>()
+                : get_class_index_manifest_filename(options["input-directory"].as<std::string>());
+            snapshot->class_index = std::make_shared<dataset_class_index>(get_filenames(snapshot->image_files), decoding_anno_classes, classes_key, manifest_filename, data_loader_thread_count);
+
+            // A bad sample would otherwise stop the training when it's first picked, maybe hours later
+            const std::vector<size_t> invalid_images = validate_dataset ? snapshot->class_index->get_invalid_images() : std::vector<size_t>();
+            if (!invalid_images.empty()) {
+                const size_t max_reported = 20;
+                for (size_t i = 0; i < invalid_images.size() && i < max_reported; ++i) {
+                    const image_class_statistics& statistics = snapshot->class_index->get_statistics(invalid_images[i]);
+                    cout << "Excluding " << snapshot->image_files[invalid_images[i]].filenames.image_filename << ": " << statistics.error << endl;
+                }
+                if (invalid_images.size() > max_reported) {
+                    cout << "... and " << invalid_images.size() - max_reported << " more" << endl;
+                }
+                cout << invalid_images.size() << " of " << snapshot->image_files.size() << " images excluded" << endl;
+
+                std::vector<stamped_image_filenames> valid_image_files;
+                for (size_t i = 0, j = 0; i < snapshot->image_files.size(); ++i) {
+                    if (j < invalid_images.size() && invalid_images[j] == i) {
+                        ++j;
+                    }
+                    else {
+                        valid_image_files.push_back(snapshot->image_files[i]);
+                    }
+                }
+                if (valid_image_files.empty()) {
+                    throw std::runtime_error("No valid images left");
+                }
+                snapshot->image_files = std::move(valid_image_files);
 
-    const auto image_files = find_image_files(options["input-directory"].as<std::string>(), true);
-    cout << "images in dataset: " << image_files.size() << endl;
-    if (image_files.size() == 0)
-    {
-        cout << "Didn't find an anno dataset. " << endl;
-        return 1;
+                // Everything is in the manifest by now, so this is quick
+                snapshot->class_index = std::make_shared<dataset_class_index>(get_filenames(snapshot->image_files), decoding_anno_classes, classes_key, manifest_filename, data_loader_thread_count);
+            }
+        }
+        if (class_stratified_sampling) {
+            // Chooses the class before the image, so images without rare classes are loaded only when needed
+            snapshot->class_sampler = std::make_shared<class_stratified_sampler>(*snapshot->class_index, classes_to_ignore);
+        }
+        return std::shared_ptr<const dataset_snapshot>(snapshot);
+    };
+
+    // Stamping the files costs a couple of stat calls per image, so it's done only if needed
+    std::shared_ptr<const dataset_snapshot> current_dataset;
+    std::vector<stamped_image_filenames> scanned_image_files; // including any excluded by the validation
+    if (!use_crop_file && !use_shards) {
+        scanned_image_files = stamp_image_files(image_files, rescan_interval > 0);
+        current_dataset = make_dataset_snapshot(scanned_image_files, class_stratified_sampling || options.count("global-class-weights") > 0);
+    }
+
+    const dataset_class_index* const class_index = current_dataset ? current_dataset->class_index.get() : nullptr;
+
+    if (class_index && validate_dataset) {
+        for (const AnnoClass& anno_class : anno_classes) {
+            if (class_index->get_images_by_class().count(anno_class.index) == 0) {
+                cout << "Warning: class " << anno_class.index << " (" << anno_class.classlabel << ") isn't present in any label image" << endl;
+            }
+        }
     }
 
+    if (class_stratified_sampling) {
+        for (const uint16_t class_to_sample : current_dataset->class_sampler->get_classes()) {
+            const auto i = std::find_if(anno_classes.begin(), anno_classes.end(), [class_to_sample](const AnnoClass& anno_class) { return anno_class.index == class_to_sample; });
+            cout << "Class " << class_to_sample << (i != anno_classes.end() ? " (" + i->classlabel + ")" : std::string())
+                << ": " << class_index->get_images_by_class().at(class_to_sample).size() << " images, "
+                << class_index->get_pixel_count(class_to_sample) << " pixels" << endl;
+        }
+    }
+
+    // Computed once, so that weighting a crop is just a lookup per pixel
+    std::vector<double> global_label_weights;
+    if (options.count("global-class-weights") > 0) {
+        std::vector<uint64_t> label_counts;
+        for (const auto& i : class_index->get_images_by_class()) {
+            if (std::find(classes_to_ignore.begin(), classes_to_ignore.end(), i.first) == classes_to_ignore.end()) {
+                label_counts.resize(std::max<size_t>(label_counts.size(), i.first + 1));
+                label_counts[i.first] = class_index->get_pixel_count(i.first);
+            }
+        }
+        global_label_weights = compute_global_label_weights(label_counts, options["class-weight"].as<double>());
+
+        cout << "Global class weights =";
+        for (size_t label = 0; label < global_label_weights.size(); ++label) {
+            if (global_label_weights[label] > 0.0) {
+                cout << " " << label << ":" << global_label_weights[label];
+            }
+        }
+        cout << endl;
+    }
+
+    // The crops of a crop file may have been materialized with other classes ignored (or none)
+    const auto ignore_classes_to_ignore_in_crop = [&classes_to_ignore](dlib::matrix<uint16_t>& label_image) {
+        if (classes_to_ignore.empty()) {
+            return;
+        }
+        for (long r = 0, nr = label_image.nr(); r < nr; ++r) {
+            for (long c = 0, nc = label_image.nc(); c < nc; ++c) {
+                uint16_t& label = label_image(r, c);
+                if (std::find(classes_to_ignore.begin(), classes_to_ignore.end(), label) != classes_to_ignore.end()) {
+                    label = dlib::loss_multiclass_log_per_pixel_::label_to_ignore;
+                }
+            }
+        }
+    };
+
     const auto ignore_classes_to_ignore = [&classes_to_ignore](sample& sample) {
         for (const auto class_to_ignore : classes_to_ignore) {
             const auto i = sample.labeled_points_by_class.find(class_to_ignore);
@@ -422,26 +766,57 @@ int main(int argc, char** argv) try
         std::swap(sample.labeled_points_by_class, labeled_points_to_keep);
     };
 
-    shared_lru_cache_using_std<image_filenames, std::shared_ptr<sample>, std::unordered_map> full_images_cache(
-        [&](const image_filenames& image_filenames) {
+    std::atomic<size_t> full_image_requests(0);
+    std::atomic<size_t> full_image_reads(0);
+
+    // The stamps are a part of the key, so modified files are read again
+    shared_lru_cache_using_std<stamped_image_filenames, std::shared_ptr<sample>, std::unordered_map> full_images_cache(
+        [&](const stamped_image_filenames& stamped_image_filenames) {
+            ++full_image_reads;
             std::shared_ptr<sample> sample(new sample);
-            *sample = read_sample(image_filenames, anno_classes, true, initial_downscaling_factor);
+            *sample = read_sample(stamped_image_filenames.filenames, decoding_anno_classes, true, initial_downscaling_factor);
             ignore_classes_to_ignore(*sample);
             return sample;
         }, cached_image_count);
 
-    cout << endl << "Now training..." << endl;
-   
+    // When reading shards, the samples come from a shuffle buffer instead of the cache
+    std::unique_ptr<shuffled_shard_samples> shard_samples;
+    if (use_shards) {
+        shard_samples.reset(new shuffled_shard_samples(shard_files, options["shuffle-buffer-size"].as<size_t>(), options["crops-per-sample"].as<size_t>(), ignore_classes_to_ignore));
+    }
+
+    const auto get_full_image_reads = [&]() {
+        return shard_samples ? shard_samples->get_read_count() : full_image_reads.load();
+    };
+
+    if (!benchmark_loader && materialize_crop_count == 0) {
+        cout << endl << "Now training..." << endl;
+    }
+
     set_low_priority();
 
+    // If the trainer is going to resume, the loaders resume, too
+    const std::string synchronization_filename = fine_tune ? "annonet_fine_tuning_state_file.dat" : "annonet_trainer_state_file.dat";
+    const std::string loader_state_filename = synchronization_filename + ".loaders";
+
+    loader_state resumed_loader_state;
+    const bool resume_loaders = !benchmark_loader && materialize_crop_count == 0
+        && std::ifstream(synchronization_filename, std::ios::binary)
+        && load_loader_state(resumed_loader_state, loader_state_filename);
+
+    recent_image_tracker recent_images(4 * std::max(1, cached_image_count));
+    const uint64_t loader_seed = resume_loaders ? resumed_loader_state.seed : static_cast<uint64_t>(time(0));
+
     // Start a bunch of threads that read images from disk and pull out random crops.  It's
     // important to be sure to feed the GPU fast enough to keep it busy.  Using multiple
     // thread for this kind of data preparation helps us do that.  Each thread puts the
     // crops into the data queue.
     dlib::pipe<crop> data(2 * minibatch_size);
-    auto pull_crops = [&data, &full_images_cache, &image_files, actual_input_dimension, &options](time_t seed)
+    auto pull_crops = [&data, &full_images_cache, &shard_samples, &crop_file, &current_dataset, &global_label_weights, &full_image_requests, &resumed_loader_state, &recent_images, &ignore_classes_to_ignore_in_crop, loader_seed, rescan_interval, actual_input_dimension, further_downscaling_factor, materialize_crop_count, &options](time_t seed)
     {
-        dlib::rand rnd(time(0)+seed);
+        const size_t loader_index = static_cast<size_t>(seed);
+        uint64_t crop_index = loader_index < resumed_loader_state.crop_counts.size() ? resumed_loader_state.crop_counts[loader_index] : 0;
+        dlib::rand rnd;
         NetPimpl::input_type input_image;
         matrix<uint16_t> index_label_image;
         crop crop;
@@ -451,30 +826,260 @@ int main(int argc, char** argv) try
             crop.error.clear();
             crop.warning.clear();
 
-            const size_t index = rnd.get_random_32bit_number() % image_files.size();
-            const image_filenames& image_filenames = image_files[index];
-            const std::shared_ptr<sample> ground_truth_sample = full_images_cache(image_filenames);
+            seed_crop_random_number_generator(rnd, loader_seed, loader_index, crop_index);
+            crop.loader_index = loader_index;
+            crop.crop_index = crop_index++;
+
+            if (crop_file) {
+                // the crops have been extracted already, so only the augmentation is left
+                crop_file->read(rnd.get_random_64bit_number() % crop_file->get_crop_count(), crop.input_image, crop.temporary_unweighted_label_image);
+                ignore_classes_to_ignore_in_crop(crop.temporary_unweighted_label_image);
+                augment_crop(crop, rnd, options, global_label_weights);
+                data.enqueue(crop);
+                continue;
+            }
+
+            int class_to_crop = -1;
+            std::shared_ptr<sample> ground_truth_sample;
+
+            ++full_image_requests;
+            if (shard_samples) {
+                ground_truth_sample = shard_samples->get(rnd);
+            }
+            else {
+                const std::shared_ptr<const dataset_snapshot> dataset = std::atomic_load(&current_dataset);
+                size_t image_index = 0;
+                if (dataset->class_sampler) {
+                    uint16_t sampled_class = 0;
+                    image_index = dataset->class_sampler->get(rnd, sampled_class);
+                    class_to_crop = sampled_class;
+                }
+                else {
+                    image_index = rnd.get_random_32bit_number() % dataset->image_files.size();
+                }
+                recent_images.add(dataset->image_files[image_index].filenames.image_filename);
+                ground_truth_sample = full_images_cache(dataset->image_files[image_index]);
+            }
 
-            if (!ground_truth_sample->error.empty()) {
+            if (!ground_truth_sample->error.empty() && rescan_interval > 0) {
+                // the file may have been removed, or be still being written
+                crop.warning = "Warning: " + ground_truth_sample->error;
+            }
+            else if (!ground_truth_sample->error.empty()) {
                 crop.error = ground_truth_sample->error;
             }
             else if (ground_truth_sample->labeled_points_by_class.empty()) {
                 crop.warning = "Warning: no labeled points in " + ground_truth_sample->image_filenames.label_filename;
             }
+            else if (materialize_crop_count > 0) {
+                extract_random_crop(actual_input_dimension, *ground_truth_sample, crop, rnd, further_downscaling_factor, temp, class_to_crop);
+            }
             else {
-                randomly_crop_image(actual_input_dimension, *ground_truth_sample, crop, rnd, options, temp);
+                randomly_crop_image(actual_input_dimension, *ground_truth_sample, crop, rnd, options, global_label_weights, temp, class_to_crop);
             }
             data.enqueue(crop);
         }
     };
 
+    // Before the rescanner starts, so that the snapshot (and the pointers into it) can't be
+    // replaced while the cache is warming up
+    if (resume_loaders && current_dataset && !resumed_loader_state.hot_image_filenames.empty()) {
+        const std::shared_ptr<const dataset_snapshot> dataset = current_dataset;
+        std::unordered_map<std::string, const stamped_image_filenames*> image_files_by_name;
+        for (const stamped_image_filenames& image_file : dataset->image_files) {
+            image_files_by_name[image_file.filenames.image_filename] = &image_file;
+        }
+
+        // Least recently used first, so that the hottest images are the last to be evicted
+        std::vector<const stamped_image_filenames*> hot_image_files;
+        for (auto i = resumed_loader_state.hot_image_filenames.rbegin(); i != resumed_loader_state.hot_image_filenames.rend() && hot_image_files.size() < static_cast<size_t>(cached_image_count); ++i) {
+            const auto j = image_files_by_name.find(*i);
+            if (j != image_files_by_name.end()) {
+                hot_image_files.push_back(j->second);
+            }
+        }
+
+        cout << "Warming up the image cache with " << hot_image_files.size() << " images..." << endl;
+        parallel_for(data_loader_thread_count, 0, hot_image_files.size(), [&](long i) {
+            full_images_cache(*hot_image_files[i]);
+        });
+    }
+
+    std::unique_ptr<dataset_rescanner> rescanner;
+    if (rescan_interval > 0 && current_dataset) {
+        const auto on_change = [&](const std::vector<stamped_image_filenames>& rescanned_image_files) {
+            // The global class weights, if any, are kept as they were at the start
+            std::atomic_store(&current_dataset, make_dataset_snapshot(rescanned_image_files, class_stratified_sampling || validate_dataset));
+        };
+        // Seeded with what was scanned, so that the images excluded above aren't reported as added
+        rescanner.reset(new dataset_rescanner(options["input-directory"].as<std::string>(), scanned_image_files, std::chrono::seconds(rescan_interval), on_change));
+    }
+
     std::vector<std::thread> data_loaders;
     for (unsigned int i = 0; i < data_loader_thread_count; ++i) {
         data_loaders.push_back(std::thread([pull_crops, i]() { pull_crops(i); }));
     }
     
+    const auto join = [](std::vector<thread>& threads)
+    {
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    };
+
+    if (materialize_crop_count > 0) {
+        const std::string crop_filename = options["crop-file"].as<std::string>();
+
+        cout << endl << "Materializing " << materialize_crop_count << " crops into " << crop_filename << "..." << endl;
+
+        crop_file_info info;
+        info.anno_classes_json = anno_classes_json;
+        info.initial_downscaling_factor = initial_downscaling_factor;
+        info.further_downscaling_factor = further_downscaling_factor;
+        info.dimension = actual_input_dimension;
+
+        crop_file_writer writer(crop_filename, info);
+
+        std::set<std::string> warnings_already_printed;
+
+        crop crop;
+        while (writer.get_crop_count() < materialize_crop_count) {
+            data.dequeue(crop);
+            taken_crop_counts[crop.loader_index] = crop.crop_index + 1;
+
+            if (!crop.error.empty()) {
+                data.disable();
+                join(data_loaders);
+                throw std::runtime_error(crop.error);
+            }
+            else if (!crop.warning.empty()) {
+                if (warn_about_empty_label_images && warnings_already_printed.find(crop.warning) == warnings_already_printed.end()) {
+                    std::cout << std::endl << crop.warning << std::endl;
+                    warnings_already_printed.insert(crop.warning);
+                }
+            }
+            else {
+                writer.write(crop.input_image, crop.temporary_unweighted_label_image);
+                if (writer.get_crop_count() % 100 == 0 || writer.get_crop_count() == materialize_crop_count) {
+                    cout << "\rCrops: " << writer.get_crop_count() << " of " << materialize_crop_count << std::flush;
+                }
+            }
+        }
+
+        data.disable();
+        join(data_loaders);
+
+        writer.finish();
+
+        cout << endl << "Done!" << endl;
+        return 0;
+    }
+
+    if (benchmark_loader) {
+        cout << endl << "Benchmarking the data loaders for " << benchmark_duration << " seconds..." << endl;
+
+        size_t crop_count = 0, warning_count = 0, error_count = 0;
+
+        const auto t0 = std::chrono::steady_clock::now();
+        const size_t full_image_requests_at_t0 = full_image_requests;
+        const size_t full_image_reads_at_t0 = get_full_image_reads();
+
+        auto progress_last_printed = t0;
+        double elapsed_seconds = 0.0;
+
+        crop crop;
+        while (elapsed_seconds < benchmark_duration) {
+            data.dequeue(crop);
+            taken_crop_counts[crop.loader_index] = crop.crop_index + 1;
+
+            if (!crop.error.empty()) {
+                ++error_count;
+            }
+            else if (!crop.warning.empty()) {
+                ++warning_count;
+            }
+            else {
+                ++crop_count;
+            }
+
+            const auto now = std::chrono::steady_clock::now();
+            elapsed_seconds = std::chrono::duration_cast<std::chrono::duration<double>>(now - t0).count();
+            if (now - progress_last_printed > std::chrono::seconds(1)) {
+                cout << "\rCrops: " << crop_count << ", crops/s: " << std::fixed << std::setprecision(1) << crop_count / elapsed_seconds << "   " << std::flush;
+                progress_last_printed = now;
+            }
+        }
+
+        const size_t requests = full_image_requests - full_image_requests_at_t0;
+        const size_t reads = get_full_image_reads() - full_image_reads_at_t0;
+
+        data.disable();
+        join(data_loaders);
+
+        const double cache_hit_rate = requests > 0 ? (requests - std::min(reads, requests)) / static_cast<double>(requests) : 0.0;
+
+        cout << endl;
+        cout << "Elapsed = " << elapsed_seconds << " s" << endl;
+        cout << "Crops = " << crop_count << " (" << warning_count << " without labels, " << error_count << " with errors)" << endl;
+        cout << "Crops/s = " << crop_count / elapsed_seconds << endl;
+        cout << "Decodes/s = " << reads / elapsed_seconds << endl;
+        cout << "Cache hit rate = " << 100.0 * cache_hit_rate << " %" << endl;
+
+        if (options.count("benchmark-result-file")) {
+            write_benchmark_results(options["benchmark-result-file"].as<std::string>(), {
+                { "crops_per_second", crop_count / elapsed_seconds },
+                { "decodes_per_second", reads / elapsed_seconds },
+                { "cache_hit_rate", cache_hit_rate },
+            });
+        }
+        return 0;
+    }
+
+    NetPimpl::TrainingNet training_net;
+
+    std::vector<NetPimpl::input_type> samples;
+    std::vector<NetPimpl::training_label_type> labels;
+
+    training_net.Initialize();
+    training_net.SetNetWidth(net_width_scaler, net_width_min_filter_count);
+
+    // A separate state file, so that a fine-tuning run doesn't resume the (finished) state of
+    // the training it started from, but can still resume itself if interrupted. The weights
+    // come in through the same file: the trainer loads it in SetSynchronizationFile, and the
+    // learning rate and the other settings below then replace the loaded ones.
+    const bool initial_trainer_state_copied = fine_tune
+        && copy_initial_trainer_state(options["initialize-from"].as<std::string>(), serialized_initial_net, synchronization_filename);
+    training_net.SetSynchronizationFile(synchronization_filename, std::chrono::seconds(10 * 60));
+    if (initial_trainer_state_copied) {
+        check_initial_trainer_state(training_net, options["initialize-from"].as<std::string>(), serialized_initial_net, synchronization_filename);
+    }
+    training_net.BeVerbose();
+    training_net.SetClassCount(anno_classes.size());
+    training_net.SetLearningRate(initial_learning_rate);
+    training_net.SetLearningRateShrinkFactor(learning_rate_shrink_factor);
+    training_net.SetIterationsWithoutProgressThreshold(iterations_without_progress_threshold);
+    training_net.SetPreviousLossValuesDumpAmount(previous_loss_values_dump_amount);
+    training_net.SetAllBatchNormalizationRunningStatsWindowSizes(batch_normalization_running_stats_window_size);
+
     size_t minibatch = 0;
 
+    // The crops that have been given to the trainer; written to the loader state whenever the
+    // trainer state has been written, so that the two describe (about) the same step
+    std::vector<uint64_t> taken_crop_counts(data_loader_thread_count);
+    for (size_t i = 0; i < taken_crop_counts.size() && i < resumed_loader_state.crop_counts.size(); ++i) {
+        taken_crop_counts[i] = resumed_loader_state.crop_counts[i];
+    }
+    trainer_state_watch trainer_state_written(synchronization_filename);
+    const auto save_loader_state_if_due = [&]() {
+        if (trainer_state_written.has_been_written()) {
+            loader_state state;
+            state.seed = loader_seed;
+            state.crop_counts = taken_crop_counts;
+            state.hot_image_filenames = recent_images.get(cached_image_count);
+            save_loader_state(state, loader_state_filename);
+        }
+    };
+
     const auto save_inference_net = [&]() {
         const NetPimpl::RuntimeNet runtime_net = training_net.GetRuntimeNet();
         
@@ -485,11 +1090,51 @@ int main(int argc, char** argv) try
         serialize("annonet.dnn") << anno_classes_json << (initial_downscaling_factor * further_downscaling_factor) << serialized.str();
     };
 
+    // With a time budget, each learning rate gets an equal share of the time: the threshold
+    // for shrinking the learning rate is fitted to the measured speed, and if there still
+    // seems to be progress when the share is used up, the learning rate is shrunk anyway
+    const auto training_started = std::chrono::steady_clock::now();
+    auto time_budget_last_updated = training_started;
+
+    const auto get_elapsed_seconds = [&]() {
+        return std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - training_started).count();
+    };
+
+    const auto update_time_budgeted_schedule = [&]() {
+        const double elapsed_seconds = get_elapsed_seconds();
+        const double learning_rate = training_net.GetLearningRate();
+        const double budgeted_learning_rate = get_time_budgeted_learning_rate(elapsed_seconds / time_budget_seconds, initial_learning_rate, learning_rate_shrink_factor, min_learning_rate);
+        if (learning_rate > budgeted_learning_rate * (1.0 + 1e-6)) {
+            cout << "Time budget: shrinking the learning rate to " << budgeted_learning_rate << endl;
+            training_net.SetLearningRate(budgeted_learning_rate);
+        }
+
+        const double steps_per_second = minibatch / elapsed_seconds;
+        const int stages_left = get_learning_rate_stage_count(std::min(learning_rate, budgeted_learning_rate), learning_rate_shrink_factor, min_learning_rate);
+        if (stages_left > 0) {
+            const double remaining_steps = (time_budget_seconds - elapsed_seconds) * steps_per_second;
+            training_net.SetIterationsWithoutProgressThreshold(std::max(100UL, static_cast<unsigned long>(remaining_steps / stages_left)));
+        }
+    };
+
     std::set<std::string> warnings_already_printed;
 
     // The main training loop.  Keep making mini-batches and giving them to the trainer.
     while (training_net.GetLearningRate() >= min_learning_rate)
     {
+        if (time_budget_seconds > 0.0) {
+            if (get_elapsed_seconds() >= time_budget_seconds) {
+                cout << "Time budget used up" << endl;
+                break;
+            }
+            // Not too often, as changing the settings makes the trainer pause
+            const auto now = std::chrono::steady_clock::now();
+            if (minibatch >= 20 && now - time_budget_last_updated > std::chrono::seconds(30)) {
+                update_time_budgeted_schedule();
+                time_budget_last_updated = now;
+            }
+        }
+
         samples.clear();
         labels.clear();
 
@@ -498,6 +1143,7 @@ int main(int argc, char** argv) try
         while (samples.size() < minibatch_size)
         {
             data.dequeue(crop);
+            taken_crop_counts[crop.loader_index] = crop.crop_index + 1;
 
             if (!crop.error.empty()) {
                 throw std::runtime_error(crop.error);
@@ -519,18 +1165,13 @@ int main(int argc, char** argv) try
         if (minibatch++ % save_interval == 0) {
             save_inference_net();
         }
+
+        save_loader_state_if_due();
     }
 
     // Training done: tell threads to stop.
     data.disable();
 
-    const auto join = [](std::vector<thread>& threads)
-    {
-        for (std::thread& thread : threads) {
-            thread.join();
-        }
-    };
-
     join(data_loaders);
 
     save_inference_net();
@@ -1,6 +1,13 @@
 #include "../annonet_train.h"
+#include "../annonet_image_formats.h"
+#include "../annonet_parse_anno_classes.h"
+#include "../annonet_tar.h"
 #include "picotest/picotest.h"
 
+#include <cstdio>
+#include <fstream>
+#include <functional>
+
 namespace {
 
     class TrainTest : public ::testing::Test {
@@ -119,6 +126,36 @@ namespace {
         EXPECT_EQ(GetTotalWeight(weighted_label_image), 5.0);
     }
 
+    TEST_F(TrainTest, WeighsClassesGlobally) {
+        NetPimpl::training_label_type weighted_label_image;
+
+        // in the whole dataset, class 1 is three times rarer than class 0
+        const std::vector<double> global_label_weights = compute_global_label_weights({ 30, 10 }, 1.0);
+
+        EXPECT_NEAR(global_label_weights[0], 0.666667, 1e-6);
+        EXPECT_NEAR(global_label_weights[1], 2.0, 1e-6);
+
+        set_weights(unweighted_label_image, weighted_label_image, global_label_weights, 1.0);
+
+        EXPECT_EQ(weighted_label_image.nr(), unweighted_label_image.nr());
+        EXPECT_EQ(weighted_label_image.nc(), unweighted_label_image.nc());
+
+        EXPECT_NEAR(weighted_label_image(0, 0).weight, 0.666667 * 1.25, 1e-6);
+        EXPECT_EQ(weighted_label_image(0, 1).weight, 0.0);
+        EXPECT_NEAR(weighted_label_image(0, 2).weight, 2.0 * 1.25, 1e-6);
+        EXPECT_NEAR(weighted_label_image(0, 3).weight, 0.666667 * 1.25, 1e-6);
+        EXPECT_NEAR(weighted_label_image(0, 4).weight, 0.666667 * 1.25, 1e-6);
+    }
+
+    TEST_F(TrainTest, SplitsTimeBudgetBetweenLearningRates) {
+        EXPECT_EQ(get_learning_rate_stage_count(0.1, 0.1, 1e-6), 6);
+
+        EXPECT_NEAR(get_time_budgeted_learning_rate(0.0, 0.1, 0.1, 1e-6), 0.1, 1e-12);
+        EXPECT_NEAR(get_time_budgeted_learning_rate(0.5, 0.1, 0.1, 1e-6), 1e-4, 1e-12);
+        EXPECT_NEAR(get_time_budgeted_learning_rate(0.99, 0.1, 0.1, 1e-6), 1e-6, 1e-12);
+        EXPECT_NEAR(get_time_budgeted_learning_rate(2.0, 0.1, 0.1, 1e-6), 1e-6, 1e-12);
+    }
+
     TEST_F(TrainTest, GeneratesRandomRectContainingPoint) {
         dlib::rand rnd;
         dlib::point point(50, 50);
@@ -131,6 +168,215 @@ namespace {
         EXPECT_TRUE(rect.contains(point));
     }
 
+    static bool Throws(const std::function<void()>& function)
+    {
+        try {
+            function();
+        }
+        catch (std::exception&) {
+            return true;
+        }
+        return false;
+    }
+
+    class ImageFormatTest : public ::testing::Test {
+    protected:
+        static raw_image_header ParsePnm(const std::string& data)
+        {
+            return parse_pnm_header(data.data(), data.size(), "test.pnm");
+        }
+
+        static raw_image_header ParseQoi(const std::string& data)
+        {
+            return parse_qoi_header(data.data(), data.size(), "test.qoi");
+        }
+
+        static std::string MakeQoiHeader(uint32_t width, uint32_t height, int channels)
+        {
+            std::string header = "qoif";
+            for (const uint32_t value : { width, height }) {
+                for (int shift = 24; shift >= 0; shift -= 8) {
+                    header += static_cast<char>((value >> shift) & 0xff);
+                }
+            }
+            header += static_cast<char>(channels);
+            header += '\0'; // colorspace
+            return header;
+        }
+    };
+
+    TEST_F(ImageFormatTest, ParsesPnmHeaders) {
+        const std::string pgm_header = "P5\n# a comment\n2 3\n255\n";
+        const raw_image_header pgm = ParsePnm(pgm_header + std::string(6, 'x'));
+        EXPECT_EQ(pgm.width, 2);
+        EXPECT_EQ(pgm.height, 3);
+        EXPECT_EQ(pgm.channels, 1);
+        EXPECT_EQ(pgm.data_offset, pgm_header.size());
+
+        const std::string ppm_header = "P6 4 1 255 ";
+        const raw_image_header ppm = ParsePnm(ppm_header + std::string(12, 'x'));
+        EXPECT_EQ(ppm.width, 4);
+        EXPECT_EQ(ppm.height, 1);
+        EXPECT_EQ(ppm.channels, 3);
+        EXPECT_EQ(ppm.data_offset, ppm_header.size());
+    }
+
+    TEST_F(ImageFormatTest, RejectsMalformedPnmHeaders) {
+        EXPECT_TRUE(Throws([]() { ParsePnm("P4\n2 3\n255\n" + std::string(6, 'x')); }));
+        EXPECT_TRUE(Throws([]() { ParsePnm("P5\n2 3\n"); }));
+        EXPECT_TRUE(Throws([]() { ParsePnm("P5\n2 x\n255\n" + std::string(6, 'x')); }));
+        EXPECT_TRUE(Throws([]() { ParsePnm("P5\n2 3\n65535\n" + std::string(12, 'x')); }));
+        EXPECT_TRUE(Throws([]() { ParsePnm("P5\n0 3\n255\n"); }));
+        EXPECT_TRUE(Throws([]() { ParsePnm("P5\n2 3\n255"); }));
+        EXPECT_TRUE(Throws([]() { ParsePnm("P5\n2 3\n255\n" + std::string(5, 'x')); }));
+        EXPECT_TRUE(Throws([]() { ParsePnm("P5\n99999999999999999999 3\n255\n"); }));
+        EXPECT_TRUE(Throws([]() { ParsePnm("P5\n2147483647 2147483647\n255\n"); }));
+    }
+
+    TEST_F(ImageFormatTest, ParsesQoiHeaders) {
+        const raw_image_header qoi = ParseQoi(MakeQoiHeader(640, 480, 4));
+        EXPECT_EQ(qoi.width, 640);
+        EXPECT_EQ(qoi.height, 480);
+        EXPECT_EQ(qoi.channels, 4);
+        EXPECT_EQ(qoi.data_offset, static_cast<size_t>(14));
+    }
+
+    TEST_F(ImageFormatTest, RejectsMalformedQoiHeaders) {
+        EXPECT_TRUE(Throws([]() { ParseQoi("qoix" + MakeQoiHeader(2, 2, 3).substr(4)); }));
+        EXPECT_TRUE(Throws([]() { ParseQoi(MakeQoiHeader(2, 2, 3).substr(0, 10)); }));
+        EXPECT_TRUE(Throws([]() { ParseQoi(MakeQoiHeader(2, 2, 5)); }));
+        EXPECT_TRUE(Throws([]() { ParseQoi(MakeQoiHeader(0, 2, 3)); }));
+        EXPECT_TRUE(Throws([]() { ParseQoi(MakeQoiHeader(0x10000, 0x10000, 3)); }));
+    }
+
+    class TarTest : public ::testing::Test {
+    protected:
+        virtual void TearDown() {
+            for (const std::string& filename : filenames) {
+                std::remove(filename.c_str());
+                std::remove((filename + ".annoindex").c_str());
+            }
+        }
+
+        static void AppendMember(std::string& archive, const std::string& name, const std::string& content, char type = '0', uint64_t modification_time = 0)
+        {
+            std::string header(512, '\0');
+            std::copy(name.begin(), name.end(), header.begin());
+            char number[13];
+            std::snprintf(number, sizeof(number), "%011llo", static_cast<unsigned long long>(content.size()));
+            std::copy(number, number + 11, header.begin() + 124);
+            std::snprintf(number, sizeof(number), "%011llo", static_cast<unsigned long long>(modification_time));
+            std::copy(number, number + 11, header.begin() + 136);
+            header[156] = type;
+            std::copy_n("ustar", 6, header.begin() + 257);
+            std::copy_n("00", 2, header.begin() + 263);
+
+            archive += header;
+            archive += content;
+            archive += std::string((512 - content.size() % 512) % 512, '\0');
+        }
+
+        static void AppendEnd(std::string& archive)
+        {
+            archive += std::string(1024, '\0');
+        }
+
+        // Each test uses its own file, so that no cached index of another test gets picked up
+        std::string Write(const std::string& name, const std::string& archive)
+        {
+            const std::string filename = "annonet_test_" + name + ".tar";
+            std::ofstream(filename, std::ios::binary).write(archive.data(), archive.size());
+            filenames.push_back(filename);
+            return filename;
+        }
+
+        std::vector<std::string> filenames;
+    };
+
+    TEST_F(TarTest, IndexesMembers) {
+        std::string archive;
+        AppendMember(archive, "a.txt", "hello", '0', 1000);
+        AppendMember(archive, "./dir/b.txt", std::string(600, 'b'), '0', 2000);
+        AppendEnd(archive);
+
+        const tar_archive tar(Write("members", archive));
+
+        EXPECT_EQ(tar.get_member_names().size(), static_cast<size_t>(2));
+        EXPECT_TRUE(tar.contains("a.txt"));
+        EXPECT_TRUE(tar.contains("dir/b.txt"));
+        EXPECT_TRUE(!tar.contains("c.txt"));
+
+        const auto data = tar.get_member_data("a.txt");
+        EXPECT_EQ(std::string(data.first, data.second), "hello");
+
+        uint64_t offset = 0, size = 0;
+        int64_t modification_time = 0;
+        tar.get_member_stamp("dir/b.txt", offset, size, modification_time);
+        EXPECT_EQ(offset, static_cast<uint64_t>(3 * 512));
+        EXPECT_EQ(size, static_cast<uint64_t>(600));
+        EXPECT_EQ(modification_time, 2000);
+
+        EXPECT_TRUE(Throws([&tar]() { tar.get_member_data("c.txt"); }));
+    }
+
+    TEST_F(TarTest, UsesLongNamesAndLaterCopies) {
+        std::string archive;
+        AppendMember(archive, "", "22 path=long/name.png\n", 'x');
+        AppendMember(archive, "short.png", "first");
+        AppendMember(archive, "././@LongLink", "gnu/name.png", 'L');
+        AppendMember(archive, "short2.png", "second");
+        AppendMember(archive, "long/name.png", "third");
+        AppendEnd(archive);
+
+        const tar_archive tar(Write("long_names", archive));
+
+        EXPECT_EQ(tar.get_member_names().size(), static_cast<size_t>(2));
+        EXPECT_TRUE(!tar.contains("short.png"));
+        EXPECT_TRUE(!tar.contains("short2.png"));
+
+        const auto data = tar.get_member_data("long/name.png");
+        EXPECT_EQ(std::string(data.first, data.second), "third");
+        EXPECT_TRUE(tar.contains("gnu/name.png"));
+    }
+
+    TEST_F(TarTest, RejectsMalformedArchives) {
+        std::string truncated;
+        AppendMember(truncated, "a.txt", std::string(1000, 'a'));
+        truncated.resize(1024);
+        const std::string truncated_filename = Write("truncated", truncated);
+        EXPECT_TRUE(Throws([&truncated_filename]() { tar_archive tar(truncated_filename); }));
+
+        std::string bad_pax;
+        AppendMember(bad_pax, "", "99 path=x\n", 'x');
+        AppendMember(bad_pax, "a.txt", "a");
+        AppendEnd(bad_pax);
+        const std::string bad_pax_filename = Write("bad_pax", bad_pax);
+        EXPECT_TRUE(Throws([&bad_pax_filename]() { tar_archive tar(bad_pax_filename); }));
+    }
+
+    class ClassRemapTest : public ::testing::Test {
+    };
+
+    TEST_F(ClassRemapTest, ParsesRemaps) {
+        const auto remap = parse_class_remap({ "2:1", "3:0" });
+        EXPECT_EQ(remap.size(), static_cast<size_t>(2));
+        EXPECT_EQ(remap[0].first, 2);
+        EXPECT_EQ(remap[0].second, 1);
+        EXPECT_EQ(remap[1].first, 3);
+        EXPECT_EQ(remap[1].second, 0);
+
+        EXPECT_TRUE(parse_class_remap({}).empty());
+    }
+
+    TEST_F(ClassRemapTest, RejectsMalformedRemaps) {
+        EXPECT_TRUE(Throws([]() { parse_class_remap({ "2" }); }));
+        EXPECT_TRUE(Throws([]() { parse_class_remap({ "a:b" }); }));
+        EXPECT_TRUE(Throws([]() { parse_class_remap({ "2:" }); }));
+        EXPECT_TRUE(Throws([]() { parse_class_remap({ ":1" }); }));
+        EXPECT_TRUE(Throws([]() { parse_class_remap({ "70000:1" }); }));
+        EXPECT_TRUE(Throws([]() { parse_class_remap({ "-1:0" }); }));
+    }
+
 }  // namespace
 
 int main(int argc, char **argv) {